@@ -0,0 +1,1375 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include "aln_file.h"
+
+/*
+ * Binary file: BGZF compressed, with
+ *   magic "\211BNA", u32 version, u32 chrom count,
+ *   then for each chrom: u32 name length, name, i32 size;
+ * and then records, each as
+ *   u32 length of the rest, fixed-width core (see ALN_CORE_SIZE),
+ *   query name, match types packed as 4-bit codes,
+ *   and varint coded reference/query interval sizes.
+ * All integers are little-endian.
+ */
+
+#define ALN_MAGIC "\211BNA"
+#define ALN_VERSION 2
+#define ALN_CORE_SIZE 70
+
+#define INDEX_FILE_EXT ".bni"
+#define INDEX_FORMAT "BNIv0.1"
+
+int parse_aln_format(const char *s)
+{
+	if (strcmp(s, "txt") == 0) {
+		return ALN_FORMAT_TXT;
+	} else if (strcmp(s, "bin") == 0) {
+		return ALN_FORMAT_BIN;
+	} else if (strcmp(s, "xmap") == 0) {
+		return ALN_FORMAT_XMAP;
+	} else {
+		return ALN_FORMAT_UNKNOWN;
+	}
+}
+
+void aln_header_init(struct aln_header *h)
+{
+	array_init(h->chroms);
+}
+
+void aln_header_free(struct aln_header *h)
+{
+	array_free(h->chroms);
+}
+
+int aln_header_add_chrom(struct aln_header *h, const char *name, int size)
+{
+	struct aln_chrom *c;
+
+	if (array_reserve(h->chroms, h->chroms.size + 1)) {
+		return -ENOMEM;
+	}
+	c = &h->chroms.data[h->chroms.size++];
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	c->size = size;
+	return 0;
+}
+
+int aln_header_find_chrom(const struct aln_header *h, const char *name)
+{
+	size_t i;
+	for (i = 0; i < h->chroms.size; ++i) {
+		if (strcmp(h->chroms.data[i].name, name) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+void alignment_init(struct alignment *a)
+{
+	memset(a, 0, sizeof(struct alignment));
+}
+
+void alignment_free(struct alignment *a)
+{
+	array_free(a->types);
+	array_free(a->rsizes);
+	array_free(a->qsizes);
+}
+
+void aln_index_init(struct aln_index *index)
+{
+	array_init(index->items);
+	array_init(index->spans);
+}
+
+void aln_index_free(struct aln_index *index)
+{
+	array_free(index->items);
+	array_free(index->spans);
+}
+
+void aln_index_filename(const char *filename, char *buf, size_t bufsize)
+{
+	snprintf(buf, bufsize, "%s%s", filename, INDEX_FILE_EXT);
+}
+
+static inline int string_ends_with(const char *s, const char *suffix)
+{
+	size_t n = strlen(s), m = strlen(suffix);
+	return (n > m && strcmp(s + n - m, suffix) == 0);
+}
+
+static struct aln_file *aln_file_new(const char *filename, int format, int writing)
+{
+	struct aln_file *fp;
+
+	fp = malloc(sizeof(struct aln_file));
+	if (!fp) {
+		return NULL;
+	}
+	memset(fp, 0, sizeof(struct aln_file));
+	fp->name = filename;
+	fp->format = format;
+	fp->writing = writing;
+	aln_header_init(&fp->header);
+	aln_index_init(&fp->index);
+	array_init(fp->buf);
+	return fp;
+}
+
+static void aln_file_delete(struct aln_file *fp)
+{
+	if (fp->text) {
+		gzclose(fp->text);
+	}
+	file_close(fp->fp);
+	array_free(fp->buf);
+	aln_index_free(&fp->index);
+	aln_header_free(&fp->header);
+	free(fp);
+}
+
+/* buffer of encoded bytes */
+
+static inline int put_bytes(struct aln_file *fp, const void *data, size_t size)
+{
+	if (array_reserve(fp->buf, fp->buf.size + size)) {
+		return -ENOMEM;
+	}
+	memcpy(fp->buf.data + fp->buf.size, data, size);
+	fp->buf.size += size;
+	return 0;
+}
+
+static inline int put_u32(struct aln_file *fp, uint32_t value)
+{
+	unsigned char p[4];
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+	return put_bytes(fp, p, sizeof(p));
+}
+
+static inline int put_u64(struct aln_file *fp, uint64_t value)
+{
+	return put_u32(fp, value & 0xffffffff) || put_u32(fp, value >> 32);
+}
+
+static inline int put_varint(struct aln_file *fp, uint32_t value)
+{
+	unsigned char p[5];
+	size_t n = 0;
+	while (value >= 0x80) {
+		p[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[n++] = value;
+	return put_bytes(fp, p, n);
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static inline int get_varint(const unsigned char **p, const unsigned char *end, int *value)
+{
+	uint32_t v = 0;
+	int shift = 0;
+	while (*p < end && shift < 32) {
+		unsigned char c = *(*p)++;
+		v |= (uint32_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*value = (int)v;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* text format */
+
+static int append_text(struct aln_file *fp, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int append_text(struct aln_file *fp, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (array_reserve(fp->buf, fp->buf.size + 64)) {
+		return -ENOMEM;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(fp->buf.data + fp->buf.size, fp->buf.capacity - fp->buf.size, fmt, ap);
+	va_end(ap);
+	if ((size_t)n >= fp->buf.capacity - fp->buf.size) {
+		if (array_reserve(fp->buf, fp->buf.size + n + 1)) {
+			return -ENOMEM;
+		}
+		va_start(ap, fmt);
+		vsnprintf(fp->buf.data + fp->buf.size, fp->buf.capacity - fp->buf.size, fmt, ap);
+		va_end(ap);
+	}
+	fp->buf.size += n;
+	return 0;
+}
+
+/* text records are buffered, and written by blocks */
+static int flush_text(struct aln_file *fp)
+{
+	int ret = 0;
+
+	if (fp->buf.size == 0) {
+		return 0;
+	}
+	if (fp->bin) {
+		ret = bgzf_write(fp->bin, fp->buf.data, fp->buf.size);
+	} else if (gzwrite(fp->text, fp->buf.data, fp->buf.size) != (int)fp->buf.size) {
+		fprintf(stderr, "Error: Failed to write file '%s'\n", fp->name);
+		ret = -EIO;
+	}
+	fp->buf.size = 0;
+	return ret;
+}
+
+#define TEXT_CHROM_PREFIX "##chrom="
+
+/* chroms of reference in order, with their sizes, ahead of column names */
+static int write_text_header(struct aln_file *fp)
+{
+	size_t i;
+
+	for (i = 0; i < fp->header.chroms.size; ++i) {
+		const struct aln_chrom *c = &fp->header.chroms.data[i];
+		if (append_text(fp, TEXT_CHROM_PREFIX "%s\t%d\n", c->name, c->size)) {
+			return -ENOMEM;
+		}
+	}
+	return append_text(fp, "#name\tchrom\tpos\tstrand\tsize\tlabels\t"
+			"qsize\tqlabels\trstart\trend\tqstart\tqend\tmissing\textra\talignment\n");
+}
+
+static int write_text(struct aln_file *fp, const struct alignment *a)
+{
+	size_t i, j, k;
+	int n;
+
+	if (append_text(fp, "%s\t%s\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t",
+				a->name, fp->header.chroms.data[a->chrom].name, a->pos,
+				(a->direct > 0 ? "+" : "-"), a->size, a->labels, a->qsize, a->qlabels,
+				a->rstart, a->rend, a->qstart, a->qend, a->missing, a->extra)) {
+		return -ENOMEM;
+	}
+	for (i = 0, j = 0, k = 0; i < a->types.size; ++i) {
+		for (n = 0; n < match_ref_intervals(a->types.data[i]); ++n) {
+			if (append_text(fp, (n > 0 ? "+%d" : (i > 0 ? "|%d" : "%d")),
+						a->rsizes.data[j++])) {
+				return -ENOMEM;
+			}
+		}
+		for (n = 0; n < match_qry_intervals(a->types.data[i]); ++n) {
+			if (append_text(fp, (n > 0 ? "+%d" : ":%d"), a->qsizes.data[k++])) {
+				return -ENOMEM;
+			}
+		}
+	}
+	if (append_text(fp, "\n")) {
+		return -ENOMEM;
+	}
+	return (fp->buf.size >= BGZF_BLOCK_SIZE ? flush_text(fp) : 0);
+}
+
+/*
+ * XMAP format (version 0.2), with ids of query and reference taken from
+ * their names if numeric, or their ordinals (from 1) otherwise.
+ * Confidence is -log10 of the chance to match all aligned intervals at
+ * random, as the product over matched interval(s) of
+ *   min(1, 2 * max(|ref_size - qry_size|, XMAP_RESOLUTION) / max(ref_size, qry_size))
+ */
+
+#define XMAP_RESOLUTION 500
+
+static int write_xmap_header(struct aln_file *fp)
+{
+	return append_text(fp, "# XMAP File Version:\t0.2\n"
+			"# Label Channels:\t1\n"
+			"#h XmapEntryID\tQryContigID\tRefContigID\tQryStartPos\tQryEndPos\t"
+			"RefStartPos\tRefEndPos\tOrientation\tConfidence\tHitEnum\t"
+			"QryLen\tRefLen\tLabelChannel\tAlignment\n"
+			"#f int\tint\tint\tfloat\tfloat\tfloat\tfloat\tstring\tfloat\tstring\t"
+			"float\tfloat\tint\tstring\n");
+}
+
+static int is_number(const char *s)
+{
+	if (!*s) return 0;
+	for (; *s; ++s) {
+		if (*s < '0' || *s > '9') return 0;
+	}
+	return 1;
+}
+
+static double xmap_confidence(const struct alignment *a)
+{
+	double score = 0;
+	size_t i, j, k;
+	int n, rsize, qsize, diff;
+
+	for (i = 0, j = 0, k = 0; i < a->types.size; ++i) {
+		for (n = 0, rsize = 0; n < match_ref_intervals(a->types.data[i]); ++n) {
+			rsize += a->rsizes.data[j++];
+		}
+		for (n = 0, qsize = 0; n < match_qry_intervals(a->types.data[i]); ++n) {
+			qsize += a->qsizes.data[k++];
+		}
+		diff = abs(rsize - qsize);
+		if (diff < XMAP_RESOLUTION) {
+			diff = XMAP_RESOLUTION;
+		}
+		if (2 * diff < (rsize > qsize ? rsize : qsize)) {
+			score -= log10(2.0 * diff / (rsize > qsize ? rsize : qsize));
+		}
+	}
+	return score;
+}
+
+static int append_ops(struct aln_file *fp, char op, int n, char *last, int *count)
+{
+	for (; n > 0; --n) {
+		if (op != *last && *count > 0) {
+			if (append_text(fp, "%d%c", *count, *last)) {
+				return -ENOMEM;
+			}
+			*count = 0;
+		}
+		*last = op;
+		++*count;
+	}
+	return 0;
+}
+
+/*
+ * Each label is 'M' (matched), 'D' (missing in query) or 'I' (extra in
+ * query), in reference order. A match is 'D'/'I' labels then 'M', and the
+ * whole string for strand '-' is the same as going through matches reversely.
+ */
+static int append_hit_enum(struct aln_file *fp, const struct alignment *a)
+{
+	size_t i, m;
+	char last = 0;
+	int type, count = 0;
+
+	if (append_ops(fp, 'M', 1, &last, &count)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < a->types.size; ++i) {
+		m = (a->direct > 0 ? i : a->types.size - 1 - i);
+		type = a->types.data[m];
+		if (append_ops(fp, 'D', match_ref_intervals(type) - 1, &last, &count)
+				|| append_ops(fp, 'I', match_qry_intervals(type) - 1, &last, &count)
+				|| append_ops(fp, 'M', 1, &last, &count)) {
+			return -ENOMEM;
+		}
+	}
+	return append_text(fp, "%d%c", count, last);
+}
+
+/* pairs of matched labels (ref_id,qry_id), in reference order */
+static int append_label_pairs(struct aln_file *fp, const struct alignment *a)
+{
+	size_t i;
+	int j, k;
+
+	if (a->direct > 0) {
+		if (append_text(fp, "(%d,%d)", a->rstart, a->qstart)) {
+			return -ENOMEM;
+		}
+		for (i = 0, j = 0, k = 0; i < a->types.size; ++i) {
+			j += match_ref_intervals(a->types.data[i]);
+			k += match_qry_intervals(a->types.data[i]);
+			if (append_text(fp, "(%d,%d)", a->rstart + j, a->qstart + k)) {
+				return -ENOMEM;
+			}
+		}
+	} else {
+		j = a->labels - 1;
+		k = a->qlabels - 1;
+		if (append_text(fp, "(%d,%d)", a->rstart - j, a->qstart + k)) {
+			return -ENOMEM;
+		}
+		for (i = a->types.size; i > 0; --i) {
+			j -= match_ref_intervals(a->types.data[i - 1]);
+			k -= match_qry_intervals(a->types.data[i - 1]);
+			if (append_text(fp, "(%d,%d)", a->rstart - j, a->qstart + k)) {
+				return -ENOMEM;
+			}
+		}
+	}
+	return 0;
+}
+
+static int write_xmap(struct aln_file *fp, const struct alignment *a)
+{
+	const struct aln_chrom *c = &fp->header.chroms.data[a->chrom];
+	int qbegin = (a->direct > 0 ? a->qpos : a->qpos + a->qsize);
+	int qend = (a->direct > 0 ? a->qpos + a->qsize : a->qpos);
+
+	if (append_text(fp, "%llu\t", (unsigned long long)fp->count + 1)
+			|| (is_number(a->name) ? append_text(fp, "%s\t", a->name)
+				: append_text(fp, "%llu\t", (unsigned long long)a->qid + 1))
+			|| (is_number(c->name) ? append_text(fp, "%s\t", c->name)
+				: append_text(fp, "%d\t", a->chrom + 1))
+			|| append_text(fp, "%.1f\t%.1f\t%.1f\t%.1f\t%s\t%.2f\t",
+				(double)qbegin, (double)qend, (double)a->pos, (double)(a->pos + a->size),
+				(a->direct > 0 ? "+" : "-"), xmap_confidence(a))
+			|| append_hit_enum(fp, a)
+			|| append_text(fp, "\t%.1f\t%.1f\t1\t", (double)a->qlen, (double)c->size)
+			|| append_label_pairs(fp, a)
+			|| append_text(fp, "\n")) {
+		return -ENOMEM;
+	}
+	return (fp->buf.size >= BGZF_BLOCK_SIZE ? flush_text(fp) : 0);
+}
+
+static int match_type(int rcount, int qcount)
+{
+	if (rcount == 1 && qcount == 1) {
+		return MATCH_EXACT;
+	} else if (qcount == 1) {
+		return (rcount == 2 ? MATCH_MISSING : (rcount == 3 ? MATCH_MISSING2 : 0));
+	} else if (rcount == 1) {
+		return (qcount == 2 ? MATCH_EXTRA : (qcount == 3 ? MATCH_EXTRA2 : 0));
+	} else {
+		return 0;
+	}
+}
+
+static int read_sizes(struct file *fp, int *sizes, int *count, int *next)
+{
+	int c;
+
+	*count = 0;
+	do {
+		if (*count >= 3 || read_integer(fp, &sizes[*count])) {
+			return -1;
+		}
+		++*count;
+	} while ((c = gzgetc(fp->file)) == '+');
+	*next = c;
+	return 0;
+}
+
+/*
+ * Chroms in header lines of text, if any, as written by 'map' to keep
+ * reference order; other chroms are added as they are first read.
+ */
+static int read_text_header(struct aln_file *fp)
+{
+	struct file *file = fp->fp;
+	char buf[MAX_FRAGMENT_NAME_SIZE + 64];
+	size_t n = strlen(TEXT_CHROM_PREFIX);
+	char *name, *p;
+	int size;
+
+	while (current_char(file) == '#') {
+		if (read_line(file, buf, sizeof(buf))) {
+			break;
+		}
+		if (strncmp(buf, TEXT_CHROM_PREFIX, n) == 0) {
+			name = buf + n;
+			p = strchr(name, '\t');
+			if (!p || !strchr(p, '\n') || p - name > MAX_FRAGMENT_NAME_SIZE
+					|| sscanf(p + 1, "%d", &size) != 1 || size < 0) {
+				fprintf(stderr, "Error: Invalid chrom header line in file '%s'\n", fp->name);
+				return -EINVAL;
+			}
+			*p = '\0';
+			if (aln_header_find_chrom(&fp->header, name) < 0
+					&& aln_header_add_chrom(&fp->header, name, size)) {
+				return -ENOMEM;
+			}
+		} else {
+			skip_to_next_line(file, buf, sizeof(buf));
+		}
+	}
+	return 0;
+}
+
+static int read_text(struct aln_file *fp, struct alignment *a)
+{
+	struct file *file = fp->fp;
+	char chrom[sizeof(fp->header.chroms.data[0].name)];
+	char strand[4];
+	int rsizes[3], qsizes[3];
+	int c, i, rcount, qcount, type;
+
+	while ((c = gzgetc(file->file)) == '#') {
+		skip_current_line(file);
+	}
+	if (c == EOF) {
+		return -1;
+	}
+	gzungetc(c, file->file);
+
+	if (read_string(file, a->name, sizeof(a->name))) {
+		return -1;
+	}
+	if (read_string(file, chrom, sizeof(chrom))
+			|| read_integer(file, &a->pos)
+			|| read_string(file, strand, sizeof(strand))
+			|| read_integer(file, &a->size)
+			|| read_integer(file, &a->labels)
+			|| read_integer(file, &a->qsize)
+			|| read_integer(file, &a->qlabels)
+			|| read_integer(file, &a->rstart)
+			|| read_integer(file, &a->rend)
+			|| read_integer(file, &a->qstart)
+			|| read_integer(file, &a->qend)
+			|| read_integer(file, &a->missing)
+			|| read_integer(file, &a->extra)) {
+		file_error(file, "Failed to read alignment columns");
+		return -EINVAL;
+	}
+	if (strcmp(strand, "+") != 0 && strcmp(strand, "-") != 0) {
+		file_error(file, "Unknown strand text '%s'", strand);
+		return -EINVAL;
+	}
+	a->direct = (strand[0] == '+' ? 1 : -1);
+	a->qpos = 0;  /* not in text */
+	a->qlen = 0;
+
+	a->chrom = aln_header_find_chrom(&fp->header, chrom);
+	if (a->chrom < 0) {
+		if (aln_header_add_chrom(&fp->header, chrom, 0)) {
+			return -ENOMEM;
+		}
+		a->chrom = fp->header.chroms.size - 1;
+	}
+
+	a->types.size = 0;
+	a->rsizes.size = 0;
+	a->qsizes.size = 0;
+	skip_spaces(file);
+	do {
+		if (read_sizes(file, rsizes, &rcount, &c) || c != ':'
+				|| read_sizes(file, qsizes, &qcount, &c)
+				|| (type = match_type(rcount, qcount)) == 0) {
+			file_error(file, "Invalid alignment string");
+			return -EINVAL;
+		}
+		if (array_reserve(a->types, a->types.size + 1)
+				|| array_reserve(a->rsizes, a->rsizes.size + rcount)
+				|| array_reserve(a->qsizes, a->qsizes.size + qcount)) {
+			return -ENOMEM;
+		}
+		a->types.data[a->types.size++] = type;
+		for (i = 0; i < rcount; ++i) {
+			a->rsizes.data[a->rsizes.size++] = rsizes[i];
+		}
+		for (i = 0; i < qcount; ++i) {
+			a->qsizes.data[a->qsizes.size++] = qsizes[i];
+		}
+	} while (c == '|');
+
+	if (c == '\n') {
+		++file->line;
+	} else if (c != EOF) {
+		skip_current_line(file);
+	}
+	return 0;
+}
+
+/* binary format */
+
+static int write_bin_header(struct aln_file *fp)
+{
+	size_t i, len;
+
+	fp->buf.size = 0;
+	if (put_bytes(fp, ALN_MAGIC, 4)
+			|| put_u32(fp, ALN_VERSION)
+			|| put_u32(fp, fp->header.chroms.size)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < fp->header.chroms.size; ++i) {
+		const struct aln_chrom *c = &fp->header.chroms.data[i];
+		len = strlen(c->name);
+		if (put_u32(fp, len) || put_bytes(fp, c->name, len) || put_u32(fp, c->size)) {
+			return -ENOMEM;
+		}
+	}
+	return bgzf_write(fp->bin, fp->buf.data, fp->buf.size);
+}
+
+static int add_index_item(struct aln_index *index, const struct alignment *a, int64_t offset)
+{
+	struct aln_index_item *item;
+	size_t n = index->items.size;
+
+	if (n == index->items.capacity && array_reserve(index->items, n + n / 2 + 1)) {
+		return -ENOMEM;  /* grown by half, as it could be large */
+	}
+	item = &index->items.data[index->items.size++];
+	item->chrom = a->chrom;
+	item->pos = a->pos;
+	item->end = a->pos + a->size;
+	item->offset = offset;
+	return 0;
+}
+
+static int write_bin(struct aln_file *fp, const struct alignment *a)
+{
+	size_t i, len = strlen(a->name);
+	int32_t core[14] = { a->chrom, a->pos, a->size, a->labels, a->qsize, a->qlabels,
+		a->rstart, a->rend, a->qstart, a->qend, a->missing, a->extra, a->qpos, a->qlen };
+	unsigned char flags[2] = { (a->direct > 0 ? 0 : 1), len };
+
+	fp->buf.size = 0;
+	if (put_u32(fp, 0) || put_u64(fp, a->qid)) {  /* length, filled later */
+		return -ENOMEM;
+	}
+	for (i = 0; i < sizeof(core) / sizeof(core[0]); ++i) {
+		if (put_u32(fp, core[i])) {
+			return -ENOMEM;
+		}
+	}
+	if (put_u32(fp, a->types.size) || put_bytes(fp, flags, sizeof(flags))) {
+		return -ENOMEM;
+	}
+	assert(fp->buf.size == 4 + ALN_CORE_SIZE);
+
+	if (put_bytes(fp, a->name, len)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < a->types.size; i += 2) {
+		unsigned char c = a->types.data[i];
+		if (i + 1 < a->types.size) {
+			c |= a->types.data[i + 1] << 4;
+		}
+		if (put_bytes(fp, &c, 1)) {
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < a->rsizes.size; ++i) {
+		if (put_varint(fp, a->rsizes.data[i])) {
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < a->qsizes.size; ++i) {
+		if (put_varint(fp, a->qsizes.data[i])) {
+			return -ENOMEM;
+		}
+	}
+
+	len = fp->buf.size - 4;
+	fp->buf.data[0] = len & 0xff;
+	fp->buf.data[1] = (len >> 8) & 0xff;
+	fp->buf.data[2] = (len >> 16) & 0xff;
+	fp->buf.data[3] = (len >> 24) & 0xff;
+
+	if (fp->indexing) {
+		if (add_index_item(&fp->index, a, bgzf_tell(fp->bin))) {
+			return -ENOMEM;
+		}
+	}
+	return bgzf_write(fp->bin, fp->buf.data, fp->buf.size);
+}
+
+/* 0 if all read, 1 if none at the end of file, or -EIO if read in part */
+static int read_bytes(struct aln_file *fp, void *buf, size_t size)
+{
+	ssize_t n;
+
+	if (fp->bin) {
+		n = bgzf_read(fp->bin, buf, size);
+	} else {
+		n = gzread(fp->fp->file, buf, size);
+	}
+	if (n == (ssize_t)size) {
+		return 0;
+	} else if (n == 0) {
+		return 1;
+	} else {
+		fprintf(stderr, "Error: Failed to read file '%s', or it is truncated\n", fp->name);
+		return -EIO;
+	}
+}
+
+static int read_bin_header(struct aln_file *fp)
+{
+	unsigned char p[8];
+	char name[sizeof(fp->header.chroms.data[0].name)];
+	uint32_t i, count, len;
+	int ret;
+
+	if ((ret = read_bytes(fp, p, 8)) < 0) {
+		return ret;
+	}
+	if (ret > 0 || memcmp(p, ALN_MAGIC, 4) != 0) {
+		fprintf(stderr, "Error: Invalid binary alignment file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	if (get_u32(p + 4) != ALN_VERSION) {
+		fprintf(stderr, "Error: Unsupported version %u of file '%s'\n", get_u32(p + 4), fp->name);
+		return -EINVAL;
+	}
+	if (read_bytes(fp, p, 4)) {
+		goto truncated;
+	}
+	count = get_u32(p);
+	for (i = 0; i < count; ++i) {
+		if (read_bytes(fp, p, 4)) {
+			goto truncated;
+		}
+		len = get_u32(p);
+		if (len >= sizeof(name)) {
+			fprintf(stderr, "Error: Too long chrom name in file '%s'\n", fp->name);
+			return -EINVAL;
+		}
+		if (read_bytes(fp, name, len) || read_bytes(fp, p, 4)) {
+			goto truncated;
+		}
+		name[len] = '\0';
+		if (aln_header_add_chrom(&fp->header, name, (int32_t)get_u32(p))) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+
+truncated:
+	fprintf(stderr, "Error: Incomplete header of file '%s'\n", fp->name);
+	return -EINVAL;
+}
+
+static int read_bin(struct aln_file *fp, struct alignment *a)
+{
+	const unsigned char *p, *end;
+	unsigned char head[4];
+	uint32_t i, len, count;
+	int32_t core[14];
+	int value, ret;
+
+	if ((ret = read_bytes(fp, head, sizeof(head))) != 0) {
+		return (ret > 0 ? -1 : ret);  /* -1 for end of file */
+	}
+	len = get_u32(head);
+	if (len < ALN_CORE_SIZE) {
+		goto invalid;
+	}
+	fp->buf.size = 0;
+	if (array_reserve(fp->buf, len)) {
+		return -ENOMEM;
+	}
+	if ((ret = read_bytes(fp, fp->buf.data, len)) != 0) {
+		if (ret > 0) {
+			fprintf(stderr, "Error: Truncated record in file '%s'\n", fp->name);
+			return -EIO;
+		}
+		return ret;
+	}
+	p = (const unsigned char *)fp->buf.data;
+	end = p + len;
+
+	a->qid = get_u64(p);
+	for (i = 0; i < 14; ++i) {
+		core[i] = (int32_t)get_u32(p + 8 + i * 4);
+	}
+	a->chrom = core[0];
+	a->pos = core[1];
+	a->size = core[2];
+	a->labels = core[3];
+	a->qsize = core[4];
+	a->qlabels = core[5];
+	a->rstart = core[6];
+	a->rend = core[7];
+	a->qstart = core[8];
+	a->qend = core[9];
+	a->missing = core[10];
+	a->extra = core[11];
+	a->qpos = core[12];
+	a->qlen = core[13];
+	count = get_u32(p + 64);
+	a->direct = (p[68] ? -1 : 1);
+	len = p[69];
+	p += ALN_CORE_SIZE;
+
+	if (a->chrom < 0 || (size_t)a->chrom >= fp->header.chroms.size
+			|| len >= sizeof(a->name) || p + len + (count + 1) / 2 > end) {
+		goto invalid;
+	}
+	memcpy(a->name, p, len);
+	a->name[len] = '\0';
+	p += len;
+
+	a->types.size = 0;
+	a->rsizes.size = 0;
+	a->qsizes.size = 0;
+	if (array_reserve(a->types, count)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; ++i) {
+		a->types.data[i] = (i % 2 == 0 ? (p[i / 2] & 0xf) : (p[i / 2] >> 4));
+		if (a->types.data[i] < MATCH_EXACT || a->types.data[i] > MATCH_EXTRA2) {
+			goto invalid;
+		}
+		a->rsizes.size += match_ref_intervals(a->types.data[i]);
+		a->qsizes.size += match_qry_intervals(a->types.data[i]);
+	}
+	a->types.size = count;
+	p += (count + 1) / 2;
+
+	count = a->rsizes.size;
+	a->rsizes.size = 0;
+	if (array_reserve(a->rsizes, count)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; ++i) {
+		if (get_varint(&p, end, &value)) goto invalid;
+		a->rsizes.data[i] = value;
+	}
+	a->rsizes.size = count;
+
+	count = a->qsizes.size;
+	a->qsizes.size = 0;
+	if (array_reserve(a->qsizes, count)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; ++i) {
+		if (get_varint(&p, end, &value)) goto invalid;
+		a->qsizes.data[i] = value;
+	}
+	a->qsizes.size = count;
+	return 0;
+
+invalid:
+	fprintf(stderr, "Error: Invalid alignment record in file '%s'\n", fp->name);
+	return -EINVAL;
+}
+
+/* index */
+
+static int compare_index_item(const void *a, const void *b)
+{
+	const struct aln_index_item *x = a;
+	const struct aln_index_item *y = b;
+
+	if (x->chrom != y->chrom) {
+		return (x->chrom < y->chrom ? -1 : 1);
+	} else if (x->pos != y->pos) {
+		return (x->pos < y->pos ? -1 : 1);
+	} else if (x->offset != y->offset) {
+		return (x->offset < y->offset ? -1 : 1);
+	} else {
+		return 0;
+	}
+}
+
+static int index_finish(struct aln_index *index, size_t chrom_count)
+{
+	size_t i;
+
+	qsort(index->items.data, index->items.size,
+			sizeof(index->items.data[0]), compare_index_item);
+
+	if (array_reserve(index->spans, chrom_count)) {
+		return -ENOMEM;
+	}
+	index->spans.size = chrom_count;
+	memset(index->spans.data, 0, sizeof(index->spans.data[0]) * chrom_count);
+	for (i = 0; i < index->items.size; ++i) {
+		const struct aln_index_item *item = &index->items.data[i];
+		if (index->spans.data[item->chrom] < item->end - item->pos) {
+			index->spans.data[item->chrom] = item->end - item->pos;
+		}
+	}
+	return 0;
+}
+
+static int index_save(struct aln_file *fp)
+{
+	char path[PATH_MAX];
+	gzFile file;
+	size_t i;
+
+	if (index_finish(&fp->index, fp->header.chroms.size)) {
+		return -ENOMEM;
+	}
+
+	aln_index_filename(fp->name, path, sizeof(path));
+	file = gzopen(path, "wx");  /* 'x': check existed */
+	if (!file) {
+		if (errno == EEXIST) {
+			fprintf(stderr, "Error: Output file '%s' has already existed!\n", path);
+		} else {
+			fprintf(stderr, "Error: Can not open output file '%s'\n", path);
+		}
+		return -EIO;
+	}
+	gzprintf(file, "##fileformat=%s\n", INDEX_FORMAT);
+	gzprintf(file, "#chrom\tpos\tend\toffset\n");
+	for (i = 0; i < fp->index.items.size; ++i) {
+		const struct aln_index_item *item = &fp->index.items.data[i];
+		gzprintf(file, "%s\t%d\t%d\t%lld\n", fp->header.chroms.data[item->chrom].name,
+				item->pos, item->end, (long long)item->offset);
+	}
+	gzclose(file);
+	return 0;
+}
+
+int aln_index_load(struct aln_file *fp, struct aln_index *index)
+{
+	char path[PATH_MAX];
+	char name[sizeof(fp->header.chroms.data[0].name)];
+	char offset[32];
+	struct aln_index_item item;
+	struct file *file;
+	int c, ret = 0;
+
+	aln_index_filename(fp->name, path, sizeof(path));
+	file = file_open(path);
+	if (!file) {
+		return -EINVAL;
+	}
+	while ((c = gzgetc(file->file)) != EOF) {
+		if (c == '#') {
+			skip_current_line(file);
+			continue;
+		}
+		gzungetc(c, file->file);
+
+		if (read_string(file, name, sizeof(name))) break;
+		if (read_integer(file, &item.pos)
+				|| read_integer(file, &item.end)
+				|| read_string(file, offset, sizeof(offset))) {
+			file_error(file, "Failed to read index columns");
+			ret = -EINVAL;
+			break;
+		}
+		item.chrom = aln_header_find_chrom(&fp->header, name);
+		if (item.chrom < 0) {
+			file_error(file, "Unknown chrom '%s'", name);
+			ret = -EINVAL;
+			break;
+		}
+		item.offset = strtoll(offset, NULL, 10);
+		skip_current_line(file);
+
+		if (array_reserve(index->items, index->items.size + 1)) {
+			ret = -ENOMEM;
+			break;
+		}
+		index->items.data[index->items.size++] = item;
+	}
+	file_close(file);
+
+	if (ret == 0) {
+		ret = index_finish(index, fp->header.chroms.size);
+	}
+	return ret;
+}
+
+void aln_index_query(const struct aln_index *index, int chrom, int start, int end,
+		size_t *first, size_t *last)
+{
+	const struct aln_index_item *items = index->items.data;
+	struct aln_index_item key = { .chrom = chrom, .offset = -1 };
+	size_t low, high, mid;
+
+	key.pos = (start > index->spans.data[chrom] ? start - index->spans.data[chrom] : 0);
+	low = 0;
+	high = index->items.size;
+	while (low < high) {  /* first item not less than key */
+		mid = low + (high - low) / 2;
+		if (compare_index_item(&items[mid], &key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	*first = low;
+
+	key.pos = end;
+	key.offset = INT64_MAX;
+	high = index->items.size;
+	while (low < high) {  /* first item greater than key */
+		mid = low + (high - low) / 2;
+		if (compare_index_item(&items[mid], &key) <= 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	*last = low;
+}
+
+/* index items of all records in bin file, after its header */
+static int scan_index_items(struct aln_file *fp, struct aln_index *index)
+{
+	struct alignment a;
+	int64_t offset;
+	int ret;
+
+	alignment_init(&a);
+	while (1) {
+		offset = bgzf_tell(fp->bin);
+		ret = read_bin(fp, &a);
+		if (ret) break;
+
+		if (add_index_item(index, &a, offset)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	alignment_free(&a);
+	return (ret == -1 ? 0 : ret);  /* -1 for end of file */
+}
+
+int aln_build_index(const char *filename)
+{
+	struct aln_file *fp;
+	int ret;
+
+	fp = aln_file_new(filename, ALN_FORMAT_BIN, 0);
+	if (!fp) {
+		return -ENOMEM;
+	}
+	fp->bin = bgzf_open(filename, "r");
+	if (!fp->bin) {
+		aln_file_delete(fp);
+		return -EINVAL;
+	}
+	ret = read_bin_header(fp);
+	if (ret == 0) {
+		fp->indexing = 1;
+		ret = scan_index_items(fp, &fp->index);
+	}
+	if (ret == 0) {
+		ret = index_save(fp);
+	}
+	bgzf_close(fp->bin);
+	aln_file_delete(fp);
+	return ret;
+}
+
+/* file */
+
+static struct aln_file *aln_file_new_output(const char *filename, int format,
+		const struct aln_header *header)
+{
+	struct aln_file *fp;
+	size_t i;
+
+	assert(format == ALN_FORMAT_TXT || format == ALN_FORMAT_BIN || format == ALN_FORMAT_XMAP);
+
+	fp = aln_file_new(filename, format, 1);
+	if (!fp) {
+		return NULL;
+	}
+	for (i = 0; i < header->chroms.size; ++i) {
+		if (aln_header_add_chrom(&fp->header,
+					header->chroms.data[i].name, header->chroms.data[i].size)) {
+			aln_file_delete(fp);
+			return NULL;
+		}
+	}
+	return fp;
+}
+
+struct aln_file *aln_open_write(const char *filename, int format,
+		const struct aln_header *header)
+{
+	struct aln_file *fp;
+	int ret;
+
+	fp = aln_file_new_output(filename, format, header);
+	if (!fp) {
+		return NULL;
+	}
+
+	if (format != ALN_FORMAT_BIN) {
+		if (string_ends_with(filename, ".gz")) {
+			fp->bin = bgzf_open(filename, "w");  /* BGZF, still readable as gzip */
+		} else {
+			fp->text = open_gzfile_write(filename);
+		}
+		if (!fp->bin && !fp->text) {
+			aln_file_delete(fp);
+			return NULL;
+		}
+		ret = (format == ALN_FORMAT_TXT ? write_text_header(fp) : write_xmap_header(fp));
+	} else {
+		fp->bin = bgzf_open(filename, "w");
+		if (!fp->bin) {
+			aln_file_delete(fp);
+			return NULL;
+		}
+		fp->indexing = (strcmp(filename, "-") != 0 && strcmp(filename, "stdout") != 0);
+		ret = write_bin_header(fp);
+	}
+	if (ret) {
+		fp->indexing = 0;
+		aln_close(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/* output into an opened descriptor, such as a socket, without index */
+struct aln_file *aln_dopen_write(int fd, const char *name, int format,
+		const struct aln_header *header)
+{
+	struct aln_file *fp;
+	int ret;
+
+	fp = aln_file_new_output(name, format, header);
+	if (!fp) {
+		return NULL;
+	}
+	if (format != ALN_FORMAT_BIN) {
+		fp->text = gzdopen(fd, "wT");
+		if (!fp->text) {
+			fprintf(stderr, "Error: Can not open output file '%s'\n", name);
+			aln_file_delete(fp);
+			return NULL;
+		}
+		ret = (format == ALN_FORMAT_TXT ? write_text_header(fp) : write_xmap_header(fp));
+	} else {
+		fp->bin = bgzf_dopen(fd, name, "w");
+		if (!fp->bin) {
+			aln_file_delete(fp);
+			return NULL;
+		}
+		ret = write_bin_header(fp);
+	}
+	if (ret) {
+		aln_close(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/* index of records kept in bin output to append, with the same header */
+static int reload_index(struct aln_file *fp)
+{
+	struct aln_file *in;
+	size_t i;
+	int same, ret;
+
+	in = aln_file_new(fp->name, ALN_FORMAT_BIN, 0);
+	if (!in) {
+		return -ENOMEM;
+	}
+	in->bin = bgzf_open(fp->name, "r");
+	if (!in->bin) {
+		aln_file_delete(in);
+		return -EINVAL;
+	}
+	ret = read_bin_header(in);
+	if (ret == 0) {
+		same = (in->header.chroms.size == fp->header.chroms.size);
+		for (i = 0; same && i < fp->header.chroms.size; ++i) {
+			same = (strcmp(in->header.chroms.data[i].name, fp->header.chroms.data[i].name) == 0);
+		}
+		if (!same) {
+			fprintf(stderr, "Error: Output '%s' is mapped onto other reference\n", fp->name);
+			ret = -EINVAL;
+		}
+	}
+	if (ret == 0) {
+		ret = scan_index_items(in, &fp->index);
+	}
+	bgzf_close(in->bin);
+	aln_file_delete(in);
+	return ret;
+}
+
+/*
+ * Reopen output of an interrupted run to continue, truncated to 'offset'
+ * as returned by aln_flush(), after 'count' records written.
+ */
+struct aln_file *aln_open_append(const char *filename, int format,
+		const struct aln_header *header, int64_t offset, uint64_t count)
+{
+	struct aln_file *fp;
+	char path[PATH_MAX];
+	int ret = 0;
+
+	if (strcmp(filename, "-") == 0 || strcmp(filename, "stdout") == 0) {
+		fprintf(stderr, "Error: Can not append to stdout\n");
+		return NULL;
+	}
+	fp = aln_file_new_output(filename, format, header);
+	if (!fp) {
+		return NULL;
+	}
+	fp->count = count;
+
+	if (format != ALN_FORMAT_BIN && !string_ends_with(filename, ".gz")) {
+		fp->text = open_gzfile_append(filename, offset);
+		if (!fp->text) {
+			aln_file_delete(fp);
+			return NULL;
+		}
+		return fp;
+	}
+
+	if (truncate(filename, offset) != 0) {
+		fprintf(stderr, "Error: Can not truncate output file '%s'\n", filename);
+		aln_file_delete(fp);
+		return NULL;
+	}
+	if (format == ALN_FORMAT_BIN) {
+		fp->indexing = 1;
+		ret = reload_index(fp);
+		if (ret == 0) {  /* index left by the interrupted run, saved again on close */
+			aln_index_filename(filename, path, sizeof(path));
+			if (unlink(path) != 0 && errno != ENOENT) {
+				fprintf(stderr, "Error: Can not remove index file '%s'\n", path);
+				ret = -EIO;
+			}
+		}
+	}
+	if (ret == 0) {
+		fp->bin = bgzf_open(filename, "a");
+	}
+	if (!fp->bin) {
+		aln_file_delete(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/*
+ * Write out all records, with size of output file in 'offset', to which
+ * the output could be truncated and appended later.
+ */
+int aln_flush(struct aln_file *fp, int64_t *offset)
+{
+	assert(fp->writing);
+
+	if (fp->format != ALN_FORMAT_BIN && flush_text(fp)) {
+		return -EIO;
+	}
+	if (fp->bin) {
+		if (bgzf_flush(fp->bin)) {
+			return -EIO;
+		}
+		*offset = fp->bin->block_offset;
+		return 0;
+	}
+	return flush_gzfile(fp->text, offset);
+}
+
+struct aln_file *aln_open_read(const char *filename)
+{
+	struct aln_file *fp;
+	int ret = 0;
+
+	fp = aln_file_new(filename, ALN_FORMAT_UNKNOWN, 0);
+	if (!fp) {
+		return NULL;
+	}
+	fp->fp = file_open(filename);
+	if (!fp->fp) {
+		aln_file_delete(fp);
+		return NULL;
+	}
+	if (current_char(fp->fp) == (unsigned char)ALN_MAGIC[0]) {
+		fp->format = ALN_FORMAT_BIN;
+		ret = read_bin_header(fp);
+	} else {
+		fp->format = ALN_FORMAT_TXT;
+		ret = read_text_header(fp);
+	}
+	if (ret) {
+		aln_file_delete(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+int aln_close(struct aln_file *fp)
+{
+	int ret = 0;
+
+	if (!fp) {
+		return 0;
+	}
+	if (fp->writing && fp->format != ALN_FORMAT_BIN) {
+		ret = flush_text(fp);
+	}
+	if (fp->bin) {
+		if (bgzf_close(fp->bin)) {
+			ret = -EIO;
+		}
+	}
+	if (ret == 0 && fp->writing && fp->indexing) {
+		ret = index_save(fp);
+	}
+	aln_file_delete(fp);
+	return ret;
+}
+
+int aln_write(struct aln_file *fp, const struct alignment *a)
+{
+	int ret;
+
+	assert(fp->writing);
+	assert(a->chrom >= 0 && (size_t)a->chrom < fp->header.chroms.size);
+
+	switch (fp->format) {
+	case ALN_FORMAT_TXT: ret = write_text(fp, a); break;
+	case ALN_FORMAT_BIN: ret = write_bin(fp, a); break;
+	case ALN_FORMAT_XMAP: ret = write_xmap(fp, a); break;
+	default: assert(0); return -1;
+	}
+	if (ret == 0) {
+		++fp->count;
+	}
+	return ret;
+}
+
+int aln_read(struct aln_file *fp, struct alignment *a)
+{
+	assert(!fp->writing);
+
+	if (fp->format == ALN_FORMAT_TXT) {
+		return read_text(fp, a);
+	} else {
+		return read_bin(fp, a);
+	}
+}
+
+int aln_read_at(struct aln_file *fp, int64_t offset, struct alignment *a)
+{
+	assert(!fp->writing);
+	assert(fp->format == ALN_FORMAT_BIN);
+
+	if (!fp->bin) {
+		fp->bin = bgzf_open(fp->name, "r");
+		if (!fp->bin) {
+			return -EINVAL;
+		}
+	}
+	if (bgzf_seek(fp->bin, offset)) {
+		return -EINVAL;
+	}
+	return read_bin(fp, a);
+}
@@ -0,0 +1,119 @@
+#ifndef __ALN_FILE_H__
+#define __ALN_FILE_H__
+
+#include <stdint.h>
+#include "nick_map.h"
+#include "io_base.h"
+#include "bgzf.h"
+
+enum aln_format {  /* of alignment results */
+	ALN_FORMAT_UNKNOWN = 0,
+	ALN_FORMAT_TXT,  /* tab-separated text, one alignment in each line */
+	ALN_FORMAT_BIN,  /* binary records, BGZF compressed */
+	ALN_FORMAT_XMAP, /* .xmap file by BioNano inc., only for output */
+};
+
+enum match_type {  /* of aligned interval(s) */
+	MATCH_EXACT = 1,    /* one interval to one interval */
+	MATCH_MISSING = 2,  /* a label missing in query */
+	MATCH_EXTRA = 3,    /* an extra label in query */
+	MATCH_MISSING2 = 4, /* two labels missing in query */
+	MATCH_EXTRA2 = 5,   /* two extra labels in query */
+};
+
+static inline int match_ref_intervals(int type)
+{
+	return (type == MATCH_MISSING ? 2 : (type == MATCH_MISSING2 ? 3 : 1));
+}
+
+static inline int match_qry_intervals(int type)
+{
+	return (type == MATCH_EXTRA ? 2 : (type == MATCH_EXTRA2 ? 3 : 1));
+}
+
+struct aln_chrom {
+	char name[MAX_FRAGMENT_NAME_SIZE + 1];
+	int size;  /* in bp, 0 for unknown */
+};
+
+struct aln_header {
+	array(struct aln_chrom) chroms;
+};
+
+struct alignment {
+	char name[MAX_FRAGMENT_NAME_SIZE + 1];  /* of query */
+	uint64_t qid;    /* ordinal of query in input, from 0 */
+	int chrom;       /* index into header chroms */
+	int pos;         /* of leftmost reference label */
+	int direct;      /* 1 for '+', -1 for '-' */
+	int size, labels;    /* reference */
+	int qsize, qlabels;  /* query */
+	int qpos, qlen;  /* of first aligned query label, and query length */
+	int rstart, rend, qstart, qend;  /* label indices */
+	int missing, extra;
+	array(int) types;   /* of each match, as enum match_type */
+	array(int) rsizes;  /* reference interval sizes */
+	array(int) qsizes;  /* query interval sizes */
+};
+
+struct aln_index_item {
+	int chrom;
+	int pos, end;
+	int64_t offset;  /* virtual offset of record */
+};
+
+struct aln_index {  /* position index of binary file */
+	array(struct aln_index_item) items;  /* sorted by chrom and pos */
+	array(int) spans;  /* max (end - pos) of items on each chrom */
+};
+
+struct aln_file {
+	const char *name;
+	int format;
+	int writing;
+	struct aln_header header;
+
+	gzFile text;        /* writing text */
+	struct file *fp;    /* reading text */
+	struct bgzf *bin;   /* reading/writing binary, or writing '.gz' text */
+	uint64_t count;     /* of records written */
+
+	int indexing;       /* to save index on close */
+	struct aln_index index;
+
+	array(char) buf;    /* of encoded record */
+};
+
+int parse_aln_format(const char *s);
+
+void aln_header_init(struct aln_header *h);
+void aln_header_free(struct aln_header *h);
+int aln_header_add_chrom(struct aln_header *h, const char *name, int size);
+int aln_header_find_chrom(const struct aln_header *h, const char *name);
+
+void alignment_init(struct alignment *a);
+void alignment_free(struct alignment *a);
+
+struct aln_file *aln_open_write(const char *filename, int format,
+		const struct aln_header *header);
+struct aln_file *aln_dopen_write(int fd, const char *name, int format,
+		const struct aln_header *header);
+struct aln_file *aln_open_append(const char *filename, int format,
+		const struct aln_header *header, int64_t offset, uint64_t count);
+struct aln_file *aln_open_read(const char *filename);
+int aln_flush(struct aln_file *fp, int64_t *offset);
+int aln_close(struct aln_file *fp);
+
+int aln_write(struct aln_file *fp, const struct alignment *a);
+int aln_read(struct aln_file *fp, struct alignment *a);
+
+void aln_index_init(struct aln_index *index);
+void aln_index_free(struct aln_index *index);
+void aln_index_filename(const char *filename, char *buf, size_t bufsize);
+int aln_build_index(const char *filename);
+int aln_index_load(struct aln_file *fp, struct aln_index *index);
+void aln_index_query(const struct aln_index *index, int chrom, int start, int end,
+		size_t *first, size_t *last);
+int aln_read_at(struct aln_file *fp, int64_t offset, struct alignment *a);
+
+#endif /* __ALN_FILE_H__ */
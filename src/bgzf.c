@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <zlib.h>
+#include "bgzf.h"
+
+#define BLOCK_HEADER_SIZE 18
+#define BLOCK_FOOTER_SIZE 8
+
+static const unsigned char BLOCK_HEADER[BLOCK_HEADER_SIZE] = {
+	0x1f, 0x8b, 8, 4,  /* gzip magic, deflate, with extra field */
+	0, 0, 0, 0, 0, 0xff,  /* mtime, xfl, os */
+	6, 0,  /* xlen */
+	'B', 'C', 2, 0,  /* subfield 'BC' with 2 bytes */
+	0, 0  /* total block size - 1 */
+};
+
+static inline void put_u16(unsigned char *p, unsigned int value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
+static inline unsigned int get_u16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int bgzf_check_header(const unsigned char *header, size_t size)
+{
+	return (size >= BLOCK_HEADER_SIZE
+			&& header[0] == 0x1f && header[1] == 0x8b && header[2] == 8
+			&& (header[3] & 4) != 0 && get_u16(header + 10) == 6
+			&& header[12] == 'B' && header[13] == 'C' && get_u16(header + 14) == 2);
+}
+
+struct bgzf *bgzf_open(const char *filename, const char *mode)
+{
+	struct bgzf *fp;
+	int is_std = (strcmp(filename, "-") == 0
+			|| strcmp(filename, "stdin") == 0 || strcmp(filename, "stdout") == 0);
+
+	assert(mode[0] == 'r' || mode[0] == 'w' || mode[0] == 'a');
+
+	fp = malloc(sizeof(struct bgzf));
+	if (!fp) {
+		return NULL;
+	}
+	memset(fp, 0, sizeof(struct bgzf) - sizeof(fp->data) - sizeof(fp->cdata));
+	fp->name = filename;
+	fp->writing = (mode[0] != 'r');
+
+	if (mode[0] == 'r') {
+		fp->fp = (is_std ? stdin : fopen(filename, "rb"));
+	} else if (mode[0] == 'w') {
+		fp->fp = (is_std ? stdout : fopen(filename, "wxb")); /* 'x': check existed */
+	} else {
+		fp->fp = (is_std ? stdout : fopen(filename, "ab"));
+		if (fp->fp && !is_std) {
+			fseeko(fp->fp, 0, SEEK_END);
+			fp->block_offset = ftello(fp->fp);
+		}
+	}
+	if (!fp->fp) {
+		if (errno == EEXIST) {
+			fprintf(stderr, "Error: Output file '%s' has already existed!\n", filename);
+		} else {
+			fprintf(stderr, "Error: Can not open file '%s'\n", filename);
+		}
+		free(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/* BGZF stream on an opened descriptor, such as a socket */
+struct bgzf *bgzf_dopen(int fd, const char *name, const char *mode)
+{
+	struct bgzf *fp;
+
+	assert(mode[0] == 'r' || mode[0] == 'w');
+
+	fp = malloc(sizeof(struct bgzf));
+	if (!fp) {
+		return NULL;
+	}
+	memset(fp, 0, sizeof(struct bgzf) - sizeof(fp->data) - sizeof(fp->cdata));
+	fp->name = name;
+	fp->writing = (mode[0] == 'w');
+	fp->fp = fdopen(fd, (fp->writing ? "wb" : "rb"));
+	if (!fp->fp) {
+		fprintf(stderr, "Error: Can not open file '%s'\n", name);
+		free(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+static int deflate_block(struct bgzf *fp)
+{
+	z_stream zs;
+	size_t size;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return -EINVAL;
+	}
+	zs.next_in = fp->data;
+	zs.avail_in = fp->block_pos;
+	zs.next_out = fp->cdata + BLOCK_HEADER_SIZE;
+	zs.avail_out = sizeof(fp->cdata) - BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		return -EINVAL;
+	}
+	size = BLOCK_HEADER_SIZE + zs.total_out + BLOCK_FOOTER_SIZE;
+	deflateEnd(&zs);
+
+	memcpy(fp->cdata, BLOCK_HEADER, BLOCK_HEADER_SIZE);
+	put_u16(fp->cdata + 16, size - 1);
+	put_u32(fp->cdata + size - 8, crc32(crc32(0, NULL, 0), fp->data, fp->block_pos));
+	put_u32(fp->cdata + size - 4, fp->block_pos);
+
+	if (fwrite(fp->cdata, 1, size, fp->fp) != size) {
+		fprintf(stderr, "Error: Failed to write file '%s'\n", fp->name);
+		return -EIO;
+	}
+	fp->block_offset += size;
+	fp->block_pos = 0;
+	return 0;
+}
+
+int bgzf_flush(struct bgzf *fp)
+{
+	assert(fp->writing);
+	if (fp->block_pos > 0) {
+		if (deflate_block(fp)) {
+			return -EIO;
+		}
+	}
+	return (fflush(fp->fp) == 0 ? 0 : -EIO);
+}
+
+int bgzf_write(struct bgzf *fp, const void *buf, size_t length)
+{
+	const unsigned char *p = buf;
+
+	assert(fp->writing);
+	while (length > 0) {
+		size_t n = BGZF_BLOCK_SIZE - fp->block_pos;
+		if (n > length) {
+			n = length;
+		}
+		memcpy(fp->data + fp->block_pos, p, n);
+		fp->block_pos += n;
+		p += n;
+		length -= n;
+		if (fp->block_pos >= BGZF_BLOCK_SIZE) {
+			if (deflate_block(fp)) {
+				return -EIO;
+			}
+		}
+	}
+	return 0;
+}
+
+static int inflate_block(struct bgzf *fp)
+{
+	unsigned char *p = fp->cdata;
+	size_t size;
+	z_stream zs;
+
+	fp->block_offset = ftello(fp->fp);
+	fp->block_length = 0;
+	fp->block_pos = 0;
+
+	size = fread(p, 1, BLOCK_HEADER_SIZE, fp->fp);
+	if (size == 0) {
+		return 0; /* EOF */
+	}
+	if (!bgzf_check_header(p, size)) {
+		fprintf(stderr, "Error: Invalid BGZF block in file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	size = get_u16(p + 16) + 1;
+	if (size < BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE
+			|| fread(p + BLOCK_HEADER_SIZE, 1, size - BLOCK_HEADER_SIZE, fp->fp)
+				!= size - BLOCK_HEADER_SIZE) {
+		fprintf(stderr, "Error: Truncated BGZF block in file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -15) != Z_OK) {
+		return -EINVAL;
+	}
+	zs.next_in = p + BLOCK_HEADER_SIZE;
+	zs.avail_in = size - BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE;
+	zs.next_out = fp->data;
+	zs.avail_out = sizeof(fp->data);
+	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		inflateEnd(&zs);
+		fprintf(stderr, "Error: Failed to decompress BGZF block in file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	fp->block_length = zs.total_out;
+	inflateEnd(&zs);
+
+	if (fp->block_length != get_u32(p + size - 4)
+			|| crc32(crc32(0, NULL, 0), fp->data, fp->block_length) != get_u32(p + size - 8)) {
+		fprintf(stderr, "Error: Corrupted BGZF block in file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+ssize_t bgzf_read(struct bgzf *fp, void *buf, size_t length)
+{
+	unsigned char *p = buf;
+	size_t count = 0;
+
+	assert(!fp->writing);
+	while (count < length) {
+		size_t n;
+		if (fp->block_pos >= fp->block_length) {
+			if (inflate_block(fp)) {
+				return -EINVAL;
+			}
+			if (fp->block_length == 0) {
+				if (feof(fp->fp)) break;
+				continue; /* empty block */
+			}
+		}
+		n = fp->block_length - fp->block_pos;
+		if (n > length - count) {
+			n = length - count;
+		}
+		memcpy(p + count, fp->data + fp->block_pos, n);
+		fp->block_pos += n;
+		count += n;
+	}
+	return count;
+}
+
+int bgzf_seek(struct bgzf *fp, int64_t offset)
+{
+	assert(!fp->writing);
+	if (fseeko(fp->fp, offset >> 16, SEEK_SET) != 0) {
+		fprintf(stderr, "Error: Failed to seek in file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	if (inflate_block(fp)) {
+		return -EINVAL;
+	}
+	fp->block_offset = offset >> 16;
+	fp->block_pos = offset & 0xffff;
+	return 0;
+}
+
+int bgzf_close(struct bgzf *fp)
+{
+	int ret = 0;
+	if (fp) {
+		if (fp->writing) {
+			ret = bgzf_flush(fp);
+			if (ret == 0) {
+				ret = deflate_block(fp); /* empty block as EOF marker */
+			}
+		}
+		if (fp->fp != stdin && fp->fp != stdout) {
+			fclose(fp->fp);
+		} else if (fp->fp == stdout) {
+			fflush(stdout);
+		}
+		free(fp);
+	}
+	return ret;
+}
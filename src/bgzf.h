@@ -0,0 +1,44 @@
+#ifndef __BGZF_H__
+#define __BGZF_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * BGZF: blocked gzip format, as a series of gzip members with at most 64KB
+ * data each, so that any block can be located by its (compressed) file
+ * offset. A virtual offset is (block_offset << 16 | offset_in_block).
+ */
+
+#define BGZF_BLOCK_SIZE 0xff00  /* max uncompressed data of a block */
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+struct bgzf {
+	FILE *fp;
+	const char *name;
+	int writing;
+	int64_t block_offset;  /* file offset of current block */
+	size_t block_length;   /* length of uncompressed data in buffer */
+	size_t block_pos;      /* current position in buffer */
+	unsigned char data[BGZF_MAX_BLOCK_SIZE];
+	unsigned char cdata[BGZF_MAX_BLOCK_SIZE];
+};
+
+struct bgzf *bgzf_open(const char *filename, const char *mode);
+struct bgzf *bgzf_dopen(int fd, const char *name, const char *mode);
+int bgzf_close(struct bgzf *fp);
+
+ssize_t bgzf_read(struct bgzf *fp, void *buf, size_t length);
+int bgzf_write(struct bgzf *fp, const void *buf, size_t length);
+int bgzf_flush(struct bgzf *fp);
+
+static inline int64_t bgzf_tell(const struct bgzf *fp)
+{
+	return (fp->block_offset << 16) | (fp->block_pos & 0xffff);
+}
+int bgzf_seek(struct bgzf *fp, int64_t offset);
+
+int bgzf_check_header(const unsigned char *header, size_t size);
+
+#endif /* __BGZF_H__ */
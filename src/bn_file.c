@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
 #include "bn_file.h"
@@ -41,6 +42,7 @@ static int bn_read_txt(struct file *fp, struct fragment *f)
 			if (i + 1 < count) {
 				f->nicks.data[i].pos = pos;
 				f->nicks.data[i].flag = 0;
+				f->nicks.data[i].channel = 1;
 			} else {
 				f->size = pos;
 			}
@@ -49,10 +51,11 @@ static int bn_read_txt(struct file *fp, struct fragment *f)
 	return 0;
 }
 
+/* sites of channels in order of '##enzyme=' lines */
 static int bn_read_tsv_header(struct file *fp, struct nick_map *map)
 {
 	char buf[256];
-	int c;
+	int c, ended, channel = 0;
 
 	while ((c = gzgetc(fp->file)) != EOF) {
 		if (c != '#') {
@@ -60,6 +63,7 @@ static int bn_read_tsv_header(struct file *fp, struct nick_map *map)
 			break;
 		}
 		if (read_line(fp, buf, sizeof(buf))) break;
+		ended = (strchr(buf, '\n') != NULL);  /* before site taken out of line */
 		if (string_begins_as(buf, "#enzyme=")) {
 			char *p, *q, *e;
 			p = strchr(buf, '=');
@@ -72,10 +76,12 @@ static int bn_read_tsv_header(struct file *fp, struct nick_map *map)
 				if (e) {
 					*e = '\0';
 				}
-				nick_map_set_enzyme(map, p, q);
+				nick_map_set_channel(map, ++channel, p, q);
 			}
 		}
-		skip_to_next_line(fp, buf, sizeof(buf));
+		if (!ended) {
+			skip_to_next_line(fp, buf, sizeof(buf));
+		}
 	}
 	return 0;
 }
@@ -84,7 +90,8 @@ static int bn_read_tsv(struct file *fp, struct fragment *f)
 {
 	char name[sizeof(f->name)];
 	char strandText[4];
-	int c, label, pos, strand;
+	char buf[256];
+	int c, label, pos, strand, channel;
 
 	f->name[0] = '\0';
 	f->nicks.size = 0;
@@ -135,7 +142,14 @@ static int bn_read_tsv(struct file *fp, struct fragment *f)
 			return -EINVAL;
 		}
 
-		skip_current_line(fp);
+		/* optional 'channel' column after 'size', for labels of more than one */
+		if (read_line(fp, buf, sizeof(buf)) || sscanf(buf, "%*d %d", &channel) != 1) {
+			channel = 1;
+		} else if (strand >= 0 && channel < 1) {
+			file_error(fp, "Invalid channel %d", channel);
+			return -EINVAL;
+		}
+		skip_to_next_line(fp, buf, sizeof(buf));
 
 		if (strand >= 0) {
 			if (array_reserve(f->nicks, f->nicks.size + 1)) {
@@ -143,6 +157,7 @@ static int bn_read_tsv(struct file *fp, struct fragment *f)
 			}
 			f->nicks.data[f->nicks.size].pos = pos;
 			f->nicks.data[f->nicks.size].flag = strand;
+			f->nicks.data[f->nicks.size].channel = channel;
 			++f->nicks.size;
 		} else {
 			f->size = pos;
@@ -152,10 +167,42 @@ static int bn_read_tsv(struct file *fp, struct fragment *f)
 	return (f->name[0] ? 0 : -1);
 }
 
+static int compare_nick(const void *a, const void *b)
+{
+	const struct nick *x = a;
+	const struct nick *y = b;
+	if (x->pos != y->pos) {
+		return (x->pos < y->pos ? -1 : 1);
+	}
+	return (x->channel < y->channel ? -1 : (x->channel > y->channel ? 1 : 0));
+}
+
+/* label positions of a channel, ended by molecule size */
+static int bn_read_bnx_labels(struct file *fp, struct fragment *f, int channel)
+{
+	double value;
+
+	while (read_double(fp, &value) == 0) {
+		int pos = to_integer(value);
+		if (pos == f->size) {
+			break;
+		}
+		if (array_reserve(f->nicks, f->nicks.size + 1)) {
+			return -ENOMEM;
+		}
+		f->nicks.data[f->nicks.size].pos = pos;
+		f->nicks.data[f->nicks.size].flag = 0;
+		f->nicks.data[f->nicks.size].channel = channel;
+		++f->nicks.size;
+	}
+	skip_current_line(fp);
+	return 0;
+}
+
 static int bn_read_bnx(struct file *fp, struct fragment *f)
 {
 	char type[5];
-	int c;
+	int c, ret, channel;
 	double value;
 
 	f->name[0] = '\0';
@@ -189,19 +236,22 @@ static int bn_read_bnx(struct file *fp, struct fragment *f)
 				file_error(fp, "Missing molecule info line");
 				return -EINVAL;
 			}
-			while (read_double(fp, &value) == 0) {
-				int pos = to_integer(value);
-				if (pos == f->size) {
-					break;
+			if ((ret = bn_read_bnx_labels(fp, f, 1)) != 0) {
+				return ret;
+			}
+			/* other channels, in lines right after the first one */
+			for (channel = 1; (c = current_char(fp)) >= '2' && c <= '9'; channel = c - '0') {
+				if (read_string(fp, type, sizeof(type)) || strlen(type) != 1) {
+					file_error(fp, "Invalid label channel '%s'", type);
+					return -EINVAL;
 				}
-				if (array_reserve(f->nicks, f->nicks.size + 1)) {
-					return -ENOMEM;
+				if ((ret = bn_read_bnx_labels(fp, f, c - '0')) != 0) {
+					return ret;
 				}
-				f->nicks.data[f->nicks.size].pos = pos;
-				f->nicks.data[f->nicks.size].flag = 0;
-				++f->nicks.size;
 			}
-			skip_current_line(fp);
+			if (channel > 1) {
+				qsort(f->nicks.data, f->nicks.size, sizeof(struct nick), compare_nick);
+			}
 			break;
 		}
 		skip_current_line(fp);
@@ -209,17 +259,21 @@ static int bn_read_bnx(struct file *fp, struct fragment *f)
 	return (f->name[0] ? 0 : -1);
 }
 
-static int bn_read_cmap_header(struct file *fp, struct nick_map *map)
+/* sites of channels in BNX/CMAP header, as ' Nickase Recognition Site <N>:' */
+static int bn_read_site_header(struct file *fp, struct nick_map *map)
 {
+	const char *prefix = " Nickase Recognition Site ";
 	char buf[256];
-	int c;
+	int c, ended;
 	while ((c = gzgetc(fp->file)) != EOF) {
 		if (c != '#') {
 			gzungetc(c, fp->file);
 			break;
 		}
 		if (read_line(fp, buf, sizeof(buf))) break;
-		if (string_begins_as(buf, " Nickase Recognition Site 1:")) {
+		ended = (strchr(buf, '\n') != NULL);  /* before site taken out of line */
+		if (string_begins_as(buf, prefix) && strchr(buf, ':')) {
+			int channel = atoi(buf + strlen(prefix));
 			char *p, *q, *e;
 			p = strchr(buf, ':');
 			assert(p != NULL);
@@ -232,10 +286,12 @@ static int bn_read_cmap_header(struct file *fp, struct nick_map *map)
 				if (e) {
 					*e = '\0';
 				}
-				nick_map_set_enzyme(map, p, q);
+				nick_map_set_channel(map, channel, p, q);
 			}
 		}
-		skip_to_next_line(fp, buf, sizeof(buf));
+		if (!ended) {
+			skip_to_next_line(fp, buf, sizeof(buf));
+		}
 	}
 	return 0;
 }
@@ -277,12 +333,13 @@ static int bn_read_cmap(struct file *fp, struct fragment *f)
 			default: break;
 			}
 		}
-		if (channel == 1) {
+		if (channel > 0) {
 			if (array_reserve(f->nicks, f->nicks.size + 1)) {
 				return -ENOMEM;
 			}
 			f->nicks.data[f->nicks.size].pos = pos;
 			f->nicks.data[f->nicks.size].flag = 0;
+			f->nicks.data[f->nicks.size].channel = channel;
 			++f->nicks.size;
 		} else {
 			assert(channel == 0);
@@ -336,9 +393,9 @@ int bn_read_header(struct file *fp, int *format, struct nick_map *map)
 
 	switch (*format) {
 	case FORMAT_TSV: return bn_read_tsv_header(fp, map);
-	case FORMAT_CMAP: return bn_read_cmap_header(fp, map);
-	case FORMAT_TXT:
 	case FORMAT_BNX:
+	case FORMAT_CMAP: return bn_read_site_header(fp, map);
+	case FORMAT_TXT:
 	default: return bn_skip_comment_lines(fp);
 	}
 }
@@ -357,6 +414,87 @@ int bn_read(struct file *fp, int format, struct fragment *f)
 	}
 }
 
+/*
+ * Skip a fragment without parsing its labels, where only leading fields
+ * of each line are looked at to find the end of record.
+ */
+int bn_skip(struct file *fp, int format)
+{
+	char buf[256];
+	char field[8];
+	int value, lines = 0, done = 0;
+
+	assert(fp != NULL);
+
+	while (!done) {
+		skip_spaces(fp);
+		if (read_line(fp, buf, sizeof(buf))) {
+			break;
+		}
+		if (buf[0] == '#') {
+			skip_to_next_line(fp, buf, sizeof(buf));
+			continue;
+		}
+		switch (format) {
+		case FORMAT_TSV:  /* fragment end line, with strand '*' */
+			done = (sscanf(buf, "%*s %*s %*s %7s", field) == 1 && strcmp(field, "*") == 0);
+			break;
+		case FORMAT_BNX:  /* label positions line */
+			done = (sscanf(buf, "%7s", field) == 1 && strcmp(field, "1") == 0);
+			break;
+		case FORMAT_CMAP:  /* fragment end line, with channel 0 */
+			done = (sscanf(buf, "%*s %*s %*s %*s %d", &value) == 1 && value == 0);
+			break;
+		case FORMAT_TXT:
+		default:
+			done = 1;
+			break;
+		}
+		skip_to_next_line(fp, buf, sizeof(buf));
+		++lines;
+	}
+	return (lines > 0 ? 0 : -1);
+}
+
+/*
+ * Read the next fragment of shard 'index' (0-based) out of 'count', that is
+ * fragments whose ordinal in file modulo 'count' is 'index', with the others
+ * skipped. The ordinal of fragment read is returned in 'ordinal', which
+ * should be 0 before the first call.
+ */
+int bn_read_shard(struct file *fp, int format, struct fragment *f,
+		size_t index, size_t count, uint64_t *ordinal)
+{
+	int ret;
+
+	assert(index < count);
+
+	while (*ordinal % count != index) {
+		if ((ret = bn_skip(fp, format)) != 0) {
+			return ret;
+		}
+		++*ordinal;
+	}
+	if ((ret = bn_read(fp, format, f)) == 0) {
+		++*ordinal;
+	}
+	return ret;
+}
+
+/* shard as '<i>/<N>', where 1 <= i <= N, into 0-based index */
+int parse_shard_text(const char *s, size_t *index, size_t *count)
+{
+	unsigned long i, n;
+	char c;
+
+	if (sscanf(s, "%lu/%lu%c", &i, &n, &c) != 2 || i < 1 || i > n) {
+		return -EINVAL;
+	}
+	*index = i - 1;
+	*count = n;
+	return 0;
+}
+
 int parse_format_text(const char *s)
 {
 	if (strcmp(s, "txt") == 0) {
@@ -372,7 +510,28 @@ int parse_format_text(const char *s)
 	}
 }
 
+static int is_selected(const char *name, const char * const *names, size_t count)
+{
+	size_t i;
+	if (count == 0) {
+		return 1;
+	}
+	for (i = 0; i < count; ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int nick_map_load(struct nick_map *map, const char *filename)
+{
+	return nick_map_load_selected(map, filename, NULL, 0);
+}
+
+/* only fragments named in 'names' are kept, or all if 'count' is 0 */
+int nick_map_load_selected(struct nick_map *map, const char *filename,
+		const char * const *names, size_t count)
 {
 	struct file *fp;
 	struct fragment fragment = { };
@@ -391,6 +550,9 @@ int nick_map_load(struct nick_map *map, const char *filename)
 		return err;
 	}
 	while (bn_read(fp, format, &fragment) == 0) {
+		if (!is_selected(fragment.name, names, count)) {
+			continue;
+		}
 		if (array_reserve(map->fragments, map->fragments.size + 1)) {
 			return -ENOMEM;
 		}
@@ -401,6 +563,7 @@ int nick_map_load(struct nick_map *map, const char *filename)
 		fragment.nicks.size = 0;
 		fragment.nicks.capacity = 0;
 	}
+	array_free(fragment.nicks);
 	file_close(fp);
 	return 0;
 }
@@ -445,32 +608,70 @@ static int save_as_txt(gzFile file, const struct nick_map *map)
 	return 0;
 }
 
+/* channels of labels in file, with at least one */
+static inline int channel_count(const struct nick_map *map)
+{
+	return (map->channel_count > 0 ? map->channel_count : 1);
+}
+
+/* recognition site of each channel, with 'space' after colon */
+static void save_sites(gzFile file, const struct nick_map *map, const char *space)
+{
+	const struct label_channel *c;
+	int i;
+
+	for (i = 0; i < channel_count(map); ++i) {
+		c = &map->channels[i];
+		if (c->enzyme[0] && c->rec_seq[0]) {
+			gzprintf(file, "# Nickase Recognition Site %d:%s%s/%s\n",
+					i + 1, space, c->enzyme, c->rec_seq);
+		} else {
+			gzprintf(file, "# Nickase Recognition Site %d:%sunknown\n", i + 1, space);
+		}
+	}
+}
+
 static int save_tsv_header(gzFile file, const struct nick_map *map)
 {
+	int i;
+
 	gzprintf(file, "##fileformat=MAPv0.1\n");
-	if (map->enzyme[0] && map->rec_seq[0]) {
-		gzprintf(file, "##enzyme=%s/%s\n", map->enzyme, map->rec_seq);
+	for (i = 0; i < map->channel_count; ++i) {
+		if (map->channels[i].enzyme[0] && map->channels[i].rec_seq[0]) {
+			gzprintf(file, "##enzyme=%s/%s\n", map->channels[i].enzyme, map->channels[i].rec_seq);
+		}
 	}
 	gzprintf(file, "##program=bntools\n");
 	gzprintf(file, "##programversion="VERSION"\n");
 	write_command_line(file);
-	gzprintf(file, "#name\tlabel\tpos\tstrand\tsize\n");
+	if (map->channel_count > 1) {
+		gzprintf(file, "#name\tlabel\tpos\tstrand\tsize\tchannel\n");
+	} else {
+		gzprintf(file, "#name\tlabel\tpos\tstrand\tsize\n");
+	}
 	return 0;
 }
 
-static int save_fragment_as_tsv(gzFile file, const struct fragment *fragment)
+/* with 'channel' column of each label, and 0 for fragment end, if more than one */
+static int save_fragment_as_tsv(gzFile file, const struct fragment *fragment, int channels)
 {
 	const char * const STRAND[] = { "?", "+", "-", "+/-" };
 	size_t i;
 	const struct nick *n;
 	for (i = 0, n = NULL; i < fragment->nicks.size; ++i) {
 		n = &fragment->nicks.data[i];
-		gzprintf(file, "%s\t%zd\t%d\t%s\t%d\n",
+		gzprintf(file, "%s\t%zd\t%d\t%s\t%d",
 				fragment->name, i, n->pos, STRAND[n->flag & 3],
 				n->pos - (i == 0 ? 0 : (n - 1)->pos));
+		if (channels > 1) {
+			gzprintf(file, "\t%d\n", n->channel);
+		} else {
+			gzprintf(file, "\n");
+		}
 	}
-	gzprintf(file, "%s\t%zd\t%d\t*\t%d\n",
-			fragment->name, fragment->nicks.size, fragment->size, fragment->size - (n ? n->pos : 0));
+	gzprintf(file, "%s\t%zd\t%d\t*\t%d%s\n",
+			fragment->name, fragment->nicks.size, fragment->size, fragment->size - (n ? n->pos : 0),
+			(channels > 1 ? "\t0" : ""));
 	return 0;
 }
 
@@ -479,36 +680,43 @@ static int save_as_tsv(gzFile file, const struct nick_map *map)
 	size_t i;
 	save_tsv_header(file, map);
 	for (i = 0; i < map->fragments.size; ++i) {
-		save_fragment_as_tsv(file, &map->fragments.data[i]);
+		save_fragment_as_tsv(file, &map->fragments.data[i], map->channel_count);
 	}
 	return 0;
 }
 
 static int save_bnx_header(gzFile file, const struct nick_map *map)
 {
+	int i;
+
 	gzprintf(file, "# BNX File Version: 0.1\n");
-	gzprintf(file, "# Label Channels: 1\n");
-	if (map->enzyme[0] && map->rec_seq[0]) {
-		gzprintf(file, "# Nickase Recognition Site 1: %s/%s\n", map->enzyme, map->rec_seq);
-	} else {
-		gzprintf(file, "# Nickase Recognition Site 1: unknown\n");
-	}
+	gzprintf(file, "# Label Channels: %d\n", channel_count(map));
+	save_sites(file, map, " ");
 	gzprintf(file, "# Number of Nanomaps: %zd\n", map->fragments.size);
 	gzprintf(file, "#0h\tLabel Channel\tMapID\tLength\n");
 	gzprintf(file, "#0f\tint\tint\tfloat\n");
-	gzprintf(file, "#1h\tLabel Channel\tLabelPositions[N]\n");
-	gzprintf(file, "#1f\tint\tfloat\n");
+	for (i = 1; i <= channel_count(map); ++i) {
+		gzprintf(file, "#%dh\tLabel Channel\tLabelPositions[N]\n", i);
+		gzprintf(file, "#%df\tint\tfloat\n", i);
+	}
 	return 0;
 }
 
-static int save_fragment_as_bnx(gzFile file, const struct fragment *fragment)
+/* a line of label positions for each channel, even if none in it */
+static int save_fragment_as_bnx(gzFile file, const struct fragment *fragment, int channels)
 {
 	size_t i;
-	gzprintf(file, "0\t%s\t%zd\n1", fragment->name, fragment->size);
-	for (i = 0; i < fragment->nicks.size; ++i) {
-		gzprintf(file, "\t%d", fragment->nicks.data[i].pos);
+	int c;
+	gzprintf(file, "0\t%s\t%d\n", fragment->name, fragment->size);
+	for (c = 1; c <= channels; ++c) {
+		gzprintf(file, "%d", c);
+		for (i = 0; i < fragment->nicks.size; ++i) {
+			if (fragment->nicks.data[i].channel == c || channels == 1) {
+				gzprintf(file, "\t%d", fragment->nicks.data[i].pos);
+			}
+		}
+		gzprintf(file, "\t%d\n", fragment->size);
 	}
-	gzprintf(file, "\t%d\n", fragment->size);
 	return 0;
 }
 
@@ -517,7 +725,7 @@ static int save_as_bnx(gzFile file, const struct nick_map *map)
 	size_t i;
 	save_bnx_header(file, map);
 	for (i = 0; i < map->fragments.size; ++i) {
-		save_fragment_as_bnx(file, &map->fragments.data[i]);
+		save_fragment_as_bnx(file, &map->fragments.data[i], channel_count(map));
 	}
 	return 0;
 }
@@ -525,12 +733,8 @@ static int save_as_bnx(gzFile file, const struct nick_map *map)
 static int save_cmap_header(gzFile file, const struct nick_map *map)
 {
 	gzprintf(file, "# CMAP File Version:  0.1\n");
-	gzprintf(file, "# Label Channels:  1\n");
-	if (map->enzyme[0] && map->rec_seq[0]) {
-		gzprintf(file, "# Nickase Recognition Site 1:  %s/%s\n", map->enzyme, map->rec_seq);
-	} else {
-		gzprintf(file, "# Nickase Recognition Site 1:  unknown\n");
-	}
+	gzprintf(file, "# Label Channels:  %d\n", channel_count(map));
+	save_sites(file, map, "  ");
 	gzprintf(file, "# Number of Consensus Nanomaps:    %zd\n", map->fragments.size);
 	gzprintf(file, "#h CMapId\tContigLength\tNumSites\tSiteID"
 			"\tLabelChannel\tPosition\tStdDev\tCoverage\tOccurrence\n");
@@ -538,13 +742,14 @@ static int save_cmap_header(gzFile file, const struct nick_map *map)
 	return 0;
 }
 
-static int save_fragment_as_cmap(gzFile file, const struct fragment *fragment)
+static int save_fragment_as_cmap(gzFile file, const struct fragment *fragment, int channels)
 {
 	size_t i;
 	for (i = 0; i < fragment->nicks.size; ++i) {
 		gzprintf(file, "%s\t%d\t%zd\t%zd\t%d\t%d\t%d\t%d\t%d\n",
 				fragment->name, fragment->size, fragment->nicks.size,
-				i + 1, 1, fragment->nicks.data[i].pos, 0, 0, 0);
+				i + 1, (channels > 1 ? fragment->nicks.data[i].channel : 1),
+				fragment->nicks.data[i].pos, 0, 0, 0);
 	}
 	gzprintf(file, "%s\t%d\t%zd\t%zd\t%d\t%d\t%d\t%d\t%d\n",
 			fragment->name, fragment->size, fragment->nicks.size,
@@ -557,7 +762,7 @@ static int save_as_cmap(gzFile file, const struct nick_map *map)
 	size_t i;
 	save_cmap_header(file, map);
 	for (i = 0; i < map->fragments.size; ++i) {
-		save_fragment_as_cmap(file, &map->fragments.data[i]);
+		save_fragment_as_cmap(file, &map->fragments.data[i], channel_count(map));
 	}
 	return 0;
 }
@@ -598,13 +803,15 @@ int save_header(gzFile file, const struct nick_map *map, int format)
 	}
 }
 
-int save_fragment(gzFile file, const struct fragment *fragment, int format)
+/* with channels of 'map', as in its header saved */
+int save_fragment(gzFile file, const struct nick_map *map,
+		const struct fragment *fragment, int format)
 {
 	switch (format) {
 	case FORMAT_TXT: return save_fragment_as_txt(file, fragment);
-	case FORMAT_TSV: return save_fragment_as_tsv(file, fragment);
-	case FORMAT_BNX: return save_fragment_as_bnx(file, fragment);
-	case FORMAT_CMAP: return save_fragment_as_cmap(file, fragment);
+	case FORMAT_TSV: return save_fragment_as_tsv(file, fragment, map->channel_count);
+	case FORMAT_BNX: return save_fragment_as_bnx(file, fragment, channel_count(map));
+	case FORMAT_CMAP: return save_fragment_as_cmap(file, fragment, channel_count(map));
 	default: assert(0); return -EINVAL;
 	}
 }
@@ -16,12 +16,20 @@ int parse_format_text(const char *s);
 
 int bn_read_header(struct file *fp, int *format, struct nick_map *map);
 int bn_read(struct file *fp, int format, struct fragment *f);
+int bn_skip(struct file *fp, int format);
+int bn_read_shard(struct file *fp, int format, struct fragment *f,
+		size_t index, size_t count, uint64_t *ordinal);
+
+int parse_shard_text(const char *s, size_t *index, size_t *count);
 
 int nick_map_load(struct nick_map *map, const char *filename);
+int nick_map_load_selected(struct nick_map *map, const char *filename,
+		const char * const *names, size_t count);
 int nick_map_save(const struct nick_map *map, const char *filename, int format);
 
 int save_header(gzFile file, const struct nick_map *map, int format);
-int save_fragment(gzFile file, const struct fragment *fragment, int format);
+int save_fragment(gzFile file, const struct nick_map *map,
+		const struct fragment *fragment, int format);
 
 int bn_skip_comment_lines(struct file *fp);
 
@@ -8,6 +8,12 @@ extern int view_main (int argc, char * const argv[]);
 extern int align_main(int argc, char * const argv[]);
 extern int index_main(int argc, char * const argv[]);
 extern int map_main  (int argc, char * const argv[]);
+extern int aview_main(int argc, char * const argv[]);
+extern int sort_main (int argc, char * const argv[]);
+extern int depth_main(int argc, char * const argv[]);
+extern int merge_main(int argc, char * const argv[]);
+extern int serve_main(int argc, char * const argv[]);
+extern int client_main(int argc, char * const argv[]);
 
 static int version_main(int argc, char * const argv[])
 {
@@ -28,6 +34,12 @@ static const struct command CMD[] = {
 	{ "align",   align_main,   "align between two restriction maps" },
 	{ "index",   index_main,   "build index of reference restriction map" },
 	{ "map",     map_main,     "map molecules to reference restriction map" },
+	{ "aview",   aview_main,   "convert/select alignments of map results" },
+	{ "sort",    sort_main,    "sort alignments of map results by position" },
+	{ "depth",   depth_main,   "compute reference coverage of map results" },
+	{ "merge",   merge_main,   "merge map results of query shards" },
+	{ "serve",   serve_main,   "serve map requests with reference loaded once" },
+	{ "client",  client_main,  "map molecules by a 'serve' process" },
 };
 
 static void print_usage(void)
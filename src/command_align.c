@@ -5,196 +5,656 @@
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "nick_map.h"
+#include "ref_map.h"
 #include "bn_file.h"
+#include "label_align.h"
+#include "label_sketch.h"
+#include "ref_band.h"
+#include "pair_file.h"
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
 
 #define DEF_OUTPUT "stdout"
+#define DEF_FORMAT "txt"
+#define DEF_TOLERANCE 0.1
+#define DEF_MAX_DELTA 2
+#define DEF_MIN_SCORE 4
+#define DEF_MAX_MEMORY 1024
+#define DEF_MIN_HITS 0
+#define DEF_TUPLE_SIZE 3
+#define DEF_WINDOW 2
+#define DEF_MAX_HITS 256
+#define DEF_THREADS 1
+#define DEF_SEED_SIZE 4
+#define DEF_MIN_SEEDS 4
+#define DEF_BAND_MARGIN 8
+#define TILE_SIZE 16     /* pairs of a tile */
+#define ROUND_TILES 256  /* tiles of each thread in a round */
+
+struct align_record {  /* of an alignment, with label pairs in buffer */
+	size_t a, b;  /* fragments */
+	size_t first, count;
+};
+
+struct align_buffer {  /* of each thread */
+	struct dp_matrix m;
+	array(struct align_record) records;
+	array(size_t) labels_a;
+	array(size_t) labels_b;
+};
+
+struct align_tile {  /* pairs of fragment a and [first, last) of b, or candidates */
+	size_t a;
+	size_t first, last;
+	size_t worker;  /* which aligned it */
+	size_t first_record, records;
+};
+
+struct align_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;  /* of tiles left */
+	size_t next, end;      /* tiles left, taken from next, and stolen from end */
+	struct align_buffer buf;
+	struct align_pairs *pairs;
+	int ret;
+};
+
+struct align_pairs {
+	const struct nick_map *map1;
+	const struct nick_map *map2;
+	const sketch_pairs_t *candidates;  /* or all pairs */
+	const ref_bands_t *bands;          /* instead of candidates, onto reference */
+	struct pair_file *out;
+	size_t a, b;  /* where next tile starts, with 'b' as index of candidates/bands if any */
+	array(struct align_tile) tiles;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	array(struct align_worker) workers;
+	size_t round;    /* started */
+	size_t running;  /* workers in this round */
+	int done;
+};
 
 static int verbose = 0;
+static int threads = DEF_THREADS;
+static int reference = 0;
+static int decode = 0;
+static const char *output_file = DEF_OUTPUT;
+static int output_format = PAIR_FORMAT_TXT;
+
+static struct align_params params = {
+	DEF_TOLERANCE, DEF_MAX_DELTA, DEF_MIN_SCORE, (size_t)DEF_MAX_MEMORY << 20
+};
+
+static struct sketch_params sketch_params = {
+	DEF_TOLERANCE, DEF_TUPLE_SIZE, DEF_WINDOW, DEF_MIN_HITS, DEF_MAX_HITS
+};
+
+static struct band_params band_params = {
+	DEF_TOLERANCE, DEF_SEED_SIZE, DEF_MIN_SEEDS, DEF_BAND_MARGIN
+};
 
 static void print_usage(void)
 {
 	fprintf(stderr, "\n"
 			"Usage: bntools align [options] <map_a> [<map_b>]\n"
+			"       bntools align -D [options] <align_file>\n"
 			"\n"
 			"Options:\n"
 			"   <map_a/b>   input map file(s), in tsv/cmap/bnx format\n"
+			"   -o FILE     output file [%s]\n"
+			"   -f STR      output format, txt/bin [%s]\n"
+			"   -e FLOAT    tolerance to compare interval size [%.2f]\n"
+			"   -d INT      max intervals merged in one match, for missing labels,\n"
+			"               up to %d [%d]\n"
+			"   -m INT      minimal matched intervals of an alignment [%d]\n"
+			"   -M INT      max memory (in MB) of DP matrix, above which it is\n"
+			"               filled in linear memory, but about twice slower [%d]\n"
+			"   -c INT      minimal shared minimizers of a pair to be aligned,\n"
+			"               or 0 to align all pairs [%d]\n"
+			"   -k INT      intervals of a tuple, for minimizers [%d]\n"
+			"   -w INT      tuples of a window, for minimizers [%d]\n"
+			"   -r INT      max fragments of a minimizer, above which it is\n"
+			"               ignored as repeat [%d]\n"
+			"   -t INT      number of threads to align [%d]\n"
+			"   -R          take <map_b> as reference, with fragments of <map_a>\n"
+			"               aligned only in bands of seeds from its index, which\n"
+			"               is built if no index file found\n"
+			"   -s INT      consecutive intervals matched by a seed, with '-R' [%d]\n"
+			"   -n INT      minimal seeds of a band, with '-R' [%d]\n"
+			"   -b INT      diagonals around seeds of a band, with seeds apart by\n"
+			"               more than twice of it in separate bands, with '-R' [%d]\n"
+			"   -D          decode <align_file> of binary alignments, into format\n"
+			"               of '-f'\n"
 			"   -v          show verbose message\n"
 			"   -h          show this help\n"
-			"\n");
+			"\n", DEF_OUTPUT, DEF_FORMAT, DEF_TOLERANCE, MAX_DELTA, DEF_MAX_DELTA, DEF_MIN_SCORE, DEF_MAX_MEMORY,
+			DEF_MIN_HITS, DEF_TUPLE_SIZE, DEF_WINDOW, DEF_MAX_HITS, DEF_THREADS,
+			DEF_SEED_SIZE, DEF_MIN_SEEDS, DEF_BAND_MARGIN);
 }
 
-#define TOLERANCE .1
-#define MIN_SCORE 2
+/* intervals stepped over from label 'start' to 'end' */
+static void print_step(const struct fragment *f, size_t start, size_t end, const char *name)
+{
+	size_t k;
 
-struct node {
-	int score;
-	int delta_i;
-	int delta_j;
-};
+	printf("%s: %d { ", name, f->nicks.data[end].pos - f->nicks.data[start].pos);
+	for (k = start; k < end; ++k) {
+		if (k > start) printf(", ");
+		printf("[%zd] %d", k, f->nicks.data[k + 1].pos - f->nicks.data[k].pos);
+	}
+	printf(" }");
+}
 
-static inline int min(int a, int b) { return (a < b ? a : b); }
+static void print_matrix(const struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb)
+{
+	size_t i, j;
+
+	printf("a (%zd):\n", m->w);
+	for (i = 1; i < m->w; ++i) {
+		printf(" [%2zd] %-5d", i, fa->nicks.data[i].pos - fa->nicks.data[i - 1].pos);
+		if (i % 5 == 0) printf("\n");
+	}
+	if (i % 5 != 1) printf("\n");
 
-static int align(const struct fragment *fa, const struct fragment *fb)
+	printf("b (%zd):\n", m->h);
+	for (i = 1; i < m->h; ++i) {
+		printf(" [%2zd] %-5d", i, fb->nicks.data[i].pos - fb->nicks.data[i - 1].pos);
+		if (i % 5 == 0) printf("\n");
+	}
+	if (i % 5 != 1) printf("\n");
+
+	printf("matrix:\n");
+	for (j = 1; j < m->h; ++j) {
+		for (i = 1; i < m->w; ++i) {
+			size_t index = dp_cell(m, i, j);
+			printf("%2d/%d,%d", m->scores.data[index],
+					move_delta_i(m->moves.data[index]), move_delta_j(m->moves.data[index]));
+		}
+		printf("\n");
+	}
+}
+
+/* DP matrix of fragment a and labels of b in band, from label 'first' of b */
+static int fill_band(struct dp_matrix *m, const struct fragment *fa, const struct fragment *fb,
+		const struct ref_band *band, size_t *first)
+{
+	struct fragment window = *fb;
+	long low = (band->low > 0 ? band->low : 0);
+	long high = band->high + (long)fa->nicks.size - 1;
+
+	if (high > (long)fb->nicks.size - 1) {
+		high = (long)fb->nicks.size - 1;
+	}
+	*first = 0;
+	window.nicks.size = 0;
+	if (low <= high) {
+		*first = low;
+		window.nicks.data += low;
+		window.nicks.size = high - low + 1;
+	}
+	window.nicks.capacity = window.nicks.size;
+	return dp_matrix_fill_band(m, fa, &window, &params, band->low - low, band->high - low);
+}
+
+/*
+ * Alignments of fragment a and b, or only in band if any, kept in buffer
+ * with label pairs. Verbose messages are printed at once, under lock of
+ * stdout for other threads.
+ */
+static int align(struct align_buffer *buf, const struct fragment *fa, const struct fragment *fb,
+		size_t a, size_t b, const struct ref_band *band)
 {
-	struct node *m;
-	size_t size, i, j, delta_i, delta_j;
-	size_t *result_a, *result_b, result_a_count, result_b_count;
-	size_t w = fa->nicks.size;
-	size_t h = fb->nicks.size;
+	struct dp_matrix *m = &buf->m;
+	struct align_record *r;
+	size_t k, count, first = 0;
+	size_t *result_a, *result_b;
+	int ret = 0;
+
+	if (verbose) {
+		flockfile(stdout);
+		fprintf(stdout, "align between '%s' and '%s'", fa->name, fb->name);
+		if (band) {
+			fprintf(stdout, ", in band [%ld, %ld] of %d seeds", band->low, band->high, band->seeds);
+		}
+		fprintf(stdout, "\n");
+	}
 
-	size = sizeof(struct node) * w * h;
-	m = malloc(size);
-	if (!m) {
+	if ((band ? fill_band(m, fa, fb, band, &first) : dp_matrix_fill(m, fa, fb, &params))
+			|| dp_matrix_trace(m)) {
 		fprintf(stderr, "Error: Failed to allocate memory for DP matrix!\n");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto out;
 	}
-	memset(m, 0, size);
+	if (verbose > 0 && !m->linear && !band) {
+		print_matrix(m, fa, fb);
+	}
+
+	for (;;) {
+		count = (m->w < m->h ? m->w : m->h);
+		if (array_reserve(buf->labels_a, buf->labels_a.size + count)
+				|| array_reserve(buf->labels_b, buf->labels_b.size + count)
+				|| array_reserve(buf->records, buf->records.size + 1)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			ret = -ENOMEM;
+			break;
+		}
+		result_a = buf->labels_a.data + buf->labels_a.size;
+		result_b = buf->labels_b.data + buf->labels_b.size;
+		count = dp_matrix_next(m, result_a, result_b);
+		if (count == 0) break;
+		for (k = 0; k < count; ++k) {
+			result_b[k] += first;
+		}
 
+		if (verbose > 0) {
+			printf("---- max: %zd (%zd, %zd)\n", count - 1, result_a[0], result_b[0]);
+			for (k = 0; k + 1 < count; ++k) {
+				print_step(fa, result_a[k + 1], result_a[k], "a");
+				printf("\t");
+				print_step(fb, result_b[k + 1], result_b[k], "b");
+				printf("\n");
+			}
+		}
+		r = &buf->records.data[buf->records.size++];
+		r->a = a;
+		r->b = b;
+		r->first = buf->labels_a.size;
+		r->count = count;
+		buf->labels_a.size += count;
+		buf->labels_b.size += count;
+	}
+
+out:
 	if (verbose) {
-		fprintf(stdout, "align between '%s' and '%s'\n", fa->name, fb->name);
+		printf("==============================\n");
+		funlockfile(stdout);
 	}
+	return ret;
+}
 
-	for (j = 1; j < h; ++j) {
-		for (i = 1; i < w; ++i) {
-			size_t index = j * w + i;
+/*
+ * Alignments of tile t, from its records in buffer. With verbose messages,
+ * output is flushed at once, to be in order with them if on stdout.
+ */
+static int print_tile(const struct align_pairs *pairs, const struct align_tile *t,
+		const struct align_buffer *buf)
+{
+	const struct align_record *r;
+	size_t k;
+	int ret = 0;
 
-			for (delta_j = 1; delta_j < j; ++j) {
-				int frag_b = fb->nicks.data[j].pos - fb->nicks.data[j - delta_j].pos;
+	if (verbose > 0) {
+		fflush(stdout);
+	}
+	for (k = 0; k < t->records && ret == 0; ++k) {
+		r = &buf->records.data[t->first_record + k];
+		ret = pair_write(pairs->out, pairs->map1->fragments.data[r->a].name,
+				pairs->map2->fragments.data[r->b].name,
+				buf->labels_a.data + r->first, buf->labels_b.data + r->first, r->count);
+	}
+	if (verbose > 0 && ret == 0) {
+		ret = pair_flush(pairs->out);
+	}
+	return ret;
+}
 
-				for (delta_i = 1; delta_i < i; ++i) {
-					int frag_a = fa->nicks.data[i].pos - fa->nicks.data[i - delta_i].pos;
+static void clear_buffer(struct align_buffer *buf)
+{
+	buf->records.size = 0;
+	buf->labels_a.size = 0;
+	buf->labels_b.size = 0;
+}
 
-					if (delta_i > 1 || delta_j > 1) continue;
-					if (frag_a > frag_b * (1 + TOLERANCE)) break;
+static void free_buffer(struct align_buffer *buf)
+{
+	array_free(buf->labels_b);
+	array_free(buf->labels_a);
+	array_free(buf->records);
+	dp_matrix_free(&buf->m);
+}
 
-					if (abs(frag_a - frag_b) < min(frag_a, frag_b) * TOLERANCE) {
-						int score = m[(j - delta_j) * w + (i - delta_i)].score + 1;
-						if (m[index].score < score) {
-							m[index].score = score;
-							m[index].delta_i = delta_i;
-							m[index].delta_j = delta_j;
-						}
-					}
-				}
-			}
+static int align_tile(const struct align_pairs *pairs, struct align_tile *t,
+		struct align_buffer *buf)
+{
+	const struct ref_band *band = NULL;
+	size_t k, a, b;
+	int ret = 0;
+
+	t->first_record = buf->records.size;
+	for (k = t->first; k < t->last && ret == 0; ++k) {
+		if (pairs->bands) {
+			band = &pairs->bands->data[k];
+			a = band->fragment;
+			b = band->chrom;
+		} else {
+			a = (pairs->candidates ? pairs->candidates->data[k].a : t->a);
+			b = (pairs->candidates ? pairs->candidates->data[k].b : k);
 		}
+		ret = align(buf, &pairs->map1->fragments.data[a], &pairs->map2->fragments.data[b],
+				a, b, band);
 	}
+	t->records = buf->records.size - t->first_record;
+	return ret;
+}
 
-	if (verbose > 0) {
-		printf("a (%zd):\n", w);
-		for (i = 1; i < w; ++i) {
-			printf(" [%2zd] %-5d", i, fa->nicks.data[i].pos - fa->nicks.data[i - 1].pos);
-			if (i % 5 == 0) printf("\n");
+/* tiles of the next round, from where the last one stops */
+static void next_tiles(struct align_pairs *pairs, size_t max_tiles)
+{
+	struct align_tile *t;
+	size_t n;
+
+	pairs->tiles.size = 0;
+	if (pairs->candidates || pairs->bands) {
+		n = (pairs->candidates ? pairs->candidates->size : pairs->bands->size);
+		while (pairs->tiles.size < max_tiles && pairs->b < n) {
+			t = &pairs->tiles.data[pairs->tiles.size++];
+			t->first = pairs->b;
+			t->last = (pairs->b + TILE_SIZE < n ? pairs->b + TILE_SIZE : n);
+			pairs->b = t->last;
 		}
-		if (i % 5 != 1) printf("\n");
+		return;
+	}
 
-		printf("b (%zd):\n", h);
-		for (i = 1; i < h; ++i) {
-			printf(" [%2zd] %-5d", i, fb->nicks.data[i].pos - fb->nicks.data[i - 1].pos);
-			if (i % 5 == 0) printf("\n");
+	n = pairs->map2->fragments.size;
+	while (pairs->tiles.size < max_tiles && pairs->a < pairs->map1->fragments.size) {
+		if (pairs->b >= n) {
+			++pairs->a;
+			pairs->b = (pairs->map1 == pairs->map2 ? pairs->a + 1 : 0);
+			continue;
 		}
-		if (i % 5 != 1) printf("\n");
+		t = &pairs->tiles.data[pairs->tiles.size++];
+		t->a = pairs->a;
+		t->first = pairs->b;
+		t->last = (pairs->b + TILE_SIZE < n ? pairs->b + TILE_SIZE : n);
+		pairs->b = t->last;
+	}
+}
 
-		printf("matrix:\n");
-		for (j = 1; j < h; ++j) {
-			for (i = 1; i < w; ++i) {
-				const struct node *p = &m[j * w + i];
-				printf("%2d/%d,%d", p->score, p->delta_i, p->delta_j);
-			}
-			printf("\n");
+/* next tile of worker w, or stolen as half of what is left to another */
+static int take_tile(struct align_pairs *pairs, size_t w, size_t *tile)
+{
+	struct align_worker *p = &pairs->workers.data[w];
+	struct align_worker *v;
+	size_t k, left, first;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->next < p->end) {
+		*tile = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	for (k = 1; k < pairs->workers.size; ++k) {
+		v = &pairs->workers.data[(w + k) % pairs->workers.size];
+		pthread_mutex_lock(&v->lock);
+		left = v->end - v->next;
+		first = v->end - (left + 1) / 2;
+		v->end = first;
+		pthread_mutex_unlock(&v->lock);
+		if (left > 0) {
+			pthread_mutex_lock(&p->lock);
+			p->next = first + 1;
+			p->end = first + (left + 1) / 2;
+			pthread_mutex_unlock(&p->lock);
+			*tile = first;
+			return 1;
 		}
 	}
+	return 0;
+}
 
-	result_a = malloc(sizeof(size_t) * w);
-	result_b = malloc(sizeof(size_t) * h);
-	for (;;) {
-		int max_score = 0;
-		size_t max_score_i = 0;
-		size_t max_score_j = 0;
-
-		for (j = 0; j < h; ++j) {
-			for (i = 0; i < w; ++i) {
-				if (max_score < m[j * w + i].score) {
-					max_score = m[j * w + i].score;
-					max_score_i = i;
-					max_score_j = j;
-				}
+static void *worker_main(void *arg)
+{
+	struct align_worker *w = arg;
+	struct align_pairs *pairs = w->pairs;
+	size_t index = w - pairs->workers.data;
+	size_t round = 0, tile;
+
+	pthread_mutex_lock(&pairs->lock);
+	while (1) {
+		while (pairs->round == round && !pairs->done) {
+			pthread_cond_wait(&pairs->cond, &pairs->lock);
+		}
+		if (pairs->round == round) break;
+		round = pairs->round;
+		pthread_mutex_unlock(&pairs->lock);
+
+		while (take_tile(pairs, index, &tile)) {
+			pairs->tiles.data[tile].worker = index;
+			if (align_tile(pairs, &pairs->tiles.data[tile], &w->buf)) {
+				w->ret = -ENOMEM;
 			}
 		}
 
-		if (max_score < MIN_SCORE) break;
+		pthread_mutex_lock(&pairs->lock);
+		if (--pairs->running == 0) {
+			pthread_cond_broadcast(&pairs->cond);
+		}
+	}
+	pthread_mutex_unlock(&pairs->lock);
+	return NULL;
+}
 
-		if (verbose > 0) {
-			printf("---- max: %d (%zd, %zd)\n", max_score, max_score_i, max_score_j);
-		}
-		i = max_score_i;
-		j = max_score_j;
-		result_a_count = 0;
-		result_b_count = 0;
-		for (;;) {
-			size_t k;
-			struct node *p = &m[j * w + i];
-
-			result_a[result_a_count++] = i;
-			result_b[result_b_count++] = j;
-
-			if (p->delta_i == 0 && p->delta_j == 0) break;
-
-			if (verbose > 0) {
-				printf("a: %d { ", fa->nicks.data[i].pos - fa->nicks.data[i - p->delta_i].pos);
-				for (k = 0; k < p->delta_i; ++k) {
-					size_t index = i - p->delta_i + k;
-					if (k > 0) printf(", ");
-					printf("[%zd] %d", index, fa->nicks.data[index + 1].pos - fa->nicks.data[index].pos);
-				}
-				printf(" }\t");
+/* tiles split evenly to workers, which steal from others when done */
+static int run_round(struct align_pairs *pairs)
+{
+	size_t i, n = pairs->tiles.size, count = pairs->workers.size;
+	int ret = 0;
 
-				printf("b: %d { ", fb->nicks.data[i].pos - fb->nicks.data[i - p->delta_j].pos);
-				for (k = 0; k < p->delta_j; ++k) {
-					size_t index = j - p->delta_j + k;
-					if (k > 0) printf(", ");
-					printf("[%zd] %d", index, fb->nicks.data[index + 1].pos - fb->nicks.data[index].pos);
-				}
-				printf(" }\n");
-			}
+	pthread_mutex_lock(&pairs->lock);
+	for (i = 0; i < count; ++i) {
+		pairs->workers.data[i].next = n * i / count;
+		pairs->workers.data[i].end = n * (i + 1) / count;
+	}
+	pairs->running = count;
+	++pairs->round;
+	pthread_cond_broadcast(&pairs->cond);
+	while (pairs->running > 0) {
+		pthread_cond_wait(&pairs->cond, &pairs->lock);
+	}
+	pthread_mutex_unlock(&pairs->lock);
 
-			i -= p->delta_i;
-			j -= p->delta_j;
-			p->score = 0;
+	for (i = 0; i < count; ++i) {
+		if (pairs->workers.data[i].ret) {
+			ret = pairs->workers.data[i].ret;
 		}
+	}
+	for (i = 0; i < n && ret == 0; ++i) {
+		ret = print_tile(pairs, &pairs->tiles.data[i],
+				&pairs->workers.data[pairs->tiles.data[i].worker].buf);
+	}
+	for (i = 0; i < count; ++i) {
+		clear_buffer(&pairs->workers.data[i].buf);
+	}
+	return ret;
+}
 
-		{
-			static int count = 0;
-			fprintf(stdout, ">0\t%d\t%s\t%s\n", ++count, fa->name, fb->name);
-		}
-		for (i = 0; i < result_a_count; ++i) {
-			fprintf(stdout, "%s%zd", (i == 0 ? "" : "\t"), result_a[i]);
+static int start_workers(struct align_pairs *pairs)
+{
+	struct align_worker *w;
+	size_t i;
+
+	pthread_mutex_init(&pairs->lock, NULL);
+	pthread_cond_init(&pairs->cond, NULL);
+	if (array_reserve(pairs->workers, threads)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		return -ENOMEM;
+	}
+	memset(pairs->workers.data, 0, sizeof(struct align_worker) * threads);
+	for (i = 0; i < threads; ++i) {
+		w = &pairs->workers.data[i];
+		w->pairs = pairs;
+		dp_matrix_init(&w->buf.m);
+		pthread_mutex_init(&w->lock, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			fprintf(stderr, "Error: Failed to create thread!\n");
+			pthread_mutex_destroy(&w->lock);
+			return -1;
 		}
-		fprintf(stdout, "\n");
-		for (i = 0; i < result_b_count; ++i) {
-			fprintf(stdout, "%s%zd", (i == 0 ? "" : "\t"), result_b[i]);
+		++pairs->workers.size;
+	}
+	return 0;
+}
+
+static void stop_workers(struct align_pairs *pairs)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pairs->lock);
+	pairs->done = 1;
+	pthread_cond_broadcast(&pairs->cond);
+	pthread_mutex_unlock(&pairs->lock);
+	for (i = 0; i < pairs->workers.size; ++i) {
+		pthread_join(pairs->workers.data[i].thread, NULL);
+		pthread_mutex_destroy(&pairs->workers.data[i].lock);
+		free_buffer(&pairs->workers.data[i].buf);
+	}
+	pthread_cond_destroy(&pairs->cond);
+	pthread_mutex_destroy(&pairs->lock);
+	array_free(pairs->workers);
+}
+
+/*
+ * Pairs are aligned by tiles, of TILE_SIZE fragments of 'b' (or candidate
+ * pairs, or bands) each. With more than one thread, a round of tiles is aligned by
+ * workers at once, and alignments are printed in order of tiles after it.
+ */
+static int align_pairs(struct align_pairs *pairs)
+{
+	struct align_buffer buf;
+	size_t i;
+	int ret = 0;
+
+	if (array_reserve(pairs->tiles, ROUND_TILES * threads)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		return -ENOMEM;
+	}
+	if (threads > 1) {
+		if ((ret = start_workers(pairs)) == 0) {
+			do {
+				next_tiles(pairs, ROUND_TILES * threads);
+			} while (pairs->tiles.size > 0 && (ret = run_round(pairs)) == 0);
 		}
-		fprintf(stdout, "\n");
+		stop_workers(pairs);
+	} else {
+		memset(&buf, 0, sizeof(buf));
+		dp_matrix_init(&buf.m);
+		do {
+			next_tiles(pairs, ROUND_TILES);
+			for (i = 0; i < pairs->tiles.size && ret == 0; ++i) {
+				ret = align_tile(pairs, &pairs->tiles.data[i], &buf);
+				if (ret == 0) {
+					ret = print_tile(pairs, &pairs->tiles.data[i], &buf);
+				}
+				clear_buffer(&buf);
+			}
+		} while (pairs->tiles.size > 0 && ret == 0);
+		free_buffer(&buf);
 	}
-	free(result_b);
-	free(result_a);
+	array_free(pairs->tiles);
+	return ret;
+}
 
-	free(m);
-	if (verbose) {
-		printf("==============================\n");
+/* pairs sharing minimizers, with others skipped as unlikely to be aligned */
+static int find_candidates(const struct nick_map *map1, const struct nick_map *map2,
+		sketch_pairs_t *candidates)
+{
+	struct map_sketch sketch;
+	int ret = 0;
+
+	map_sketch_init(&sketch);
+	if (map_sketch_build(&sketch, map2, &sketch_params)
+			|| map_sketch_pairs(&sketch, map1, (map1 == map2), candidates)) {
+		fprintf(stderr, "Error: Failed to allocate memory for sketch!\n");
+		ret = -ENOMEM;
+	} else if (verbose > 0) {
+		fprintf(stderr, "%zd candidate pairs, from %zd minimizers\n",
+				candidates->size, sketch.items.size);
 	}
-	return 0;
+	map_sketch_free(&sketch);
+	return ret;
 }
 
-static int align_between_maps(const struct nick_map *map1, const struct nick_map *map2)
+static int align_between_maps(const struct nick_map *map1, const struct nick_map *map2,
+		struct pair_file *out)
 {
-	size_t i, j;
-	fprintf(stdout, "#>0\tAlignmentID\tMol0ID\tMol1ID\n");
-	for (i = 0; i < map1->fragments.size; ++i) {
-		for (j = (map1 == map2 ? i + 1: 0); j < map2->fragments.size; ++j) {
-			align(&map1->fragments.data[i], &map2->fragments.data[j]);
+	struct align_pairs pairs;
+	sketch_pairs_t candidates = { };
+	int ret = 0;
+
+	memset(&pairs, 0, sizeof(pairs));
+	pairs.map1 = map1;
+	pairs.map2 = map2;
+	pairs.b = (map1 == map2 ? 1 : 0);
+	pairs.out = out;
+
+	if (sketch_params.min_hits > 0) {
+		ret = find_candidates(map1, map2, &candidates);
+		pairs.candidates = &candidates;
+		pairs.b = 0;
+	}
+	if (ret == 0) {
+		ret = align_pairs(&pairs);
+	}
+	array_free(candidates);
+	return (ret ? 1 : 0);
+}
+
+/* bands of fragments onto chroms, from seeds in index of reference */
+static int align_onto_reference(const struct nick_map *map, const struct ref_map *ref,
+		struct pair_file *out)
+{
+	struct align_pairs pairs;
+	ref_bands_t bands = { };
+	int ret = 0;
+
+	if (ref_map_bands(ref, map, &band_params, &bands)) {
+		fprintf(stderr, "Error: Failed to allocate memory for seeds!\n");
+		ret = -ENOMEM;
+	} else {
+		if (verbose > 0) {
+			fprintf(stderr, "%zd bands of seeds, from index of %zd items\n",
+					bands.size, ref->index_.size);
 		}
+		memset(&pairs, 0, sizeof(pairs));
+		pairs.map1 = map;
+		pairs.map2 = &ref->map;
+		pairs.bands = &bands;
+		pairs.out = out;
+		ret = align_pairs(&pairs);
+	}
+	array_free(bands);
+	return (ret ? 1 : 0);
+}
+
+/* reference map, with its index from file, or built if not found */
+static int load_reference(const char *filename, struct ref_map *ref)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+
+	if (nick_map_load(&ref->map, filename)) {
+		return -EINVAL;
+	}
+	get_index_filename(filename, path, sizeof(path));
+	if (strcmp(path, "-") == 0 || (stat(path, &sb) == -1 && errno == ENOENT)) {
+		if (verbose > 0) {
+			fprintf(stderr, "Building index of forward intervals for '%s'\n", filename);
+		}
+		if (ref_map_build_index(ref, INDEX_FORWARD)) {
+			fprintf(stderr, "Error: Failed to allocate memory for index!\n");
+			return -ENOMEM;
+		}
+	} else if (ref_map_load(ref, path)) {
+		return -EINVAL;
 	}
 	return 0;
 }
@@ -202,8 +662,102 @@ static int align_between_maps(const struct nick_map *map1, const struct nick_map
 static int check_options(int argc, char * const argv[])
 {
 	int c;
-	while ((c = getopt(argc, argv, "vh")) != -1) {
+	while ((c = getopt(argc, argv, "o:f:e:d:m:M:c:k:w:r:t:Rs:n:b:Dvh")) != -1) {
 		switch (c) {
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			output_format = parse_pair_format(optarg);
+			if (output_format == PAIR_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'e':
+			params.tolerance = atof(optarg);
+			if (params.tolerance <= 0 || params.tolerance >= 1) {
+				fprintf(stderr, "Error: Invalid tolerance '%s'!\n", optarg);
+				return 1;
+			}
+			sketch_params.tolerance = params.tolerance;
+			band_params.tolerance = params.tolerance;
+			break;
+		case 'd':
+			params.max_delta = atoi(optarg);
+			if (params.max_delta < 1 || params.max_delta > MAX_DELTA) {
+				fprintf(stderr, "Error: Invalid max intervals merged '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			params.min_score = atoi(optarg);
+			if (params.min_score < 1) {
+				fprintf(stderr, "Error: Invalid minimal matched intervals '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'M':
+			params.max_memory = (size_t)atoi(optarg) << 20;
+			break;
+		case 'c':
+			sketch_params.min_hits = atoi(optarg);
+			break;
+		case 'k':
+			sketch_params.k = atoi(optarg);
+			if (sketch_params.k < 1) {
+				fprintf(stderr, "Error: Invalid intervals of a tuple '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'w':
+			sketch_params.window = atoi(optarg);
+			if (sketch_params.window < 1) {
+				fprintf(stderr, "Error: Invalid tuples of a window '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			sketch_params.max_hits = atoi(optarg);
+			if (sketch_params.max_hits < 1) {
+				fprintf(stderr, "Error: Invalid max fragments of a minimizer '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads <= 0) {
+				fprintf(stderr, "Error: Invalid number of threads '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			reference = 1;
+			break;
+		case 's':
+			band_params.seed_size = atoi(optarg);
+			if (band_params.seed_size < 1) {
+				fprintf(stderr, "Error: Invalid intervals of a seed '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			band_params.min_seeds = atoi(optarg);
+			if (band_params.min_seeds < 1) {
+				fprintf(stderr, "Error: Invalid minimal seeds of a band '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			band_params.margin = atoi(optarg);
+			if (band_params.margin < 0) {
+				fprintf(stderr, "Error: Invalid diagonals around seeds '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'D':
+			decode = 1;
+			break;
 		case 'v':
 			++verbose;
 			break;
@@ -213,15 +767,39 @@ static int check_options(int argc, char * const argv[])
 			return 1;
 		}
 	}
-	if (optind >= argc || optind + 2 < argc) {
+	if (optind >= argc || optind + 2 < argc || (reference && optind + 2 != argc)
+			|| (decode && optind + 1 != argc)) {
 		print_usage();
 		return 1;
 	}
 	return 0;
 }
 
+/* binary alignments of file, into output */
+static int decode_alignments(const char *filename, struct pair_file *out)
+{
+	struct pair_file *in;
+	struct pair_record r;
+	int ret;
+
+	in = pair_open_read(filename);
+	if (!in) {
+		return 1;
+	}
+	pair_record_init(&r);
+	while ((ret = pair_read(in, &r)) == 0) {
+		ret = pair_write(out, r.name_a, r.name_b, r.labels_a.data, r.labels_b.data,
+				r.labels_a.size);
+		if (ret) break;
+	}
+	pair_record_free(&r);
+	pair_close(in);
+	return (ret == -1 ? 0 : 1);
+}
+
 int align_main(int argc, char * const argv[])
 {
+	struct pair_file *out;
 	struct nick_map map;
 	int ret;
 
@@ -229,25 +807,57 @@ int align_main(int argc, char * const argv[])
 		return 1;
 	}
 
+	out = pair_open_write(output_file, output_format);
+	if (!out) {
+		return 1;
+	}
+	if (verbose > 0 && pair_flush(out)) {  /* header before messages */
+		pair_close(out);
+		return 1;
+	}
+	if (decode) {
+		ret = decode_alignments(argv[optind], out);
+		if (pair_close(out)) {
+			ret = 1;
+		}
+		return ret;
+	}
+
 	nick_map_init(&map);
 	if (nick_map_load(&map, argv[optind])) {
 		nick_map_free(&map);
+		pair_close(out);
 		return 1;
 	}
 
-	if (optind + 1 >= argc) {
-		ret = align_between_maps(&map, &map);
+	if (reference) {
+		struct ref_map ref;
+		ref_map_init(&ref);
+		if (load_reference(argv[optind + 1], &ref)) {
+			ref_map_free(&ref);
+			nick_map_free(&map);
+			pair_close(out);
+			return 1;
+		}
+		ret = align_onto_reference(&map, &ref, out);
+		ref_map_free(&ref);
+	} else if (optind + 1 >= argc) {
+		ret = align_between_maps(&map, &map, out);
 	} else {
 		struct nick_map map2;
 		nick_map_init(&map2);
 		if (nick_map_load(&map2, argv[optind + 1])) {
 			nick_map_free(&map2);
 			nick_map_free(&map);
+			pair_close(out);
 			return 1;
 		}
-		ret = align_between_maps(&map, &map2);
+		ret = align_between_maps(&map, &map2, out);
 		nick_map_free(&map2);
 	}
 	nick_map_free(&map);
+	if (pair_close(out)) {
+		ret = 1;
+	}
 	return ret;
 }
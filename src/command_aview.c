@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "aln_file.h"
+
+#define DEF_OUTPUT "stdout"
+#define DEF_FORMAT "txt"
+
+struct region {
+	char name[MAX_FRAGMENT_NAME_SIZE + 1];
+	int start;
+	int end;  /* 0 for end of chrom */
+};
+
+static int verbose = 0;
+static int help = 0;
+
+static const char *output_file = DEF_OUTPUT;
+static int out_format = ALN_FORMAT_TXT;
+static int indexing = 0;
+static array(struct region) regions = { };
+
+static void print_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools aview [options] <input>\n"
+			"\n"
+			"Options:\n"
+			"   <input>        alignment file from 'map', in txt/bin format\n"
+			"   -o FILE        output file ["DEF_OUTPUT"]\n"
+			"   -f STR         output format, txt/xmap/bin, xmap only from bin\n"
+			"                  input ["DEF_FORMAT"]\n"
+			"   -r STR         select alignments overlapping region(s),\n"
+			"                  only for indexed bin input\n"
+			"   -i             build position index of bin input\n"
+			"   -v             show verbose message\n"
+			"   -h             show this help, '-hh' for more detail help\n"
+			"\n");
+	if (help > 1) {
+		fprintf(stderr, "Note:\n"
+				"   Region string is formatted as: <name>:<start>-<end>, where <name>\n"
+				"is a reference chrom name without ':', <start> and <end> are numbers\n"
+				"in bp, with <end> 0 or omitted for the end of chrom.\n"
+				"   Index of bin file is saved as '<input>.bni', which is also written\n"
+				"by 'map' when outputting bin format into a file.\n"
+				"\n");
+	}
+}
+
+static int append_region(const char *s)
+{
+	struct region *r;
+	const char *p;
+
+	if (array_reserve(regions, regions.size + 1)) {
+		return -ENOMEM;
+	}
+	r = &regions.data[regions.size];
+	r->start = 0;
+	r->end = 0;
+
+	p = strchr(s, ':');
+	if (p) {
+		snprintf(r->name, sizeof(r->name), "%.*s", (int)(p - s), s);
+		if (sscanf(p + 1, "%d-%d", &r->start, &r->end) < 1
+				|| r->start < 0 || r->end < 0 || (r->end > 0 && r->end < r->start)) {
+			fprintf(stderr, "Error: Invalid region '%s'!\n", s);
+			return 1;
+		}
+	} else {
+		snprintf(r->name, sizeof(r->name), "%s", s);
+	}
+	++regions.size;
+	return 0;
+}
+
+static int check_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "o:f:r:ivh")) != -1) {
+		switch (c) {
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			out_format = parse_aln_format(optarg);
+			if (out_format == ALN_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (append_region(optarg)) {
+				return 1;
+			}
+			break;
+		case 'i':
+			indexing = 1;
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'h':
+			++help;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (help || optind + 1 != argc) {
+		print_usage();
+		return 1;
+	}
+	return 0;
+}
+
+/* collect chroms of text input, which are needed before writing bin */
+static int scan_chroms(const char *filename, struct aln_header *header)
+{
+	struct aln_file *in;
+	struct alignment a;
+	size_t i;
+	int ret;
+
+	if (strcmp(filename, "-") == 0 || strcmp(filename, "stdin") == 0) {
+		fprintf(stderr, "Error: Can not convert txt from stdin into bin\n");
+		return -EINVAL;
+	}
+	in = aln_open_read(filename);
+	if (!in) {
+		return -EINVAL;
+	}
+	alignment_init(&a);
+	while ((ret = aln_read(in, &a)) == 0) { }
+	alignment_free(&a);
+
+	if (ret == -1) {
+		ret = 0;
+		for (i = 0; i < in->header.chroms.size; ++i) {
+			const struct aln_chrom *c = &in->header.chroms.data[i];
+			if (aln_header_add_chrom(header, c->name, c->size)) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+	}
+	aln_close(in);
+	return ret;
+}
+
+/* chroms of text input are known only as read */
+static int add_new_chroms(const struct aln_file *in, struct aln_file *out)
+{
+	size_t i;
+
+	for (i = out->header.chroms.size; i < in->header.chroms.size; ++i) {
+		const struct aln_chrom *c = &in->header.chroms.data[i];
+		if (aln_header_add_chrom(&out->header, c->name, c->size)) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static int view_regions(struct aln_file *in, struct aln_file *out)
+{
+	struct aln_index index;
+	struct alignment a;
+	size_t i, j, first, last;
+	int chrom, end, ret = 0;
+
+	aln_index_init(&index);
+	if (aln_index_load(in, &index)) {
+		fprintf(stderr, "Error: Failed to load index of '%s', "
+				"which could be built by '-i'\n", in->name);
+		aln_index_free(&index);
+		return -EINVAL;
+	}
+
+	alignment_init(&a);
+	for (i = 0; i < regions.size && ret == 0; ++i) {
+		const struct region *r = &regions.data[i];
+		chrom = aln_header_find_chrom(&in->header, r->name);
+		if (chrom < 0) {
+			if (verbose > 0) {
+				fprintf(stderr, "Warning: Unknown chrom '%s'\n", r->name);
+			}
+			continue;
+		}
+		end = (r->end > 0 ? r->end : INT_MAX);
+		aln_index_query(&index, chrom, r->start, end, &first, &last);
+		for (j = first; j < last; ++j) {
+			const struct aln_index_item *item = &index.items.data[j];
+			if (item->end < r->start) continue;
+			ret = aln_read_at(in, item->offset, &a);
+			if (ret == 0) {
+				ret = aln_write(out, &a);
+			}
+			if (ret) break;
+		}
+	}
+	alignment_free(&a);
+	aln_index_free(&index);
+	return ret;
+}
+
+int aview_main(int argc, char * const argv[])
+{
+	struct aln_file *in = NULL;
+	struct aln_file *out = NULL;
+	struct aln_header header;
+	struct alignment a;
+	const char *input;
+	int ret = 0;
+
+	aln_header_init(&header);
+	alignment_init(&a);
+	if (check_options(argc, argv)) {
+		ret = 1;
+		goto out;
+	}
+	input = argv[optind];
+
+	if (indexing) {
+		if (aln_build_index(input)) {
+			ret = 1;
+			goto out;
+		}
+		if (regions.size == 0 && strcmp(output_file, DEF_OUTPUT) == 0) {
+			goto out;  /* only to build index */
+		}
+	}
+
+	in = aln_open_read(input);
+	if (!in) {
+		ret = 1;
+		goto out;
+	}
+	if (regions.size > 0 && in->format != ALN_FORMAT_BIN) {
+		fprintf(stderr, "Error: Region selection needs indexed bin input\n");
+		ret = 1;
+		goto out;
+	}
+	if (in->format == ALN_FORMAT_TXT && out_format == ALN_FORMAT_XMAP) {
+		fprintf(stderr, "Error: Can not convert txt into xmap, "
+				"which needs query positions kept only in bin\n");
+		ret = 1;
+		goto out;
+	}
+
+	if (in->format == ALN_FORMAT_TXT && out_format == ALN_FORMAT_BIN) {
+		if (scan_chroms(input, &header)) {
+			ret = 1;
+			goto out;
+		}
+		out = aln_open_write(output_file, out_format, &header);
+	} else {
+		out = aln_open_write(output_file, out_format, &in->header);
+	}
+	if (!out) {
+		ret = 1;
+		goto out;
+	}
+
+	if (regions.size > 0) {
+		if (view_regions(in, out)) {
+			ret = 1;
+		}
+	} else {
+		while ((ret = aln_read(in, &a)) == 0) {
+			if (add_new_chroms(in, out) || aln_write(out, &a)) break;
+		}
+		ret = (ret == -1 ? 0 : 1);
+	}
+
+out:
+	if (aln_close(out)) {
+		ret = 1;
+	}
+	aln_close(in);
+	alignment_free(&a);
+	aln_header_free(&header);
+	array_free(regions);
+	return ret;
+}
@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ref_map.h"
+#include "bn_file.h"
+#include "aln_file.h"
+
+#define DEF_OUTPUT "stdout"
+#define DEF_BIN_SIZE 0
+#define DEF_THREADS 1
+#define BLOCK_SIZE 4096
+
+struct span {  /* of an alignment on reference */
+	size_t first, last;  /* nodes of first/last labels */
+	size_t bin_base;     /* first bin of chrom */
+	int start, end;      /* in bp */
+};
+
+struct span_block {
+	array(struct span) spans;
+};
+
+struct track {  /* difference arrays */
+	array(int) labels;       /* by node */
+	array(int) bins;         /* by bin, of fully covered bins */
+	array(int64_t) partial;  /* by bin, of bp partially covered */
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int busy;  /* with a block to process */
+	int done;  /* no more blocks */
+	struct span_block block;
+	struct track track;
+};
+
+static int verbose = 0;
+static const char *output_file = DEF_OUTPUT;
+static int bin_size = DEF_BIN_SIZE;
+static int threads = DEF_THREADS;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools depth [options] <ref> <input>\n"
+			"\n"
+			"Options:\n"
+			"   <ref>       reference genome, in tsv/cmap format\n"
+			"   <input>     alignment file from 'map', in txt/bin format,\n"
+			"               sorted or not\n"
+			"   -o FILE     output file ["DEF_OUTPUT"]\n"
+			"   -B INT      output mean depth of bins of INT bp, instead of\n"
+			"               depth of each reference label, 0 for labels [%d]\n"
+			"   -t INT      number of threads to accumulate depth [%d]\n"
+			"   -v          show verbose message\n"
+			"   -h          show this help\n"
+			"\n", DEF_BIN_SIZE, DEF_THREADS);
+}
+
+static int check_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "o:B:t:vh")) != -1) {
+		switch (c) {
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'B':
+			bin_size = atoi(optarg);
+			if (bin_size < 0) {
+				fprintf(stderr, "Error: Invalid bin size '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads <= 0) {
+				fprintf(stderr, "Error: Invalid number of threads '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'h':
+			print_usage();
+		default:
+			return 1;
+		}
+	}
+	if (optind + 2 != argc) {
+		print_usage();
+		return 1;
+	}
+	return 0;
+}
+
+static inline size_t bin_count(int size)
+{
+	return (bin_size > 0 ? ((size_t)size + bin_size - 1) / bin_size : 0);
+}
+
+static int track_init(struct track *t, size_t node_count, size_t total_bins)
+{
+	array_init(t->labels);
+	array_init(t->bins);
+	array_init(t->partial);
+	if (array_reserve(t->labels, node_count + 1)
+			|| array_reserve(t->bins, total_bins + 1)
+			|| array_reserve(t->partial, total_bins + 1)) {
+		return -ENOMEM;
+	}
+	t->labels.size = node_count + 1;
+	t->bins.size = total_bins + 1;
+	t->partial.size = total_bins + 1;
+	return 0;
+}
+
+static void track_free(struct track *t)
+{
+	array_free(t->labels);
+	array_free(t->bins);
+	array_free(t->partial);
+}
+
+static void track_add(struct track *t, const struct track *other)
+{
+	size_t i;
+	for (i = 0; i < t->labels.size; ++i) {
+		t->labels.data[i] += other->labels.data[i];
+	}
+	for (i = 0; i < t->bins.size; ++i) {
+		t->bins.data[i] += other->bins.data[i];
+		t->partial.data[i] += other->partial.data[i];
+	}
+}
+
+static void accumulate(struct track *t, const struct span *spans, size_t count)
+{
+	size_t i, b0, b1;
+
+	for (i = 0; i < count; ++i) {
+		const struct span *s = &spans[i];
+
+		++t->labels.data[s->first];
+		--t->labels.data[s->last + 1];
+
+		if (bin_size > 0 && s->end > s->start) {
+			b0 = s->bin_base + s->start / bin_size;
+			b1 = s->bin_base + (s->end - 1) / bin_size;
+			if (b0 == b1) {
+				t->partial.data[b0] += s->end - s->start;
+			} else {
+				t->partial.data[b0] += (s->start / bin_size + 1) * (int64_t)bin_size - s->start;
+				t->partial.data[b1] += s->end - (s->end - 1) / bin_size * (int64_t)bin_size;
+				++t->bins.data[b0 + 1];
+				--t->bins.data[b1];
+			}
+		}
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->busy && !w->done) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (!w->busy) break;
+		pthread_mutex_unlock(&w->lock);
+
+		accumulate(&w->track, w->block.spans.data, w->block.spans.size);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy = 0;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* hand over the block to the worker, with an empty one in exchange */
+static void dispatch(struct worker *w, struct span_block *block)
+{
+	struct span_block tmp;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->busy) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	tmp = w->block;
+	w->block = *block;
+	*block = tmp;
+	w->busy = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void finish(struct worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+}
+
+static int find_chrom(const struct ref_map *ref, const char *name)
+{
+	size_t i;
+	for (i = 0; i < ref->map.fragments.size; ++i) {
+		if (strcmp(ref->map.fragments.data[i].name, name) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static int output_labels(gzFile file, const struct ref_map *ref, const struct track *t)
+{
+	size_t i;
+	int depth = 0;
+
+	gzprintf(file, "#chrom\tlabel\tpos\tdepth\n");
+	for (i = 0; i < ref->nodes.size; ++i) {
+		const struct ref_node *n = &ref->nodes.data[i];
+		depth += t->labels.data[i];
+		if ((n->flag & FIRST_INTERVAL) != 0) continue;
+		gzprintf(file, "%s\t%zd\t%d\t%d\n",
+				ref->map.fragments.data[n->chrom].name, n->label, n->pos, depth);
+	}
+	return 0;
+}
+
+static int output_bins(gzFile file, const struct ref_map *ref, const struct track *t)
+{
+	size_t i, j, k;
+	int full = 0;
+
+	gzprintf(file, "#chrom\tstart\tend\tdepth\n");
+	for (i = 0, k = 0; i < ref->map.fragments.size; ++i) {
+		const struct fragment *f = &ref->map.fragments.data[i];
+		for (j = 0; j < bin_count(f->size); ++j, ++k) {
+			int start = j * bin_size;
+			int end = (start + bin_size < f->size ? start + bin_size : f->size);
+			full += t->bins.data[k];
+			gzprintf(file, "%s\t%d\t%d\t%.2f\n", f->name, start, end,
+					(t->partial.data[k] + (int64_t)full * (end - start)) / (double)(end - start));
+		}
+	}
+	return 0;
+}
+
+int depth_main(int argc, char * const argv[])
+{
+	struct ref_map ref;
+	struct aln_file *in = NULL;
+	struct alignment a;
+	struct track track = { };
+	array(struct worker) workers = { };
+	struct span_block block = { };
+	array(size_t) first_nodes = { };  /* of each ref chrom, or SIZE_MAX */
+	array(size_t) bin_bases = { };    /* of each ref chrom */
+	array(int) chroms = { };          /* ref chrom of each chrom in input */
+	size_t i, k, total_bins;
+	gzFile file = NULL;
+	int err, ret = 0;
+
+	if (check_options(argc, argv)) {
+		return 1;
+	}
+
+	ref_map_init(&ref);
+	alignment_init(&a);
+	if (nick_map_load(&ref.map, argv[optind]) || ref_map_prepare_nodes(&ref)) {
+		ret = 1;
+		goto out;
+	}
+
+	if (array_reserve(first_nodes, ref.map.fragments.size)
+			|| array_reserve(bin_bases, ref.map.fragments.size)
+			|| array_reserve(block.spans, BLOCK_SIZE)) {
+		goto nomem;
+	}
+	for (i = 0, total_bins = 0; i < ref.map.fragments.size; ++i) {
+		first_nodes.data[i] = SIZE_MAX;
+		bin_bases.data[i] = total_bins;
+		total_bins += bin_count(ref.map.fragments.data[i].size);
+	}
+	for (i = 0; i < ref.nodes.size; ++i) {
+		if ((ref.nodes.data[i].flag & FIRST_INTERVAL) != 0) {
+			first_nodes.data[ref.nodes.data[i].chrom] = i;
+		}
+	}
+	if (track_init(&track, ref.nodes.size, total_bins)) {
+		goto nomem;
+	}
+
+	if (threads > 1) {
+		if (array_reserve(workers, threads)) {
+			goto nomem;
+		}
+		for (i = 0; i < threads; ++i) {
+			struct worker *w = &workers.data[i];
+			if (track_init(&w->track, ref.nodes.size, total_bins)) {
+				goto nomem;
+			}
+			pthread_mutex_init(&w->lock, NULL);
+			pthread_cond_init(&w->cond, NULL);
+			if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+				fprintf(stderr, "Error: Failed to create thread!\n");
+				ret = 1;
+				goto out;
+			}
+			++workers.size;
+		}
+	}
+
+	in = aln_open_read(argv[optind + 1]);
+	if (!in) {
+		ret = 1;
+		goto out;
+	}
+
+	k = 0;
+	do {
+		if (array_reserve(block.spans, BLOCK_SIZE)) {  /* maybe exchanged */
+			goto nomem;
+		}
+		block.spans.size = 0;
+		while (block.spans.size < BLOCK_SIZE && (err = aln_read(in, &a)) == 0) {
+			struct span *s;
+			size_t first, count;
+			int c;
+
+			for (i = chroms.size; i < in->header.chroms.size; ++i) {  /* new chroms */
+				if (array_reserve(chroms, i + 1)) {
+					goto nomem;
+				}
+				chroms.data[chroms.size++] = find_chrom(&ref,
+						in->header.chroms.data[i].name);
+			}
+			c = chroms.data[a.chrom];
+			if (c < 0 || first_nodes.data[c] == SIZE_MAX) {
+				if (verbose > 0) {
+					fprintf(stderr, "Warning: Skip alignment of '%s' to unknown chrom '%s'\n",
+							a.name, in->header.chroms.data[a.chrom].name);
+				}
+				continue;
+			}
+			first = first_nodes.data[c];
+			count = ref.map.fragments.data[c].nicks.size;
+
+			s = &block.spans.data[block.spans.size++];
+			s->first = first + (a.rstart < a.rend ? a.rstart : a.rend);
+			s->last = first + (a.rstart < a.rend ? a.rend : a.rstart);
+			if (s->first < first + 1) s->first = first + 1;
+			if (s->last > first + count) s->last = first + count;
+			s->bin_base = bin_bases.data[c];
+			s->start = (a.pos > 0 ? a.pos : 0);
+			s->end = (a.pos + a.size < ref.map.fragments.data[c].size
+					? a.pos + a.size : ref.map.fragments.data[c].size);
+		}
+		if (err != 0 && err != -1) {
+			ret = 1;
+			goto out;
+		}
+		if (workers.size > 0) {
+			dispatch(&workers.data[k++ % workers.size], &block);
+		} else {
+			accumulate(&track, block.spans.data, block.spans.size);
+		}
+	} while (err == 0);
+
+	for (i = 0; i < workers.size; ++i) {
+		finish(&workers.data[i]);
+		track_add(&track, &workers.data[i].track);
+	}
+	workers.size = 0;
+
+	file = open_gzfile_write(output_file);
+	if (!file) {
+		ret = 1;
+		goto out;
+	}
+	if (bin_size > 0) {
+		output_bins(file, &ref, &track);
+	} else {
+		output_labels(file, &ref, &track);
+	}
+	goto out;
+
+nomem:
+	fprintf(stderr, "Error: Failed to allocate memory!\n");
+	ret = 1;
+out:
+	for (i = 0; i < workers.size; ++i) {
+		finish(&workers.data[i]);
+	}
+	for (i = 0; i < workers.capacity; ++i) {
+		track_free(&workers.data[i].track);
+		array_free(workers.data[i].block.spans);
+	}
+	if (file) {
+		gzclose(file);
+	}
+	aln_close(in);
+	array_free(workers);
+	array_free(chroms);
+	array_free(bin_bases);
+	array_free(first_nodes);
+	array_free(block.spans);
+	track_free(&track);
+	alignment_free(&a);
+	ref_map_free(&ref);
+	return ret;
+}
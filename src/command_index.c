@@ -8,6 +8,10 @@
 #endif
 
 static int verbose = 0;
+static int index_flags = 0;
+static int sharding = 0;
+static const char *shared_name = NULL;
+static const char *removed_name = NULL;
 
 static void print_usage(void)
 {
@@ -16,20 +20,46 @@ static void print_usage(void)
 			"\n"
 			"Options:\n"
 			"   <ref>   reference genome, in tsv/cmap format\n"
+			"   -M      also index adjacent intervals merged, for missing labels\n"
+			"   -F      index forward strand only, for half size of index\n"
+			"   -S      save index in shards by chrom, instead of a whole file\n"
+			"   -P STR  publish reference and index into shared memory STR\n"
+			"   -R STR  remove reference published as STR, without <ref>\n"
 			"   -v      show verbose message\n"
 			"   -h      show this help\n"
 			"\n"
 			"Note:\n"
 			"   Index file will be saved as '<NAME>.idx.gz', unless input <ref>\n"
 			"is '-' or 'stdin'. In such case, the index will be output to stdout.\n"
+			"   With '-S', each chrom is saved as '<NAME>.<CHROM>.idx.gz', so that\n"
+			"'map -C' could load only index of the chroms needed.\n"
+			"   With '-P', the index is kept in shared memory (like '/dev/shm/STR')\n"
+			"instead of a file, until removed by '-R' or reboot. Concurrent 'map'\n"
+			"processes could attach it by <ref> as 'shm:STR', paying the memory\n"
+			"only once per machine.\n"
 			"\n");
 }
 
 static int check_options(int argc, char * const argv[])
 {
 	int c;
-	while ((c = getopt(argc, argv, "vh")) != -1) {
+	while ((c = getopt(argc, argv, "MFSP:R:vh")) != -1) {
 		switch (c) {
+		case 'M':
+			index_flags |= INDEX_MERGED;
+			break;
+		case 'F':
+			index_flags |= INDEX_FORWARD;
+			break;
+		case 'S':
+			sharding = 1;
+			break;
+		case 'P':
+			shared_name = optarg;
+			break;
+		case 'R':
+			removed_name = optarg;
+			break;
 		case 'v':
 			++verbose;
 			break;
@@ -39,6 +69,9 @@ static int check_options(int argc, char * const argv[])
 			return 1;
 		}
 	}
+	if (removed_name && optind == argc) {
+		return 0;
+	}
 	if (optind + 1 != argc) {
 		print_usage();
 		return 1;
@@ -54,14 +87,33 @@ int index_main(int argc, char * const argv[])
 	if (check_options(argc, argv)) {
 		return 1;
 	}
+	if (removed_name) {
+		if (ref_map_unpublish(removed_name)) {
+			return 1;
+		}
+		fprintf(stderr, "Shared reference '%s' removed.\n", removed_name);
+		return 0;
+	}
 	get_index_filename(argv[optind], path, sizeof(path));
 
 	ref_map_init(&ref);
 	if (nick_map_load(&ref.map, argv[optind])) {
 		return 1;
 	}
-	ref_map_build_index(&ref);
-	if (ref_map_save(&ref, path)) {
+	ref_map_build_index(&ref, index_flags);
+	if (shared_name) {
+		if (ref_map_publish(&ref, shared_name)) {
+			ref_map_free(&ref);
+			return 1;
+		}
+		snprintf(path, sizeof(path), SHARED_PREFIX "%s", shared_name);
+	} else if (sharding && strcmp(path, "-") != 0) {
+		if (ref_map_save_shards(&ref, argv[optind])) {
+			ref_map_free(&ref);
+			return 1;
+		}
+		get_shard_filename(argv[optind], "*", path, sizeof(path));
+	} else if (ref_map_save(&ref, path)) {
 		ref_map_free(&ref);
 		return 1;
 	}
@@ -1,22 +1,78 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #include "nick_map.h"
 #include "ref_map.h"
 #include "bn_file.h"
+#include "aln_file.h"
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
 
 #define DEF_TOLERANCE 0.1
+#define SIGMA_TIMES 3
 #define DEF_MIN_MATCH 4
+#define DEF_MAX_UNIQ 0
+#define DEF_MAX_CAND 0
+#define DEF_MIN_VOTES 0
+#define DEF_BIN_SIZE 5000
+#define DEF_BATCH_SIZE 0
+#define DEF_MAX_EXTEND 0
+#define DEF_MAX_TIME 0
+#define DEF_SOCKET "bntools.sock"
+#define DEF_THREADS 4
+#define REQUEST_MAP "map "  /* request line of client, as 'map <format>' */
 
 static int verbose = 0;
 static double tolerance = DEF_TOLERANCE;
+static double error_a = 0;  /* sizing error model: sigma^2 = a + b * size, */
+static double error_b = 0;  /*   where both 0 for relative tolerance */
 static int min_match = DEF_MIN_MATCH;
+static int max_uniq_count = DEF_MAX_UNIQ;
+static size_t max_candidates = DEF_MAX_CAND;
+static int merge_seeds = 0;
+static int index_flags = 0;
+static int min_votes = DEF_MIN_VOTES;
+static int bin_size = DEF_BIN_SIZE;
+static size_t batch_size = DEF_BATCH_SIZE;
+static size_t max_extensions = DEF_MAX_EXTEND;
+static double max_seconds = DEF_MAX_TIME;
+static const char *skipped_file = NULL;
+static const char *output_file = "-";
+static int output_format = ALN_FORMAT_TXT;
+static array(char *) chroms = { };  /* to map onto, or all if empty */
+static size_t shard_index = 0;
+static size_t shard_count = 1;
+static double checkpoint_seconds = 0;
+static int resuming = 0;
+static const char *socket_file = DEF_SOCKET;
+static int threads = DEF_THREADS;
+
+enum long_option {
+	OPT_SHARD = 256,
+	OPT_CHECKPOINT,
+	OPT_RESUME,
+};
+
+static const struct option long_options[] = {
+	{ "shard", required_argument, NULL, OPT_SHARD },
+	{ "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ NULL, 0, NULL, 0 },
+};
 
 static void print_usage(void)
 {
@@ -24,219 +80,1045 @@ static void print_usage(void)
 			"Usage: bntools map [options] <ref> <query>\n"
 			"\n"
 			"Options:\n"
-			"   <ref>        reference genome, in tsv/cmap format\n"
+			"   <ref>        reference genome, in tsv/cmap format, or 'shm:STR'\n"
+			"                published by 'index -P STR'\n"
 			"   <query>      query molecules/contigs, in tsv/cmap/bnx format\n"
 			"   -e <FLOAT>   tolerance to compare fragment size [%f]\n"
+			"   -E <A>,<B>   use sizing error model instead of '-e', which allows\n"
+			"                %d sigma, as sigma^2 = A + B * size (in bp)\n"
 			"   -m <INT>     minimal matched labels in query fragment [%d]\n"
+			"   -u <INT>     skip seeds not unique within INT intervals, unless\n"
+			"                no unique one exists, 0 for no limit [%d]\n"
+			"   -c <INT>     skip seeds with more than INT candidates,\n"
+			"                0 for no limit [%d]\n"
+			"   -M           also seed with two adjacent intervals merged, to\n"
+			"                tolerate a missing/extra label in the seed\n"
+			"   -F           build index with forward strand only, if no index\n"
+			"                file found, for half memory of index\n"
+			"   -V <INT>     extend only seeds whose implied reference locus\n"
+			"                gets at least INT votes, 0 to extend all [%d]\n"
+			"   -B <INT>     bin size (in bp) of reference locus to vote [%d]\n"
+			"   -b <INT>     seed molecules in batches of INT, by one sweep over\n"
+			"                index, 0 to look up each seed separately [%d]\n"
+			"   -x <INT>     skip molecules with more than INT seed hits to\n"
+			"                extend, 0 for no limit [%d]\n"
+			"   -T <FLOAT>   stop mapping a molecule after FLOAT seconds,\n"
+			"                0 for no limit [%d]\n"
+			"   -C <STR>     map onto only the chrom(s), as comma separated names,\n"
+			"                with index loaded from their shards if found\n"
+			"   -s <FILE>    save skipped/truncated molecules into FILE\n"
+			"   --shard <I>/<N>\n"
+			"                map only the I-th of N shards of query, which are\n"
+			"                molecules with ordinal modulo N equal to I - 1\n"
+			"   --checkpoint <FLOAT>\n"
+			"                save progress every FLOAT seconds into '<FILE>.ckpt',\n"
+			"                for output FILE of '-o'\n"
+			"   --resume     continue an interrupted run from its checkpoint\n"
+			"   -o <FILE>    output file [stdout]\n"
+			"   -f <FORMAT>  output format, as 'txt', 'xmap' or 'bin' (BGZF\n"
+			"                compressed binary, indexed by position if not to\n"
+			"                stdout), with txt/xmap BGZF compressed if FILE\n"
+			"                ends with '.gz' [txt]\n"
 			"   -v           show verbose message\n"
 			"   -h           show this help\n"
-			"\n", DEF_TOLERANCE, DEF_MIN_MATCH);
+			"\n"
+			"Note:\n"
+			"   Index is loaded from '<ref>.idx.gz' if found, otherwise from its\n"
+			"shards '<ref>.<CHROM>.idx.gz' written by 'index -S', with chroms\n"
+			"without shard indexed on the fly. With <ref> as 'shm:STR', both are\n"
+			"attached from shared memory, for concurrent processes on a machine.\n"
+			"   Results of shards, in bin format, could be combined by 'merge' into\n"
+			"the same output as mapping all molecules at once.\n"
+			"   With '--resume', output (and '-s' file) is truncated to the last\n"
+			"checkpoint and appended, with query file seeked to the molecule\n"
+			"after, which is fast for uncompressed query. Other options should be\n"
+			"the same as the interrupted run.\n"
+			"\n", DEF_TOLERANCE, SIGMA_TIMES, DEF_MIN_MATCH, DEF_MAX_UNIQ, DEF_MAX_CAND,
+			DEF_MIN_VOTES, DEF_BIN_SIZE, DEF_BATCH_SIZE, DEF_MAX_EXTEND, DEF_MAX_TIME);
+}
+
+static inline int reach_end(const struct ref_node *n, int direct, size_t offset)
+{
+	return ((n[direct * offset].flag & (direct > 0 ? LAST_INTERVAL : FIRST_INTERVAL)) != 0);
+}
+
+struct bounds {
+	int low, high;
+};
+
+struct seed_hit {
+	struct ref_index r;  /* maybe reversed from a forward-only index item */
+	size_t qindex;
+	int qspan;
+};
+
+struct vote {
+	uint64_t key;  /* chrom, strand and bin of the implied start */
+	int count;
+};
+
+struct seed_range {  /* seed interval(s) in query, with candidates in index */
+	const struct fragment *qry;
+	size_t qindex;
+	int qspan;
+	struct bounds bounds;  /* of interval size to match in index */
+	size_t begin, end;
+};
+
+struct map_stats {
+	size_t seed_count;
+	size_t skipped_candidates;
+	size_t skipped_seeds;
+	size_t hit_count;
+	size_t filtered_hits;
+	size_t skipped_molecules;
+	size_t truncated_molecules;
+};
+
+struct map_buffer {  /* of each mapping thread */
+	array(struct seed_range) seeds;
+	array(struct seed_range *) sorted;
+	array(int) matches;
+	array(struct seed_hit) hits;
+	array(struct vote) votes;  /* hash table, with capacity of power of 2 */
+	struct alignment aln;
+	struct aln_file *out;
+	uint64_t qid;  /* ordinal of current query in input */
+	struct map_stats stats;
+};
+
+/* bounds of each reference interval to match, computed once from the model */
+static array(struct bounds) node_bounds = { };
+
+enum map_result {
+	MAP_DONE = 0,
+	MAP_SKIPPED,    /* for too many seed hits to extend */
+	MAP_TRUNCATED,  /* for running out of time */
+};
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static struct bounds size_bounds(int size)
+{
+	struct bounds b;
+	if (error_a > 0 || error_b > 0) {
+		int delta = (int)(SIGMA_TIMES * sqrt(error_a + error_b * size));
+		b.low = size - delta;
+		b.high = size + delta;
+	} else {
+		b.low = (int)ceil(size * (1 - tolerance));
+		b.high = (int)floor(size * (1 + tolerance));
+	}
+	return b;
 }
 
-static void print_header(void)
+static int prepare_node_bounds(const struct ref_map *ref)
 {
-	printf("#name\tchrom\tpos\tstrand\tsize\tlabels\t"
-			"qsize\tqlabels\trstart\trend\tqstart\tqend\tmissing\textra\talignment\n");
+	size_t i;
+	if (array_reserve(node_bounds, ref->nodes.size)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < ref->nodes.size; ++i) {
+		node_bounds.data[i] = size_bounds(ref->nodes.data[i].size);
+	}
+	node_bounds.size = ref->nodes.size;
+	return 0;
 }
 
-static void output_item(const struct ref_map *ref, const struct fragment *qry,
+static inline int within(struct bounds b, int size)
+{
+	return (size >= b.low && size <= b.high);
+}
+
+static int output_item(const struct ref_map *ref, const struct fragment *qry,
 		size_t rindex, size_t qindex, int direct, size_t rlabel, size_t qlabel,
-		const int *matches, size_t match_count, size_t missing, size_t extra)
+		const int *matches, size_t match_count, size_t missing, size_t extra,
+		struct map_buffer *buf)
 {
 	const struct ref_node *p = &ref->nodes.data[rindex];
-	const char *qname = qry->name;
-	const char *rname = ref->map.fragments.data[p->chrom].name;
+	struct alignment *a = &buf->aln;
 	size_t rstart = (direct > 0 ? rindex : rindex + 1);
 	size_t rend = (direct > 0 ? rindex + rlabel - 1 : rindex - rlabel + 2);
-	size_t qstart = qindex;
-	size_t qend = qindex + qlabel - 1;
-	int ref_size = abs(ref->nodes.data[rend].pos - ref->nodes.data[rstart].pos);
-	int qry_size = qry->nicks.data[qindex + qlabel - 2].pos - qry->nicks.data[qindex - 1].pos;
-	int pos = (direct > 0 ? p->pos : (p - rlabel + 1)->pos);
-	size_t i, j, k;
+	size_t i, j, k, n;
 
-	fprintf(stdout, "%s\t%s\t%d\t%s\t", qname, rname, pos, (direct > 0 ? "+" : "-"));
-	fprintf(stdout, "%d\t%zd\t%d\t%zd\t", ref_size, rlabel, qry_size, qlabel);
-	fprintf(stdout, "%zd\t%zd\t%zd\t%zd\t", ref->nodes.data[rstart].label, ref->nodes.data[rend].label, qstart, qend);
-	fprintf(stdout, "%zd\t%zd\t", missing, extra);
+	snprintf(a->name, sizeof(a->name), "%s", qry->name);
+	a->qid = buf->qid;
+	a->chrom = p->chrom;
+	a->pos = (direct > 0 ? p->pos : (p - rlabel + 1)->pos);
+	a->direct = direct;
+	a->size = abs(ref->nodes.data[rend].pos - ref->nodes.data[rstart].pos);
+	a->labels = rlabel;
+	a->qsize = qry->nicks.data[qindex + qlabel - 2].pos - qry->nicks.data[qindex - 1].pos;
+	a->qlabels = qlabel;
+	a->qpos = qry->nicks.data[qindex - 1].pos;
+	a->qlen = qry->size;
+	a->rstart = ref->nodes.data[rstart].label;
+	a->rend = ref->nodes.data[rend].label;
+	a->qstart = qindex;
+	a->qend = qindex + qlabel - 1;
+	a->missing = missing;
+	a->extra = extra;
 
+	a->types.size = 0;
+	a->rsizes.size = 0;
+	a->qsizes.size = 0;
+	if (array_reserve(a->types, match_count)
+			|| array_reserve(a->rsizes, rlabel)
+			|| array_reserve(a->qsizes, qlabel)) {
+		return -ENOMEM;
+	}
 	for (i = 0, j = 0, k = 0; i < match_count; ++i) {
-		if (i > 0) {
-			fprintf(stdout, "|");
+		a->types.data[a->types.size++] = matches[i];
+		for (n = 0; n < match_ref_intervals(matches[i]); ++n) {
+			a->rsizes.data[a->rsizes.size++] = ref->nodes.data[rindex + direct * j++].size;
+		}
+		for (n = 0; n < match_qry_intervals(matches[i]); ++n, ++k) {
+			a->qsizes.data[a->qsizes.size++] =
+				qry->nicks.data[qindex + k].pos - qry->nicks.data[qindex + k - 1].pos;
 		}
+	}
+	return aln_write(buf->out, a);
+}
+
+static void extend(const struct ref_map *ref, const struct fragment *qry_item,
+		const struct ref_index *r, size_t qindex, int qspan, struct map_buffer *buf)
+{
+	const struct bounds *nb = &node_bounds.data[r->node];
+	const struct ref_node *n = ref_index_node(ref, r);
+	const struct nick *p = &qry_item->nicks.data[qindex];
+	size_t rindex = r->node;
+	size_t j, k, missing, extra;
+
+	buf->matches.size = 0;
+	for (j = 0, k = 0, missing = 0, extra = 0; qindex + k < qry_item->nicks.size; ++j, ++k) {
+		int match = 0;
+		int ref_size = 0, qry_size = 0;
+
+		if (j == 0) {
+			/* the first (maybe merged) interval is always matched */
+			if (r->span > 1) {
+				match = 2;
+				++missing;
+			} else if (qspan > 1) {
+				match = 3;
+				++extra;
+			} else {
+				match = 1;
+			}
+			if (verbose > 1) {
+				ref_size = ref_index_size(ref, r);
+				qry_size = (p + k + qspan - 1)->pos - (p + k - 1)->pos;
+			}
+		} else {
+			/* try matching */
+			if (reach_end(n, r->direct, j)) {
+				assert(j > 0);
+				break;
+			}
+			ref_size = n[j * r->direct].size;
+			qry_size = (p + k)->pos - (p + k - 1)->pos;
+			if (within(nb[j * r->direct], qry_size)) {
+				match = 1;
+			}
+
+			/* try matching with missing nick */
+			if (!match && !reach_end(n, r->direct, j + 1)) {
+				ref_size = n[(j + 1) * r->direct].size + n[j * r->direct].size;
+				qry_size = (p + k)->pos - (p + k - 1)->pos;
+				if (within(size_bounds(ref_size), qry_size)) {
+					match = 2;
+					++missing;
+				}
+			}
+
+			/* try matching with extra nick */
+			if (!match && (qindex + k + 1 < qry_item->nicks.size)) {
+				ref_size = n[j * r->direct].size;
+				qry_size = (p + k + 1)->pos - (p + k - 1)->pos;
+				if (within(nb[j * r->direct], qry_size)) {
+					match = 3;
+					++extra;
+				}
+			}
+
+			/* try matching with two missing nicks */
+			if (!match && !reach_end(n, r->direct, j + 1) && !reach_end(n, r->direct, j + 2)) {
+				ref_size = n[(j + 2) * r->direct].size + n[(j + 1) * r->direct].size + n[j * r->direct].size;
+				qry_size = (p + k)->pos - (p + k - 1)->pos;
+				if (within(size_bounds(ref_size), qry_size)) {
+					match = 4;
+					missing += 2;
+				}
+			}
 
-		fprintf(stdout, "%d", ref->nodes.data[rindex + direct * j++].size);
-		if (matches[i] == 2 || matches[i] == 4) {
-			fprintf(stdout, "+%d", ref->nodes.data[rindex + direct * j++].size);
-			if (matches[i] == 4) {
-				fprintf(stdout, "+%d", ref->nodes.data[rindex + direct * j++].size);
+			/* try matching with two extra nicks */
+			if (!match && (qindex + k + 2 < qry_item->nicks.size)) {
+				ref_size = n[j * r->direct].size;
+				qry_size = (p + k + 2)->pos - (p + k - 1)->pos;
+				if (within(nb[j * r->direct], qry_size)) {
+					match = 5;
+					extra += 2;
+				}
 			}
 		}
+		if (!match) break;
+
+		if (array_reserve(buf->matches, buf->matches.size + 1)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			return;
+		}
+		buf->matches.data[buf->matches.size++] = match;
 
-		fprintf(stdout, ":%d", qry->nicks.data[qindex + k].pos - qry->nicks.data[qindex + k - 1].pos);
-		++k;
-		if (matches[i] == 3 || matches[i] == 5) {
-			fprintf(stdout, "+%d", qry->nicks.data[qindex + k].pos - qry->nicks.data[qindex + k - 1].pos);
+		if (verbose > 1) {
+			fprintf(stderr, "matched interval: rindex = %zd, qindex = %zd, match = %d, "
+					"j = %zd, k = %zd, ref_size = %d, qry_size = %d\n",
+					rindex, qindex, match, j, k, ref_size, qry_size);
+		}
+
+		if (match == 2) {
+			++j;
+		} else if (match == 3) {
 			++k;
-			if (matches[i] == 5) {
-				fprintf(stdout, "+%d", qry->nicks.data[qindex + k].pos - qry->nicks.data[qindex + k - 1].pos);
-				++k;
+		} else if (match == 4) {
+			j += 2;
+		} else if (match == 5) {
+			k += 2;
+		}
+	}
+	if (buf->matches.size + 1 >= min_match) {
+		if (output_item(ref, qry_item, rindex, qindex, r->direct, j + 1, k + 1,
+					buf->matches.data, buf->matches.size, missing, extra, buf)) {
+			fprintf(stderr, "Error: Failed to output alignment of '%s'!\n", qry_item->name);
+		}
+	}
+}
+
+/* index of the first item whose (first) interval is not less than 'size' */
+static size_t lower_bound(const struct ref_map *ref, int size)
+{
+	size_t low = 0, high = ref->index_.size;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (ref_index_size(ref, &ref->index_.data[mid]) < size) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static inline int seed_usable(const struct ref_index *r, int qspan)
+{
+	return (r->span == 1 || (merge_seeds && qspan == 1));
+}
+
+static void locate_seed(const struct ref_map *ref, struct seed_range *s)
+{
+	s->begin = lower_bound(ref, s->bounds.low);
+	for (s->end = s->begin; s->end < ref->index_.size; ++s->end) {
+		if (ref_index_size(ref, &ref->index_.data[s->end]) > s->bounds.high) break;
+	}
+}
+
+static int sort_seed_by_bounds(const void *a, const void *b)
+{
+	const struct seed_range *pa = *(const struct seed_range **)a;
+	const struct seed_range *pb = *(const struct seed_range **)b;
+	if (pa->bounds.low != pb->bounds.low) {
+		return (pa->bounds.low < pb->bounds.low ? -1 : 1);
+	}
+	return (pa->bounds.high < pb->bounds.high ? -1 : (pa->bounds.high > pb->bounds.high ? 1 : 0));
+}
+
+/*
+ * Sort seeds of all molecules in the batch by size, and sweep them against
+ * the (size-sorted) index in one merge-join, instead of separate lookups.
+ */
+static int locate_seeds_in_batch(const struct ref_map *ref, struct map_buffer *buf)
+{
+	size_t i, begin, end;
+
+	if (array_reserve(buf->sorted, buf->seeds.size)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < buf->seeds.size; ++i) {
+		buf->sorted.data[i] = &buf->seeds.data[i];
+	}
+	buf->sorted.size = buf->seeds.size;
+	qsort(buf->sorted.data, buf->sorted.size, sizeof(struct seed_range *), sort_seed_by_bounds);
+
+	for (i = 0, begin = 0, end = 0; i < buf->sorted.size; ++i) {
+		struct seed_range *s = buf->sorted.data[i];
+		while (begin < ref->index_.size
+				&& ref_index_size(ref, &ref->index_.data[begin]) < s->bounds.low) {
+			++begin;
+		}
+		if (end < begin || (i > 0 && s->bounds.high < buf->sorted.data[i - 1]->bounds.high)) {
+			end = begin; /* upper bound is not always monotonic with error model */
+		}
+		while (end < ref->index_.size
+				&& ref_index_size(ref, &ref->index_.data[end]) <= s->bounds.high) {
+			++end;
+		}
+		s->begin = begin;
+		s->end = end;
+	}
+	return 0;
+}
+
+static size_t count_seeds(const struct fragment *qry_item)
+{
+	if (qry_item->nicks.size < min_match || qry_item->nicks.size < 2) {
+		return 0;
+	}
+	return (qry_item->nicks.size - 1) + (merge_seeds ? qry_item->nicks.size - 2 : 0);
+}
+
+static void add_seeds(const struct fragment *qry_item, struct map_buffer *buf)
+{
+	size_t qindex;
+	int qspan;
+
+	if (count_seeds(qry_item) == 0) {
+		return;
+	}
+	assert(buf->seeds.size + count_seeds(qry_item) <= buf->seeds.capacity);
+
+	for (qindex = 1; qindex < qry_item->nicks.size; ++qindex) {
+		for (qspan = 1; qspan <= (merge_seeds ? 2 : 1); ++qspan) {
+			struct seed_range *s = &buf->seeds.data[buf->seeds.size];
+			const struct nick *p = &qry_item->nicks.data[qindex];
+			if (qindex + qspan > qry_item->nicks.size) break;
+			s->qry = qry_item;
+			s->qindex = qindex;
+			s->qspan = qspan;
+			s->bounds = size_bounds((p + qspan - 1)->pos - (p - 1)->pos);
+			++buf->seeds.size;
+		}
+	}
+}
+
+static int add_hit(struct map_buffer *buf, const struct ref_index *r,
+		const struct seed_range *s)
+{
+	if (array_reserve(buf->hits, buf->hits.size + 1)) {
+		return -ENOMEM;
+	}
+	buf->hits.data[buf->hits.size].r = *r;
+	buf->hits.data[buf->hits.size].qindex = s->qindex;
+	buf->hits.data[buf->hits.size].qspan = s->qspan;
+	++buf->hits.size;
+	return 0;
+}
+
+static void select_hits(const struct ref_map *ref, const struct seed_range *s,
+		struct map_buffer *buf)
+{
+	/* each forward-only index item stands for the items on both strands */
+	size_t strands = ((ref->index_flags & INDEX_FORWARD) != 0 ? 2 : 1);
+	size_t i, count, uniq;
+
+	for (i = s->begin, count = 0, uniq = 0; i < s->end; ++i) {
+		const struct ref_index *r = &ref->index_.data[i];
+		assert((ref_index_node(ref, r)->flag & LAST_INTERVAL) == 0);
+		assert((ref_index_node(ref, r)->flag & FIRST_INTERVAL) == 0);
+		if (!seed_usable(r, s->qspan)) continue;
+		count += strands;
+		if (max_uniq_count <= 0 || r->uniq_count <= max_uniq_count) {
+			uniq += strands;
+		}
+	}
+	++buf->stats.seed_count;
+
+	/*
+	 * Candidates in repetitive context are only extended when the
+	 * seed has no better (unique) candidate at all.
+	 */
+	if (uniq == 0) {
+		uniq = count;
+	} else if (uniq < count) {
+		buf->stats.skipped_candidates += count - uniq;
+	}
+	if (max_candidates > 0 && uniq > max_candidates) {
+		if (verbose > 1) {
+			fprintf(stderr, "Warning: Skip seed at label %zd of '%s' for %zd candidates!\n",
+					s->qindex, s->qry->name, uniq);
+		}
+		++buf->stats.skipped_seeds;
+		return;
+	}
+
+	for (i = s->begin; i < s->end; ++i) {
+		const struct ref_index *r = &ref->index_.data[i];
+		if (!seed_usable(r, s->qspan)) continue;
+		if (uniq < count && r->uniq_count > max_uniq_count) continue;
+		if (add_hit(buf, r, s)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			return;
+		}
+		if (strands > 1) {
+			struct ref_index rev = *r;
+			rev.node = r->node + (r->span - 1);
+			rev.direct = -1;
+			if (add_hit(buf, &rev, s)) {
+				fprintf(stderr, "Error: Failed to allocate memory!\n");
+				return;
 			}
 		}
 	}
-	fprintf(stdout, "\n");
 }
 
-static inline int reach_end(const struct ref_node *n, int direct, size_t offset)
+/* bin of the reference position where the query would start */
+static int implied_bin(const struct ref_map *ref, const struct fragment *qry_item,
+		const struct seed_hit *h)
 {
-	return ((n[direct * offset].flag & (direct > 0 ? LAST_INTERVAL : FIRST_INTERVAL)) != 0);
+	const struct ref_node *n = ref_index_node(ref, &h->r);
+	int qpos = qry_item->nicks.data[h->qindex - 1].pos;
+	int pos = (h->r.direct > 0 ? n->pos - qpos : n->pos + n->size + qpos);
+	return (pos >= 0 ? pos / bin_size : -((bin_size - 1 - pos) / bin_size));
+}
+
+static inline uint64_t vote_key(size_t chrom, int direct, int bin)
+{
+	return ((uint64_t)chrom << 33) | ((uint64_t)(direct > 0) << 32) | (uint32_t)bin;
+}
+
+static struct vote *find_vote(struct map_buffer *buf, uint64_t key)
+{
+	size_t mask = buf->votes.size - 1;
+	size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	while (buf->votes.data[i].count > 0 && buf->votes.data[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	return &buf->votes.data[i];
+}
+
+static int count_votes(const struct ref_map *ref, const struct fragment *qry_item,
+		struct map_buffer *buf)
+{
+	size_t i, size;
+
+	for (size = 16; size < buf->hits.size * 2; size *= 2) { }
+	if (array_reserve(buf->votes, size)) {
+		return -ENOMEM;
+	}
+	buf->votes.size = size;
+	memset(buf->votes.data, 0, sizeof(struct vote) * size);
+
+	for (i = 0; i < buf->hits.size; ++i) {
+		const struct seed_hit *h = &buf->hits.data[i];
+		size_t chrom = ref_index_node(ref, &h->r)->chrom;
+		struct vote *v = find_vote(buf, vote_key(chrom,
+					h->r.direct, implied_bin(ref, qry_item, h)));
+		v->key = vote_key(chrom, h->r.direct, implied_bin(ref, qry_item, h));
+		++v->count;
+	}
+	return 0;
+}
+
+/* votes to the locus of seed hit, including its neighbor bins */
+static int get_votes(const struct ref_map *ref, const struct fragment *qry_item,
+		struct map_buffer *buf, const struct seed_hit *h)
+{
+	size_t chrom = ref_index_node(ref, &h->r)->chrom;
+	int bin = implied_bin(ref, qry_item, h);
+	int votes = 0, i;
+	for (i = bin - 1; i <= bin + 1; ++i) {
+		votes += find_vote(buf, vote_key(chrom, h->r.direct, i))->count;
+	}
+	return votes;
 }
 
-static void map(const struct ref_map *ref, struct fragment *qry_item)
+static int map(const struct ref_map *ref, const struct fragment *qry_item,
+		const struct seed_range *seeds, size_t count, struct map_buffer *buf)
 {
-	size_t rindex, qindex, i, j, k, missing, extra;
-	array(int) matches = { };
+	struct timespec start;
+	size_t i, extensions;
 
 	if (qry_item->nicks.size < min_match) {
 		if (verbose > 1) {
 			fprintf(stderr, "Warning: Skip '%s' for less than %d labels!\n", qry_item->name, min_match);
 		}
-		return;
+		return MAP_DONE;
+	}
+	if (max_seconds > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
 	}
 
-	for (qindex = 1; qindex < qry_item->nicks.size; ++qindex) {
-		const struct nick *p = &qry_item->nicks.data[qindex];
-		int fragment_size = p->pos - (p - 1)->pos;
-		for (i = 0; i < ref->index_.size; ++i) {
-			const struct ref_index *r = &ref->index_.data[i];
-			const struct ref_node *n = r->node;
-			assert((n->flag & LAST_INTERVAL) == 0);
-			assert((n->flag & FIRST_INTERVAL) == 0);
-
-			rindex = n - ref->nodes.data;
-			if (n->size < fragment_size * (1 - tolerance)) continue;
-			if (n->size > fragment_size * (1 + tolerance)) break;
-
-			matches.size = 0;
-			for (j = 0, k = 0, missing = 0, extra = 0; qindex + k < qry_item->nicks.size; ++j, ++k) {
-				int match = 0;
-				int ref_size, qry_size;
-
-				if (j == 0) {
-					match = 1; /* the first interval is always matched */
-					if (verbose > 1) {
-						ref_size = n[j * r->direct].size;
-						qry_size = (p + k)->pos - (p + k - 1)->pos;
-					}
-				} else {
-					/* try matching */
-					if (reach_end(n, r->direct, j)) {
-						assert(j > 0);
-						break;
-					}
-					ref_size = n[j * r->direct].size;
-					qry_size = (p + k)->pos - (p + k - 1)->pos;
-					if (qry_size >= ref_size * (1 - tolerance) && qry_size <= ref_size * (1 + tolerance)) {
-						match = 1;
-					}
-
-					/* try matching with missing nick */
-					if (!match && !reach_end(n, r->direct, j + 1)) {
-						ref_size = n[(j + 1) * r->direct].size + n[j * r->direct].size;
-						qry_size = (p + k)->pos - (p + k - 1)->pos;
-						if (qry_size >= ref_size * (1 - tolerance) && qry_size <= ref_size * (1 + tolerance)) {
-							match = 2;
-							++missing;
-						}
-					}
-
-					/* try matching with extra nick */
-					if (!match && (qindex + k + 1 < qry_item->nicks.size)) {
-						ref_size = n[j * r->direct].size;
-						qry_size = (p + k + 1)->pos - (p + k - 1)->pos;
-						if (qry_size >= ref_size * (1 - tolerance) && qry_size <= ref_size * (1 + tolerance)) {
-							match = 3;
-							++extra;
-						}
-					}
-
-					/* try matching with two missing nicks */
-					if (!match && !reach_end(n, r->direct, j + 2)) {
-						ref_size = n[(j + 2) * r->direct].size + n[(j + 1) * r->direct].size + n[j * r->direct].size;
-						qry_size = (p + k)->pos - (p + k - 1)->pos;
-						if (qry_size >= ref_size * (1 - tolerance) && qry_size <= ref_size * (1 + tolerance)) {
-							match = 4;
-							missing += 2;
-						}
-					}
-
-					/* try matching with two extra nicks */
-					if (!match && (qindex + k + 2 < qry_item->nicks.size)) {
-						ref_size = n[j * r->direct].size;
-						qry_size = (p + k + 2)->pos - (p + k - 1)->pos;
-						if (qry_size >= ref_size * (1 - tolerance) && qry_size <= ref_size * (1 + tolerance)) {
-							match = 5;
-							extra += 2;
-						}
-					}
-				}
-				if (!match) break;
+	buf->hits.size = 0;
+	for (i = 0; i < count; ++i) {
+		select_hits(ref, &seeds[i], buf);
+	}
+	buf->stats.hit_count += buf->hits.size;
 
-				if (array_reserve(matches, matches.size + 1)) {
-					fprintf(stderr, "Error: Failed to allocate memory!\n");
-					array_free(matches);
-					return;
-				}
-				matches.data[matches.size++] = match;
+	/*
+	 * Each seed hit votes for the reference locus where the query would
+	 * start, and only hits to well-supported loci are extended.
+	 */
+	if (min_votes > 0) {
+		if (count_votes(ref, qry_item, buf)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			return MAP_DONE;
+		}
+		for (i = 0, count = 0; i < buf->hits.size; ++i) {
+			struct seed_hit *h = &buf->hits.data[i];
+			if (get_votes(ref, qry_item, buf, h) >= min_votes) {
+				buf->hits.data[count++] = *h;
+			}
+		}
+		buf->stats.filtered_hits += buf->hits.size - count;
+		buf->hits.size = count;
+	}
 
-				if (verbose > 1) {
-					fprintf(stderr, "matched interval: rindex = %zd, qindex = %zd, match = %d, "
-							"j = %zd, k = %zd, ref_size = %d, qry_size = %d\n",
-							rindex, qindex, match, j, k, ref_size, qry_size);
-				}
+	if (max_extensions > 0 && buf->hits.size > max_extensions) {
+		if (verbose > 1) {
+			fprintf(stderr, "Warning: Skip '%s' for %zd seed hits to extend!\n",
+					qry_item->name, buf->hits.size);
+		}
+		++buf->stats.skipped_molecules;
+		return MAP_SKIPPED;
+	}
 
-				if (match == 2) {
-					++j;
-				} else if (match == 3) {
-					++k;
-				} else if (match == 4) {
-					j += 2;
-				} else if (match == 5) {
-					k += 2;
-				}
-			}
-			if (matches.size + 1 >= min_match) {
-				output_item(ref, qry_item, rindex, qindex, r->direct,
-						j + 1, k + 1, matches.data, matches.size, missing, extra);
+	for (i = 0, extensions = 0; i < buf->hits.size; ++i) {
+		const struct seed_hit *h = &buf->hits.data[i];
+		if (max_seconds > 0 && (++extensions & 63) == 0
+				&& elapsed_seconds(&start) > max_seconds) {
+			if (verbose > 1) {
+				fprintf(stderr, "Warning: Truncate '%s' after %zd of %zd seed hits extended!\n",
+						qry_item->name, i, buf->hits.size);
 			}
+			++buf->stats.truncated_molecules;
+			return MAP_TRUNCATED;
+		}
+		extend(ref, qry_item, &h->r, h->qindex, h->qspan, buf);
+	}
+	return MAP_DONE;
+}
+
+static void map_buffer_free(struct map_buffer *buf)
+{
+	alignment_free(&buf->aln);
+	array_free(buf->votes);
+	array_free(buf->hits);
+	array_free(buf->matches);
+	array_free(buf->sorted);
+	array_free(buf->seeds);
+}
+
+static void print_stats(const struct map_stats *stats)
+{
+	fprintf(stderr, "Seeds: %zd, skipped for too many candidates: %zd, "
+			"repetitive candidates skipped: %zd\n",
+			stats->seed_count, stats->skipped_seeds, stats->skipped_candidates);
+	fprintf(stderr, "Seed hits: %zd, filtered by votes: %zd\n",
+			stats->hit_count, stats->filtered_hits);
+	fprintf(stderr, "Molecules skipped: %zd, truncated: %zd\n",
+			stats->skipped_molecules, stats->truncated_molecules);
+}
+
+static int map_block(const struct ref_map *ref, const struct fragment *block,
+		const uint64_t *qids, size_t count, struct map_buffer *buf,
+		gzFile skipped, const struct nick_map *qry, int format)
+{
+	size_t i, j, k;
+
+	for (i = 0, k = 0; i < count; ++i) {
+		k += count_seeds(&block[i]);
+	}
+	buf->seeds.size = 0;
+	if (array_reserve(buf->seeds, k)) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < count; ++i) {
+		add_seeds(&block[i], buf);
+	}
+
+	if (batch_size > 0) {
+		if (locate_seeds_in_batch(ref, buf)) {
+			return -ENOMEM;
+		}
+	} else {
+		for (i = 0; i < buf->seeds.size; ++i) {
+			locate_seed(ref, &buf->seeds.data[i]);
+		}
+	}
+
+	for (i = 0, j = 0; i < count; ++i) {
+		for (k = j; k < buf->seeds.size && buf->seeds.data[k].qry == &block[i]; ++k) { }
+		buf->qid = qids[i];
+		if (map(ref, &block[i], buf->seeds.data + j, k - j, buf) != MAP_DONE && skipped) {
+			save_fragment(skipped, qry, &block[i], format);
 		}
+		j = k;
 	}
+	return 0;
+}
+
+static int has_chrom(const char *name, size_t len)
+{
+	size_t i;
+	for (i = 0; i < chroms.size; ++i) {
+		if (strlen(chroms.data[i]) == len && memcmp(chroms.data[i], name, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* names separated by ',', with those given before skipped */
+static int append_chroms(const char *s)
+{
+	const char *p;
+	size_t len;
+
+	for (p = s; *p; p += len + (p[len] == ',' ? 1 : 0)) {
+		len = strcspn(p, ",");
+		if (len == 0 || has_chrom(p, len)) continue;
+		if (array_reserve(chroms, chroms.size + 1)) {
+			return -ENOMEM;
+		}
+		chroms.data[chroms.size] = strndup(p, len);
+		if (!chroms.data[chroms.size]) {
+			return -ENOMEM;
+		}
+		++chroms.size;
+	}
+	return 0;
+}
+
+static void free_chroms(void)
+{
+	size_t i;
+	for (i = 0; i < chroms.size; ++i) {
+		free(chroms.data[i]);
+	}
+	array_free(chroms);
+}
+
+#define MAP_OPTIONS "e:E:m:u:c:MFV:B:b:x:T:C:v"
+
+/* options of mapping, shared by 'map' and 'serve' */
+static int set_map_option(int c, const char *arg)
+{
+	int n;
+
+	switch (c) {
+	case 'e':
+		tolerance = atof(arg);
+		break;
+	case 'E':
+		if (sscanf(arg, "%lf,%lf", &error_a, &error_b) != 2
+				|| error_a < 0 || error_b < 0 || error_a + error_b <= 0) {
+			fprintf(stderr, "Error: Invalid sizing error model '%s'!\n", arg);
+			return 1;
+		}
+		break;
+	case 'm':
+		min_match = atoi(arg);
+		break;
+	case 'u':
+		max_uniq_count = atoi(arg);
+		if (max_uniq_count < 0) {
+			fprintf(stderr, "Error: Invalid max intervals of a unique seed '%s'!\n", arg);
+			return 1;
+		}
+		break;
+	case 'c':
+		n = atoi(arg);
+		if (n < 0) {
+			fprintf(stderr, "Error: Invalid max candidates of a seed '%s'!\n", arg);
+			return 1;
+		}
+		max_candidates = n;
+		break;
+	case 'M':
+		merge_seeds = 1;
+		index_flags |= INDEX_MERGED;
+		break;
+	case 'F':
+		index_flags |= INDEX_FORWARD;
+		break;
+	case 'V':
+		min_votes = atoi(arg);
+		break;
+	case 'B':
+		bin_size = atoi(arg);
+		if (bin_size <= 0) {
+			fprintf(stderr, "Error: Invalid bin size '%s'!\n", arg);
+			return 1;
+		}
+		break;
+	case 'b':
+		n = atoi(arg);
+		if (n < 0) {
+			fprintf(stderr, "Error: Invalid batch size '%s'!\n", arg);
+			return 1;
+		}
+		batch_size = n;
+		break;
+	case 'x':
+		n = atoi(arg);
+		if (n < 0) {
+			fprintf(stderr, "Error: Invalid max seed hits to extend '%s'!\n", arg);
+			return 1;
+		}
+		max_extensions = n;
+		break;
+	case 'T':
+		max_seconds = atof(arg);
+		if (max_seconds < 0) {
+			fprintf(stderr, "Error: Invalid max seconds of a molecule '%s'!\n", arg);
+			return 1;
+		}
+		break;
+	case 'C':
+		if (append_chroms(arg)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			return 1;
+		}
+		break;
+	case 'v':
+		++verbose;
+		break;
+	default:
+		return 1;
+	}
+	return 0;
 }
 
 static int check_options(int argc, char * const argv[])
 {
 	int c;
-	while ((c = getopt(argc, argv, "e:m:avh")) != -1) {
+	while ((c = getopt_long(argc, argv, MAP_OPTIONS "s:o:f:h",
+					long_options, NULL)) != -1) {
 		switch (c) {
-		case 'e':
-			tolerance = atof(optarg);
+		case OPT_SHARD:
+			if (parse_shard_text(optarg, &shard_index, &shard_count)) {
+				fprintf(stderr, "Error: Invalid shard '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_seconds = atof(optarg);
 			break;
-		case 'm':
-			min_match = atoi(optarg);
+		case OPT_RESUME:
+			resuming = 1;
 			break;
-		case 'v':
-			++verbose;
+		case 's':
+			skipped_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			output_format = parse_aln_format(optarg);
+			if (output_format == ALN_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
 			break;
 		case 'h':
 			print_usage();
-		default:
 			return 1;
+		default:
+			if (set_map_option(c, optarg)) {
+				return 1;
+			}
+			break;
 		}
 	}
 	if (optind + 2 != argc) {
 		print_usage();
 		return 1;
 	}
+	if ((checkpoint_seconds > 0 || resuming) && (strcmp(output_file, "-") == 0
+				|| strcmp(output_file, "stdout") == 0
+				|| strcmp(argv[optind + 1], "-") == 0 || strcmp(argv[optind + 1], "stdin") == 0)) {
+		fprintf(stderr, "Error: Checkpoint needs query and output in files!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Checkpoint, saved as '<output>.ckpt' after all alignments of molecules
+ * before it are written out, so that an interrupted run could be resumed.
+ */
+struct checkpoint {
+	uint64_t molecules;   /* ordinal of next molecule in query */
+	int64_t input;        /* offset of next molecule in query file */
+	size_t line;          /* of query file */
+	int64_t output;       /* size of output file */
+	uint64_t records;     /* in output file */
+	int64_t skipped;      /* size of '-s' file, or -1 */
+};
+
+static void checkpoint_filename(char *buf, size_t bufsize)
+{
+	snprintf(buf, bufsize, "%s.ckpt", output_file);
+}
+
+static int save_checkpoint(const struct checkpoint *c)
+{
+	char path[PATH_MAX], temp[PATH_MAX + 4];
+	FILE *fp;
+	int ret;
+
+	checkpoint_filename(path, sizeof(path));
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	fp = fopen(temp, "w");
+	if (!fp) {
+		fprintf(stderr, "Error: Can not open output file '%s'\n", temp);
+		return -EIO;
+	}
+	fprintf(fp, "##fileformat=CKPv0.1\n");
+	fprintf(fp, "##shard=%zd/%zd\n", shard_index + 1, shard_count);
+	fprintf(fp, "#molecules\tinput\tline\toutput\trecords\tskipped\n");
+	fprintf(fp, "%llu\t%lld\t%zd\t%lld\t%llu\t%lld\n",
+			(unsigned long long)c->molecules, (long long)c->input, c->line,
+			(long long)c->output, (unsigned long long)c->records, (long long)c->skipped);
+	ret = (fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -EIO);
+	if (fclose(fp) != 0 || ret != 0 || rename(temp, path) != 0) {  /* replaced at once */
+		fprintf(stderr, "Error: Failed to write file '%s'\n", path);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int load_checkpoint(struct checkpoint *c)
+{
+	char path[PATH_MAX], buf[256];
+	unsigned long long molecules, records;
+	long long input, output, skipped;
+	size_t index = 0, count = 0;
+	FILE *fp;
+	int ret = -EINVAL;
+
+	checkpoint_filename(path, sizeof(path));
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Error: Can not open checkpoint file '%s'\n", path);
+		return -EINVAL;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "##shard=%zd/%zd", &index, &count) == 2) {
+			continue;
+		} else if (buf[0] == '#') {
+			continue;
+		}
+		if (sscanf(buf, "%llu %lld %zd %lld %llu %lld", &molecules, &input, &c->line,
+					&output, &records, &skipped) == 6) {
+			c->molecules = molecules;
+			c->input = input;
+			c->output = output;
+			c->records = records;
+			c->skipped = skipped;
+			ret = 0;
+		}
+		break;
+	}
+	fclose(fp);
+
+	if (ret != 0) {
+		fprintf(stderr, "Error: Invalid checkpoint file '%s'\n", path);
+	} else if (index != shard_index + 1 || count != shard_count) {
+		fprintf(stderr, "Error: Checkpoint '%s' is of shard %zd/%zd\n", path, index, count);
+		ret = -EINVAL;
+	} else if ((c->skipped >= 0) != (skipped_file != NULL)) {
+		fprintf(stderr, "Error: Option '-s' differs from checkpoint '%s'\n", path);
+		ret = -EINVAL;
+	}
+	return ret;
+}
+
+static int make_checkpoint(struct file *fp, uint64_t ordinal,
+		struct aln_file *out, gzFile skipped)
+{
+	struct checkpoint c;
+
+	c.molecules = ordinal;
+	c.input = gztell(fp->file);
+	c.line = fp->line;
+	c.records = out->count;
+	c.skipped = -1;
+	if (c.input < 0 || aln_flush(out, &c.output)
+			|| (skipped && flush_gzfile(skipped, &c.skipped))) {
+		fprintf(stderr, "Error: Failed to save checkpoint\n");
+		return -EIO;
+	}
+	return save_checkpoint(&c);
+}
+
+/* reference map and its index, from file or shards */
+static int load_reference_file(const char *filename, struct ref_map *ref)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	size_t n;
+
+	get_index_filename(filename, path, sizeof(path));
+
+	if (nick_map_load_selected(&ref->map, filename,
+				(const char * const *)chroms.data, chroms.size)) {
+		return -EINVAL;
+	}
+	if (chroms.size > 0 && ref->map.fragments.size < chroms.size) {
+		fprintf(stderr, "Error: Only %zd of %zd chroms found in '%s'\n",
+				ref->map.fragments.size, chroms.size, filename);
+		return -EINVAL;
+	}
+	if (chroms.size > 0 || (stat(path, &sb) == -1 && errno == ENOENT)) {
+		if (ref_map_load_shards(ref, filename, index_flags, &n)) {
+			return -EINVAL;
+		}
+		if (verbose > 0) {
+			fprintf(stderr, "Index of %zd chroms loaded from shards\n", n);
+		}
+	} else if (ref_map_load(ref, path)) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* reference map, its index and header of output */
+static int load_reference(const char *filename, struct ref_map *ref,
+		struct aln_header *header)
+{
+	size_t i;
+
+	if (memcmp(filename, SHARED_PREFIX, strlen(SHARED_PREFIX)) == 0) {
+		if (chroms.size > 0) {
+			fprintf(stderr, "Error: Chroms could not be selected from shared reference\n");
+			return -EINVAL;
+		}
+		if (ref_map_attach(ref, filename + strlen(SHARED_PREFIX))) {
+			return -EINVAL;
+		}
+	} else if (load_reference_file(filename, ref)) {
+		return -EINVAL;
+	}
+	if (merge_seeds && (ref->index_flags & INDEX_MERGED) == 0 && verbose > 0) {
+		fprintf(stderr, "Warning: Index of '%s' has no merged intervals, "
+				"only query intervals are merged for seeding\n", filename);
+	}
+
+	if (prepare_node_bounds(ref)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		return -ENOMEM;
+	}
+	for (i = 0; i < ref->map.fragments.size; ++i) {
+		const struct fragment *f = &ref->map.fragments.data[i];
+		if (aln_header_add_chrom(header, f->name, f->size)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			return -ENOMEM;
+		}
+	}
 	return 0;
 }
 
@@ -245,39 +1127,694 @@ int map_main(int argc, char * const argv[])
 	char path[PATH_MAX];
 	struct ref_map ref;
 	struct nick_map qry;
-	size_t i;
-	struct stat sb;
+	struct map_buffer buf = { };
+	struct aln_header header;
+	array(struct fragment) block = { };
+	array(uint64_t) qids = { };
+	uint64_t ordinal = 0;
+	struct file *fp = NULL;
+	gzFile skipped = NULL;
+	struct checkpoint ckpt;
+	struct timespec last_checkpoint;
+	size_t i, n, limit;
+	int format, ret = 0;
 
 	if (check_options(argc, argv)) {
 		return 1;
 	}
-	get_index_filename(argv[optind], path, sizeof(path));
 
 	ref_map_init(&ref);
-	if (nick_map_load(&ref.map, argv[optind])) {
-		return 1;
+	nick_map_init(&qry);
+	aln_header_init(&header);
+	alignment_init(&buf.aln);
+	if (load_reference(argv[optind], &ref, &header)) {
+		ret = 1;
+		goto out;
+	}
+
+	fp = file_open(argv[optind + 1]);
+	if (!fp) {
+		ret = 1;
+		goto out;
+	}
+	if (bn_read_header(fp, &format, &qry)) {
+		ret = 1;
+		goto out;
+	}
+	if (resuming) {
+		if (load_checkpoint(&ckpt)) {
+			ret = 1;
+			goto out;
+		}
+		if (gzseek(fp->file, ckpt.input, SEEK_SET) != ckpt.input) {
+			fprintf(stderr, "Error: Failed to seek query file '%s'\n", fp->name);
+			ret = 1;
+			goto out;
+		}
+		fp->line = ckpt.line;
+		ordinal = ckpt.molecules;
+		if (verbose > 0) {
+			fprintf(stderr, "Resumed from molecule %llu\n", (unsigned long long)ordinal);
+		}
+	}
+	if (skipped_file) {
+		if (resuming) {
+			skipped = open_gzfile_append(skipped_file, ckpt.skipped);
+		} else {
+			skipped = open_gzfile_write(skipped_file);
+		}
+		if (!skipped) {
+			ret = 1;
+			goto out;
+		}
+		if (!resuming) {
+			save_header(skipped, &qry, format);
+		}
+	}
+
+	limit = (batch_size > 0 ? batch_size : 1);
+	if (array_reserve(block, limit) || array_reserve(qids, limit)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		ret = 1;
+		goto out;
 	}
-	if (stat(path, &sb) == -1 && errno == ENOENT) {
-		ref_map_build_index(&ref);
+
+	if (resuming) {
+		buf.out = aln_open_append(output_file, output_format, &header,
+				ckpt.output, ckpt.records);
 	} else {
-		if (ref_map_load(&ref, path)) {
-			ref_map_free(&ref);
+		buf.out = aln_open_write(output_file, output_format, &header);
+	}
+	if (!buf.out) {
+		ret = 1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+	do {
+		for (n = 0; n < limit; ++n) {
+			if (bn_read_shard(fp, format, &block.data[n],
+						shard_index, shard_count, &ordinal)) break;
+			qids.data[n] = ordinal - 1;
+		}
+		if (map_block(&ref, block.data, qids.data, n, &buf, skipped, &qry, format)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			ret = 1;
+			goto out;
+		}
+		if (checkpoint_seconds > 0 && n == limit
+				&& elapsed_seconds(&last_checkpoint) >= checkpoint_seconds) {
+			if (make_checkpoint(fp, ordinal, buf.out, skipped)) {
+				ret = 1;
+				goto out;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+		}
+	} while (n == limit);
+
+	if (verbose > 0) {
+		print_stats(&buf.stats);
+	}
+
+out:
+	if (aln_close(buf.out)) {
+		ret = 1;
+	}
+	if (skipped) {
+		gzclose(skipped);
+	}
+	if (ret == 0 && (checkpoint_seconds > 0 || resuming)) {
+		checkpoint_filename(path, sizeof(path));
+		unlink(path);  /* finished */
+	}
+	map_buffer_free(&buf);
+	aln_header_free(&header);
+
+	for (i = 0; i < block.capacity; ++i) {
+		array_free(block.data[i].nicks);
+	}
+	array_free(block);
+	array_free(qids);
+	array_free(node_bounds);
+	file_close(fp);
+	nick_map_free(&qry);
+	ref_map_free(&ref);
+	free_chroms();
+	return ret;
+}
+
+/*
+ * Server holding reference and index loaded once, to map molecules sent
+ * by clients through a Unix domain socket. Each connection is served by
+ * a thread of the pool, with its own buffers, and results are streamed
+ * back through the same connection as soon as written.
+ *
+ * A client sends a request line 'map <format>', then query data in any
+ * format of 'map' (maybe gzipped), and shuts down its writing end.
+ */
+
+struct server {
+	const struct ref_map *ref;
+	const struct aln_header *header;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	array(int) pending;  /* queue of accepted connections */
+	size_t head;
+	int stopping;
+};
+
+struct serve_worker {
+	pthread_t thread;
+	struct server *server;
+	struct map_buffer buf;
+	array(struct fragment) block;
+	array(uint64_t) qids;
+};
+
+static volatile sig_atomic_t stop_serving = 0;
+
+static void print_serve_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools serve [options] <ref>\n"
+			"\n"
+			"Options:\n"
+			"   <ref>        reference genome, in tsv/cmap format, or 'shm:STR'\n"
+			"                published by 'index -P STR'\n"
+			"   -S <FILE>    Unix domain socket to listen on ["DEF_SOCKET"]\n"
+			"   -t <INT>     number of threads to map [%d]\n"
+			"   -h           show this help\n"
+			"   and options of mapping, as -e/-E/-m/-u/-c/-M/-F/-V/-B/-b/-x/-T/-C/-v\n"
+			"                of 'map'\n"
+			"\n"
+			"Note:\n"
+			"   Molecules are mapped for 'bntools client', until the server is\n"
+			"stopped by SIGINT or SIGTERM.\n"
+			"\n", DEF_THREADS);
+}
+
+static int check_serve_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, MAP_OPTIONS "S:t:h")) != -1) {
+		switch (c) {
+		case 'S':
+			socket_file = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads <= 0) {
+				fprintf(stderr, "Error: Invalid number of threads '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			print_serve_usage();
 			return 1;
+		default:
+			if (set_map_option(c, optarg)) {
+				return 1;
+			}
+			break;
+		}
+	}
+	if (optind + 1 != argc) {
+		print_serve_usage();
+		return 1;
+	}
+	return 0;
+}
+
+/* request line, read byte by byte to leave query data in the socket */
+static int read_request(int fd, char *buf, size_t bufsize)
+{
+	size_t i = 0;
+	char c;
+
+	while (read(fd, &c, 1) == 1) {
+		if (c == '\n') {
+			buf[i] = '\0';
+			return 0;
 		}
+		if (i + 1 >= bufsize) break;
+		buf[i++] = c;
+	}
+	return -1;
+}
+
+static int serve_request(struct serve_worker *w, int fd)
+{
+	const struct server *s = w->server;
+	char name[32], request[64];
+	struct nick_map qry;
+	struct file *in = NULL;
+	uint64_t ordinal = 0;
+	size_t n, limit = w->block.capacity;
+	int format, out_format, in_fd, ret = 0;
+
+	snprintf(name, sizeof(name), "client:%d", fd);
+	if (read_request(fd, request, sizeof(request))
+			|| strncmp(request, REQUEST_MAP, strlen(REQUEST_MAP)) != 0
+			|| (out_format = parse_aln_format(request + strlen(REQUEST_MAP)))
+				== ALN_FORMAT_UNKNOWN) {
+		fprintf(stderr, "Error: Invalid request from %s\n", name);
+		close(fd);
+		return -EINVAL;
+	}
+
+	in_fd = dup(fd);
+	w->buf.out = aln_dopen_write(fd, name, out_format, s->header);
+	if (!w->buf.out) {
+		close(fd);
+		close(in_fd);
+		return -EIO;
+	}
+	in = file_dopen(in_fd, name);
+	if (!in) {
+		close(in_fd);
+		ret = -EIO;
+		goto out;
 	}
 
 	nick_map_init(&qry);
-	if (nick_map_load(&qry, argv[optind + 1])) {
-		ref_map_free(&ref);
+	if (bn_read_header(in, &format, &qry)) {
+		ret = -EINVAL;
+	}
+	nick_map_free(&qry);
+
+	memset(&w->buf.stats, 0, sizeof(w->buf.stats));
+	while (ret == 0) {
+		for (n = 0; n < limit; ++n) {
+			if (bn_read_shard(in, format, &w->block.data[n], 0, 1, &ordinal)) break;
+			w->qids.data[n] = ordinal - 1;
+		}
+		if (map_block(s->ref, w->block.data, w->qids.data, n, &w->buf, NULL, NULL, format)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			ret = -ENOMEM;
+		}
+		if (n < limit) break;
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "Mapped %llu molecules for %s\n", (unsigned long long)ordinal, name);
+	}
+
+out:
+	if (aln_close(w->buf.out)) {
+		ret = -EIO;
+	}
+	w->buf.out = NULL;
+	file_close(in);
+	return ret;
+}
+
+static void *serve_worker_main(void *arg)
+{
+	struct serve_worker *w = arg;
+	struct server *s = w->server;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		while (s->head == s->pending.size && !s->stopping) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		if (s->head == s->pending.size) {  /* stopping, with no more pending */
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		fd = s->pending.data[s->head++];
+		if (s->head == s->pending.size) {
+			s->head = s->pending.size = 0;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		serve_request(w, fd);
+	}
+	return NULL;
+}
+
+static int add_pending(struct server *s, int fd)
+{
+	int ret = 0;
+	pthread_mutex_lock(&s->lock);
+	if (array_reserve(s->pending, s->pending.size + 1)) {
+		ret = -ENOMEM;
+	} else {
+		s->pending.data[s->pending.size++] = fd;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+static void handle_stop_signal(int sig)
+{
+	stop_serving = 1;
+}
+
+static int open_server_socket(const char *filename)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(filename) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: Too long socket name '%s'\n", filename);
+		return -1;
+	}
+	strcpy(addr.sun_path, filename);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Can not create socket\n");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		if (errno == EADDRINUSE) {
+			fprintf(stderr, "Error: Socket '%s' has already existed!\n", filename);
+		} else {
+			fprintf(stderr, "Error: Can not bind socket '%s'\n", filename);
+		}
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		fprintf(stderr, "Error: Can not listen on socket '%s'\n", filename);
+		close(fd);
+		unlink(filename);
+		return -1;
+	}
+	return fd;
+}
+
+int serve_main(int argc, char * const argv[])
+{
+	struct ref_map ref;
+	struct aln_header header;
+	struct server server = { };
+	array(struct serve_worker) workers = { };
+	struct sigaction sa;
+	sigset_t mask, old_mask;
+	size_t i, j, limit;
+	int sock = -1, fd, ret = 0;
+
+	if (check_serve_options(argc, argv)) {
 		return 1;
 	}
 
-	print_header();
-	for (i = 0; i < qry.fragments.size; ++i) {
-		map(&ref, &qry.fragments.data[i]);
+	ref_map_init(&ref);
+	aln_header_init(&header);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.cond, NULL);
+	server.ref = &ref;
+	server.header = &header;
+
+	if (load_reference(argv[optind], &ref, &header)) {
+		ret = 1;
+		goto out;
+	}
+	sock = open_server_socket(socket_file);
+	if (sock < 0) {
+		ret = 1;
+		goto out;
 	}
 
-	nick_map_free(&qry);
+	/* stop signals are only caught by this thread, to break accept() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);  /* for clients gone */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	limit = (batch_size > 0 ? batch_size : 1);
+	if (array_reserve(workers, threads)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		ret = 1;
+	} else {
+		memset(workers.data, 0, sizeof(struct serve_worker) * threads);
+	}
+	for (i = 0; ret == 0 && i < (size_t)threads; ++i) {
+		struct serve_worker *w = &workers.data[i];
+		w->server = &server;
+		alignment_init(&w->buf.aln);
+		if (array_reserve(w->block, limit) || array_reserve(w->qids, limit)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			ret = 1;
+			break;
+		}
+		memset(w->block.data, 0, sizeof(struct fragment) * limit);
+		if (pthread_create(&w->thread, NULL, serve_worker_main, w) != 0) {
+			fprintf(stderr, "Error: Failed to create thread!\n");
+			ret = 1;
+			break;
+		}
+		++workers.size;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret == 0 && verbose > 0) {
+		fprintf(stderr, "Serving on '%s' with %d threads\n", socket_file, threads);
+	}
+	while (ret == 0 && !stop_serving) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "Error: Failed to accept connection on '%s'\n", socket_file);
+			ret = 1;
+			break;
+		}
+		if (add_pending(&server, fd)) {
+			fprintf(stderr, "Error: Failed to allocate memory!\n");
+			close(fd);
+		}
+	}
+
+	pthread_mutex_lock(&server.lock);
+	server.stopping = 1;
+	pthread_cond_broadcast(&server.cond);
+	pthread_mutex_unlock(&server.lock);
+	for (i = 0; i < workers.size; ++i) {
+		pthread_join(workers.data[i].thread, NULL);
+	}
+	if (verbose > 0) {
+		fprintf(stderr, "Server stopped\n");
+	}
+
+out:
+	for (i = 0; workers.data && i < (size_t)threads; ++i) {
+		struct serve_worker *w = &workers.data[i];
+		map_buffer_free(&w->buf);
+		for (j = 0; j < w->block.capacity; ++j) {
+			array_free(w->block.data[j].nicks);
+		}
+		array_free(w->block);
+		array_free(w->qids);
+	}
+	array_free(workers);
+	if (sock >= 0) {
+		close(sock);
+		unlink(socket_file);
+	}
+	array_free(server.pending);
+	pthread_cond_destroy(&server.cond);
+	pthread_mutex_destroy(&server.lock);
+	aln_header_free(&header);
+	array_free(node_bounds);
 	ref_map_free(&ref);
+	free_chroms();
+	return ret;
+}
+
+/* client of 'serve', as a thin pipe of query and results */
+
+struct client_sender {
+	int sock;
+	int in;
+	int ret;
+};
+
+static void print_client_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools client [options] <query>\n"
+			"\n"
+			"Options:\n"
+			"   <query>      query molecules/contigs, in tsv/cmap/bnx format\n"
+			"   -S <FILE>    Unix domain socket of 'serve' ["DEF_SOCKET"]\n"
+			"   -o <FILE>    output file [stdout]\n"
+			"   -f <FORMAT>  output format, as 'txt', 'xmap' or 'bin' [txt]\n"
+			"   -h           show this help\n"
+			"\n");
+}
+
+static int check_client_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "S:o:f:h")) != -1) {
+		switch (c) {
+		case 'S':
+			socket_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			output_format = parse_aln_format(optarg);
+			if (output_format == ALN_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			print_client_usage();
+			return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		print_client_usage();
+		return 1;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *data, size_t size)
+{
+	ssize_t n;
+	while (size > 0) {
+		n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -EIO;
+		}
+		data += n;
+		size -= n;
+	}
 	return 0;
 }
+
+/* query is sent by another thread, while results are received */
+static void *client_send(void *arg)
+{
+	struct client_sender *s = arg;
+	char buf[65536];
+	ssize_t n;
+
+	while ((n = read(s->in, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			s->ret = -EIO;
+			break;
+		}
+		if (write_all(s->sock, buf, n)) {
+			s->ret = -EIO;
+			break;
+		}
+	}
+	shutdown(s->sock, SHUT_WR);
+	return NULL;
+}
+
+int client_main(int argc, char * const argv[])
+{
+	static const char *format_names[] = {
+		[ALN_FORMAT_TXT] = "txt", [ALN_FORMAT_BIN] = "bin", [ALN_FORMAT_XMAP] = "xmap",
+	};
+	struct sockaddr_un addr;
+	struct client_sender sender = { .sock = -1, .in = -1 };
+	pthread_t thread;
+	char buf[65536];
+	const char *query;
+	FILE *out = NULL;
+	size_t total = 0;
+	ssize_t n;
+	int ret = 0;
+
+	if (check_client_options(argc, argv)) {
+		return 1;
+	}
+	query = argv[optind];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_file);
+	sender.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sender.sock < 0 || connect(sender.sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Error: Can not connect to server at '%s'\n", socket_file);
+		ret = 1;
+		goto out;
+	}
+
+	if (strcmp(query, "-") == 0 || strcmp(query, "stdin") == 0) {
+		sender.in = 0;
+	} else {
+		sender.in = open(query, O_RDONLY);
+		if (sender.in < 0) {
+			fprintf(stderr, "Error: Can not open file to read: '%s'\n", query);
+			ret = 1;
+			goto out;
+		}
+	}
+	if (strcmp(output_file, "-") == 0 || strcmp(output_file, "stdout") == 0) {
+		out = stdout;
+	} else {
+		out = fopen(output_file, "wxb");  /* 'x': check existed */
+		if (!out) {
+			if (errno == EEXIST) {
+				fprintf(stderr, "Error: Output file '%s' has already existed!\n", output_file);
+			} else {
+				fprintf(stderr, "Error: Can not open output file '%s'\n", output_file);
+			}
+			ret = 1;
+			goto out;
+		}
+	}
+
+	n = snprintf(buf, sizeof(buf), REQUEST_MAP "%s\n", format_names[output_format]);
+	if (write_all(sender.sock, buf, n)
+			|| pthread_create(&thread, NULL, client_send, &sender) != 0) {
+		fprintf(stderr, "Error: Failed to send query to server\n");
+		ret = 1;
+		goto out;
+	}
+	while ((n = read(sender.sock, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fwrite(buf, 1, n, out) != (size_t)n) {
+			fprintf(stderr, "Error: Failed to write file '%s'\n", output_file);
+			ret = 1;
+			break;
+		}
+		total += n;
+	}
+	pthread_join(thread, NULL);
+	if (sender.ret != 0 || n < 0) {
+		fprintf(stderr, "Error: Failed to communicate with server\n");
+		ret = 1;
+	} else if (total == 0) {
+		fprintf(stderr, "Error: No result from server, see its messages\n");
+		ret = 1;
+	}
+
+out:
+	if (out && out != stdout) {
+		fclose(out);
+	} else if (out) {
+		fflush(out);
+	}
+	if (sender.in > 0) {
+		close(sender.in);
+	}
+	if (sender.sock >= 0) {
+		close(sender.sock);
+	}
+	return ret;
+}
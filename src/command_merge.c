@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aln_file.h"
+
+#define DEF_OUTPUT "stdout"
+#define DEF_FORMAT "bin"
+
+struct input {
+	struct aln_file *fp;
+	struct alignment aln;
+	size_t order;  /* in command line */
+};
+
+static int verbose = 0;
+static int help = 0;
+
+static const char *output_file = DEF_OUTPUT;
+static int out_format = ALN_FORMAT_BIN;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools merge [options] <input> [...]\n"
+			"\n"
+			"Options:\n"
+			"   <input> [...]  results of 'map --shard', in bin format\n"
+			"   -o FILE        output file ["DEF_OUTPUT"]\n"
+			"   -f STR         output format, txt/xmap/bin ["DEF_FORMAT"]\n"
+			"   -v             show verbose message\n"
+			"   -h             show this help, '-hh' for more detail help\n"
+			"\n");
+	if (help > 1) {
+		fprintf(stderr, "Note:\n"
+				"   Alignments are merged by ordinal of molecule in query, which is\n"
+				"kept only in bin format, into the same order as mapping all molecules\n"
+				"at once. All inputs should be mapped onto the same reference.\n"
+				"\n");
+	}
+}
+
+static int check_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "o:f:vh")) != -1) {
+		switch (c) {
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			out_format = parse_aln_format(optarg);
+			if (out_format == ALN_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'h':
+			++help;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (help || optind >= argc) {
+		print_usage();
+		return 1;
+	}
+	return 0;
+}
+
+static int same_header(const struct aln_header *x, const struct aln_header *y)
+{
+	size_t i;
+
+	if (x->chroms.size != y->chroms.size) {
+		return 0;
+	}
+	for (i = 0; i < x->chroms.size; ++i) {
+		if (strcmp(x->chroms.data[i].name, y->chroms.data[i].name) != 0
+				|| x->chroms.data[i].size != y->chroms.data[i].size) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* min-heap of inputs, by molecule ordinal of their current alignments */
+static inline int input_less(const struct input *x, const struct input *y)
+{
+	return (x->aln.qid < y->aln.qid || (x->aln.qid == y->aln.qid && x->order < y->order));
+}
+
+static void sift_down(struct input **heap, size_t size, size_t i)
+{
+	struct input *p = heap[i];
+	size_t child;
+
+	while ((child = i * 2 + 1) < size) {
+		if (child + 1 < size && input_less(heap[child + 1], heap[child])) {
+			++child;
+		}
+		if (!input_less(heap[child], p)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = p;
+}
+
+/*
+ * Each input is ordered by molecule ordinal, as written by 'map', so they
+ * are merged by a k-way heap, with alignments of a molecule kept together.
+ */
+int merge_main(int argc, char * const argv[])
+{
+	array(struct input) inputs = { };
+	array(struct input *) heap = { };
+	struct aln_file *out = NULL;
+	uint64_t count = 0;
+	size_t i, n;
+	int err, ret = 0;
+
+	if (check_options(argc, argv)) {
+		return 1;
+	}
+
+	n = argc - optind;
+	if (array_reserve(inputs, n) || array_reserve(heap, n)) {
+		fprintf(stderr, "Error: Failed to allocate memory!\n");
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < n; ++i) {
+		struct input *p = &inputs.data[inputs.size++];
+		p->order = i;
+		alignment_init(&p->aln);
+		p->fp = aln_open_read(argv[optind + i]);
+		if (!p->fp) {
+			ret = 1;
+			goto out;
+		}
+		if (p->fp->format != ALN_FORMAT_BIN) {
+			fprintf(stderr, "Error: Input '%s' is not in bin format, "
+					"without ordinal of molecules\n", p->fp->name);
+			ret = 1;
+			goto out;
+		}
+		if (!same_header(&p->fp->header, &inputs.data[0].fp->header)) {
+			fprintf(stderr, "Error: Input '%s' is mapped onto other reference "
+					"than '%s'\n", p->fp->name, inputs.data[0].fp->name);
+			ret = 1;
+			goto out;
+		}
+		err = aln_read(p->fp, &p->aln);
+		if (err == 0) {
+			heap.data[heap.size++] = p;
+		} else if (err != -1) {
+			ret = 1;
+			goto out;
+		}
+	}
+	for (i = heap.size / 2; i > 0; --i) {
+		sift_down(heap.data, heap.size, i - 1);
+	}
+
+	out = aln_open_write(output_file, out_format, &inputs.data[0].fp->header);
+	if (!out) {
+		ret = 1;
+		goto out;
+	}
+
+	while (heap.size > 0) {
+		struct input *p = heap.data[0];
+		if (aln_write(out, &p->aln)) {
+			ret = 1;
+			break;
+		}
+		++count;
+
+		err = aln_read(p->fp, &p->aln);
+		if (err == -1) {
+			heap.data[0] = heap.data[--heap.size];
+		} else if (err != 0) {
+			ret = 1;
+			break;
+		}
+		if (heap.size > 0) {
+			sift_down(heap.data, heap.size, 0);
+		}
+	}
+
+	if (verbose > 0 && ret == 0) {
+		fprintf(stderr, "Merged %llu alignments from %zd inputs\n",
+				(unsigned long long)count, n);
+	}
+
+out:
+	if (aln_close(out)) {
+		ret = 1;
+	}
+	for (i = 0; i < inputs.size; ++i) {
+		aln_close(inputs.data[i].fp);
+		alignment_free(&inputs.data[i].aln);
+	}
+	array_free(heap);
+	array_free(inputs);
+	return ret;
+}
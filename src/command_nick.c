@@ -17,8 +17,11 @@
 
 static int verbose = 0;
 
-static char enzyme[MAX_ENZYME_NAME_SIZE] = DEF_ENZ_NAME;
-static char rec_seq[MAX_REC_SEQ_SIZE] = DEF_REC_SEQ;
+/* of each channel, with the default one replaced by the first given */
+static char enzymes[MAX_CHANNELS][MAX_ENZYME_NAME_SIZE + 1] = { DEF_ENZ_NAME };
+static char rec_seqs[MAX_CHANNELS][MAX_REC_SEQ_SIZE + 1] = { DEF_REC_SEQ };
+static int enzyme_count = 0;
+static int rec_seq_count = 0;
 static char output_file[PATH_MAX] = DEF_OUTPUT;
 static int format = FORMAT_TSV;
 static int chrom_only = 0;
@@ -34,10 +37,12 @@ static void print_usage(void)
 			"   -f STR         output format, tsv/cmap/bnx/txt ["DEF_FORMAT"]\n"
 			"   -e STR         restriction enzyme name ["DEF_ENZ_NAME"]\n"
 			"   -r STR         recognition sequence ["DEF_REC_SEQ"]\n"
+			"                  (-e/-r can be given up to %d times in pairs, with\n"
+			"                  labels of each site in its own channel)\n"
 			"   -S             select only chr1-22, chrX and chrY to nick\n"
 			"   -v             show verbose messages\n"
 			"   -h             show this help\n"
-			"\n");
+			"\n", MAX_CHANNELS);
 }
 
 static int check_options(int argc, char * const argv[])
@@ -56,10 +61,18 @@ static int check_options(int argc, char * const argv[])
 			}
 			break;
 		case 'e':
-			snprintf(enzyme, sizeof(enzyme), "%s", optarg);
+			if (enzyme_count >= MAX_CHANNELS) {
+				fprintf(stderr, "Error: Too many enzymes, up to %d!\n", MAX_CHANNELS);
+				return 1;
+			}
+			snprintf(enzymes[enzyme_count++], sizeof(enzymes[0]), "%s", optarg);
 			break;
 		case 'r':
-			snprintf(rec_seq, sizeof(rec_seq), "%s", optarg);
+			if (rec_seq_count >= MAX_CHANNELS) {
+				fprintf(stderr, "Error: Too many recognition sequences, up to %d!\n", MAX_CHANNELS);
+				return 1;
+			}
+			snprintf(rec_seqs[rec_seq_count++], sizeof(rec_seqs[0]), "%s", optarg);
 			break;
 		case 'S':
 			chrom_only = 1;
@@ -77,14 +90,18 @@ static int check_options(int argc, char * const argv[])
 		print_usage();
 		return 1;
 	}
+	if ((enzyme_count > 1 || rec_seq_count > 1) && enzyme_count != rec_seq_count) {
+		fprintf(stderr, "Error: Enzyme names are not paired with recognition sequences!\n");
+		return 1;
+	}
 	return 0;
 }
 
 int nick_main(int argc, char * const argv[])
 {
-	struct rec_site site;
+	struct rec_site sites[MAX_CHANNELS];
 	struct ref_map ref;
-	int i, ret = 0;
+	int i, count, ret = 0;
 
 	if (check_options(argc, argv)) {
 		return 1;
@@ -92,13 +109,16 @@ int nick_main(int argc, char * const argv[])
 
 	ref_map_init(&ref);
 
-	if ((ret = prepare_rec_site(&site, enzyme, rec_seq)) != 0) {
-		goto final;
+	count = (rec_seq_count > 1 ? rec_seq_count : 1);
+	for (i = 0; i < count; ++i) {
+		if ((ret = prepare_rec_site(&sites[i], enzymes[i], rec_seqs[i])) != 0) {
+			goto final;
+		}
 	}
 
 	for (i = optind; i < argc; ++i) {
 		if ((ret = nick_map_load_seq(&ref, argv[i],
-				&site, chrom_only, verbose)) != 0) {
+				sites, count, chrom_only, verbose)) != 0) {
 			goto final;
 		}
 	}
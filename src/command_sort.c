@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "aln_file.h"
+
+#define DEF_OUTPUT "stdout"
+#define DEF_FORMAT "bin"
+#define DEF_MAX_MEMORY 512
+#define DEF_TEMP_PREFIX "bntools_sort"
+
+struct sort_item {
+	struct alignment aln;
+	size_t seq;  /* in input, to keep sorting stable */
+};
+
+struct run_reader {
+	char path[PATH_MAX];
+	struct aln_file *fp;
+	struct alignment aln;
+	size_t run;  /* ordinal of run */
+};
+
+static int verbose = 0;
+static int help = 0;
+
+static const char *output_file = DEF_OUTPUT;
+static int out_format = ALN_FORMAT_BIN;
+static int indexing = 0;
+static size_t max_memory = DEF_MAX_MEMORY;  /* in MB */
+static const char *temp_prefix = NULL;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "\n"
+			"Usage: bntools sort [options] <input>\n"
+			"\n"
+			"Options:\n"
+			"   <input>        alignment file from 'map', in txt/bin format\n"
+			"   -o FILE        output file ["DEF_OUTPUT"]\n"
+			"   -f STR         output format, txt/xmap/bin, xmap only from bin\n"
+			"                  input ["DEF_FORMAT"]\n"
+			"   -m INT         max memory (in MB) for sorting in memory [%d]\n"
+			"   -T PREFIX      prefix of temporary files [<output>, or "DEF_TEMP_PREFIX"]\n"
+			"   -i             write position index of bin output\n"
+			"   -v             show verbose message\n"
+			"   -h             show this help\n"
+			"\n", DEF_MAX_MEMORY);
+}
+
+static int check_options(int argc, char * const argv[])
+{
+	int c;
+	while ((c = getopt(argc, argv, "o:f:m:T:ivh")) != -1) {
+		switch (c) {
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'f':
+			out_format = parse_aln_format(optarg);
+			if (out_format == ALN_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Error: Unknown output format '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			max_memory = atoi(optarg);
+			if (max_memory == 0) {
+				fprintf(stderr, "Error: Invalid memory size '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			temp_prefix = optarg;
+			break;
+		case 'i':
+			indexing = 1;
+			break;
+		case 'v':
+			++verbose;
+			break;
+		case 'h':
+			++help;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (help || optind + 1 != argc) {
+		print_usage();
+		return 1;
+	}
+	if (indexing && (out_format != ALN_FORMAT_BIN || strcmp(output_file, DEF_OUTPUT) == 0
+				|| strcmp(output_file, "-") == 0)) {
+		fprintf(stderr, "Error: Only bin output into a file could be indexed!\n");
+		return 1;
+	}
+	if (!temp_prefix) {
+		temp_prefix = (strcmp(output_file, DEF_OUTPUT) == 0 || strcmp(output_file, "-") == 0
+				? DEF_TEMP_PREFIX : output_file);
+	}
+	return 0;
+}
+
+static inline int compare_alignment(const struct alignment *x, const struct alignment *y)
+{
+	if (x->chrom != y->chrom) {
+		return (x->chrom < y->chrom ? -1 : 1);
+	} else if (x->pos != y->pos) {
+		return (x->pos < y->pos ? -1 : 1);
+	} else if (x->size != y->size) {
+		return (x->size < y->size ? -1 : 1);
+	} else {
+		return 0;
+	}
+}
+
+static int compare_item(const void *a, const void *b)
+{
+	const struct sort_item *x = *(const struct sort_item **)a;
+	const struct sort_item *y = *(const struct sort_item **)b;
+	int c = compare_alignment(&x->aln, &y->aln);
+	if (c != 0) {
+		return c;
+	}
+	return (x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0));
+}
+
+static inline size_t item_memory(const struct sort_item *item)
+{
+	return sizeof(struct sort_item) + sizeof(struct sort_item *)
+		+ sizeof(int) * (item->aln.types.capacity
+				+ item->aln.rsizes.capacity + item->aln.qsizes.capacity);
+}
+
+static void temp_filename(size_t run, char *buf, size_t bufsize)
+{
+	snprintf(buf, bufsize, "%s.tmp.%04zd.bin", temp_prefix, run);
+}
+
+static int write_items(const char *filename, int format, const struct aln_header *header,
+		struct sort_item **sorted, size_t count, int index)
+{
+	struct aln_file *out;
+	size_t i;
+	int ret = 0;
+
+	out = aln_open_write(filename, format, header);
+	if (!out) {
+		return -EIO;
+	}
+	out->indexing = index;
+	for (i = 0; i < count && ret == 0; ++i) {
+		ret = aln_write(out, &sorted[i]->aln);
+	}
+	if (aln_close(out)) {
+		ret = -EIO;
+	}
+	return ret;
+}
+
+/* min-heap of run readers, by their current alignments */
+static inline int reader_less(const struct run_reader *x, const struct run_reader *y)
+{
+	int c = compare_alignment(&x->aln, &y->aln);
+	return (c < 0 || (c == 0 && x->run < y->run));
+}
+
+static void sift_down(struct run_reader **heap, size_t size, size_t i)
+{
+	struct run_reader *p = heap[i];
+	size_t child;
+
+	while ((child = i * 2 + 1) < size) {
+		if (child + 1 < size && reader_less(heap[child + 1], heap[child])) {
+			++child;
+		}
+		if (!reader_less(heap[child], p)) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = p;
+}
+
+static int merge_runs(size_t run_count, const struct aln_header *header)
+{
+	array(struct run_reader) readers = { };
+	array(struct run_reader *) heap = { };
+	struct aln_file *out = NULL;
+	size_t i;
+	int err, ret = 0;
+
+	if (array_reserve(readers, run_count) || array_reserve(heap, run_count)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < run_count; ++i) {
+		struct run_reader *r = &readers.data[readers.size++];
+		temp_filename(i, r->path, sizeof(r->path));
+		r->run = i;
+		alignment_init(&r->aln);
+		r->fp = aln_open_read(r->path);
+		if (!r->fp) {
+			ret = -EIO;
+			goto out;
+		}
+		err = aln_read(r->fp, &r->aln);
+		if (err == 0) {
+			heap.data[heap.size++] = r;
+		} else if (err != -1) {
+			ret = err;
+			goto out;
+		}
+	}
+	for (i = heap.size / 2; i > 0; --i) {
+		sift_down(heap.data, heap.size, i - 1);
+	}
+
+	out = aln_open_write(output_file, out_format, header);
+	if (!out) {
+		ret = -EIO;
+		goto out;
+	}
+	out->indexing = indexing;
+
+	while (heap.size > 0) {
+		struct run_reader *r = heap.data[0];
+		ret = aln_write(out, &r->aln);
+		if (ret) break;
+
+		err = aln_read(r->fp, &r->aln);
+		if (err == -1) {
+			heap.data[0] = heap.data[--heap.size];
+		} else if (err != 0) {
+			ret = err;
+			break;
+		}
+		if (heap.size > 0) {
+			sift_down(heap.data, heap.size, 0);
+		}
+	}
+
+out:
+	if (aln_close(out)) {
+		ret = -EIO;
+	}
+	for (i = 0; i < readers.size; ++i) {
+		aln_close(readers.data[i].fp);
+		alignment_free(&readers.data[i].aln);
+	}
+	array_free(heap);
+	array_free(readers);
+	return ret;
+}
+
+static void remove_runs(size_t run_count)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < run_count; ++i) {
+		temp_filename(i, path, sizeof(path));
+		unlink(path);
+	}
+}
+
+/*
+ * Alignments are read into memory until the limit, sorted and saved as a
+ * run in temporary (binary) file. Then all runs are merged into output.
+ */
+int sort_main(int argc, char * const argv[])
+{
+	char path[PATH_MAX];
+	struct aln_file *in = NULL;
+	array(struct sort_item) items = { };
+	array(struct sort_item *) sorted = { };
+	size_t i, n, seq, memory, run_count = 0;
+	int err = 0, ret = 0;
+
+	if (check_options(argc, argv)) {
+		return 1;
+	}
+
+	in = aln_open_read(argv[optind]);
+	if (!in) {
+		return 1;
+	}
+	if (in->format == ALN_FORMAT_TXT && out_format == ALN_FORMAT_XMAP) {
+		fprintf(stderr, "Error: Can not convert txt into xmap, "
+				"which needs query positions kept only in bin\n");
+		aln_close(in);
+		return 1;
+	}
+
+	seq = 0;
+	do {
+		for (n = 0, memory = 0; memory < max_memory * 1024 * 1024; ++n) {
+			if (n >= items.size) {
+				/* grown by half, as items are large to copy */
+				if (n == items.capacity && (array_reserve(items, n + n / 2 + 1)
+							|| array_reserve(sorted, n + n / 2 + 1))) {
+					fprintf(stderr, "Error: Failed to allocate memory!\n");
+					ret = 1;
+					goto out;
+				}
+				alignment_init(&items.data[n].aln);
+				++items.size;
+			}
+			err = aln_read(in, &items.data[n].aln);
+			if (err) break;
+			items.data[n].seq = seq++;
+			memory += item_memory(&items.data[n]);
+		}
+		if (err != 0 && err != -1) {
+			ret = 1;
+			goto out;
+		}
+		for (i = 0; i < n; ++i) {
+			sorted.data[i] = &items.data[i];
+		}
+		qsort(sorted.data, n, sizeof(sorted.data[0]), compare_item);
+
+		if (err == -1 && run_count == 0) {  /* all in memory */
+			if (write_items(output_file, out_format, &in->header, sorted.data, n, indexing)) {
+				ret = 1;
+			}
+			goto out;
+		}
+
+		temp_filename(run_count, path, sizeof(path));
+		++run_count;
+		if (write_items(path, ALN_FORMAT_BIN, &in->header, sorted.data, n, 0)) {
+			ret = 1;
+			goto out;
+		}
+		if (verbose > 0) {
+			fprintf(stderr, "Sorted run %zd: %zd alignments\n", run_count, n);
+		}
+	} while (err == 0);
+
+	if (merge_runs(run_count, &in->header)) {
+		ret = 1;
+	}
+
+out:
+	remove_runs(run_count);
+	for (i = 0; i < items.size; ++i) {
+		alignment_free(&items.data[i].aln);
+	}
+	array_free(sorted);
+	array_free(items);
+	aln_close(in);
+	return ret;
+}
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <limits.h>
 #include "nick_map.h"
 #include "bn_file.h"
@@ -25,6 +26,17 @@ static int out_format = FORMAT_TSV;
 static int counting = 0;
 static array(struct range) ranges = { };
 static int reverse = 0;
+static size_t shard_index = 0;
+static size_t shard_count = 1;
+
+enum long_option {
+	OPT_SHARD = 256,
+};
+
+static const struct option long_options[] = {
+	{ "shard", required_argument, NULL, OPT_SHARD },
+	{ NULL, 0, NULL, 0 },
+};
 
 static size_t fragment_count = 0;
 static size_t nick_count = 0;
@@ -44,6 +56,8 @@ static void print_usage(void)
 			"   -R FILE        select range(s), specified as lines in file\n"
 			"   -t             transform to reverse order\n"
 			"   -c             count fragments, nicks and total size\n"
+			"   --shard I/N    select only the I-th of N shards, which are\n"
+			"                  fragments with ordinal modulo N equal to I - 1\n"
 			"   -v             show verbose message\n"
 			"   -h             show this help, '-hh' for more detail help\n"
 			"\n");
@@ -51,6 +65,8 @@ static void print_usage(void)
 		fprintf(stderr, "Note:\n"
 				"   Range string is formatted as: <name>:<start>-<end>, where <name>\n"
 				"is a string without ':', <start> and <end> are numbers in bp.\n"
+				"   Ordinal of fragment for '--shard' is counted through all input\n"
+				"files, with fragments of other shards skipped without parsing.\n"
 				"\n");
 	}
 }
@@ -146,7 +162,7 @@ int append_ranges_in_file(const char *filename)
 static int check_options(int argc, char * const argv[])
 {
 	int c;
-	while ((c = getopt(argc, argv, "o:f:r:R:tcvh")) != -1) {
+	while ((c = getopt_long(argc, argv, "o:f:r:R:tcvh", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'o':
 			snprintf(output_file, sizeof(output_file), "%s", optarg);
@@ -174,6 +190,12 @@ static int check_options(int argc, char * const argv[])
 		case 'c':
 			counting = 1;
 			break;
+		case OPT_SHARD:
+			if (parse_shard_text(optarg, &shard_index, &shard_count)) {
+				fprintf(stderr, "Error: Invalid shard '%s'!\n", optarg);
+				return 1;
+			}
+			break;
 		case 'v':
 			++verbose;
 			break;
@@ -223,7 +245,8 @@ static void extract_fragment(const struct fragment *f, int start, int end, struc
 	for (i = 0; i < f->nicks.size; ++i) {
 		if (f->nicks.data[i].pos < start) continue;
 		if (end != 0 && f->nicks.data[i].pos > end) break;
-		nick_map_add_site(sub, f->nicks.data[i].pos - start, f->nicks.data[i].flag);
+		nick_map_add_site(sub, f->nicks.data[i].pos - start, f->nicks.data[i].flag,
+				f->nicks.data[i].channel);
 	}
 }
 
@@ -236,14 +259,14 @@ int process_fragment(struct nick_map *map, struct fragment *f, gzFile file)
 	} else {
 		if (reverse) {
 			size_t i;
-			int pos;
+			struct nick n;
 			for (i = 0; i < f->nicks.size; ++i) {
 				f->nicks.data[i].pos = f->size - f->nicks.data[i].pos;
 			}
-			for (i = 0; i < f->nicks.size / 2; ++i) {
-				pos = f->nicks.data[i].pos;
-				f->nicks.data[i].pos = f->nicks.data[f->nicks.size - 1 - i].pos;
-				f->nicks.data[f->nicks.size - 1 - i].pos = pos;
+			for (i = 0; i < f->nicks.size / 2; ++i) {  /* with channels kept */
+				n = f->nicks.data[i];
+				f->nicks.data[i] = f->nicks.data[f->nicks.size - 1 - i];
+				f->nicks.data[f->nicks.size - 1 - i] = n;
 			}
 		}
 		if (save_into_map) {
@@ -255,7 +278,7 @@ int process_fragment(struct nick_map *map, struct fragment *f, gzFile file)
 			f->nicks.size = 0;
 			f->nicks.capacity = 0;
 		} else {
-			save_fragment(file, f, out_format);
+			save_fragment(file, map, f, out_format);
 		}
 	}
 	return 0;
@@ -268,6 +291,7 @@ int view_main(int argc, char * const argv[])
 	struct fragment fragment = { };
 	struct fragment sub = { };
 	gzFile file;
+	uint64_t ordinal = 0;
 	int i, j, ret = 0;
 	int format;
 
@@ -286,7 +310,6 @@ int view_main(int argc, char * const argv[])
 			ret = 1;
 			goto out;
 		}
-		save_header(file, &map, out_format);
 	} else {
 		save_into_map = 1;
 		file = NULL;
@@ -303,7 +326,10 @@ int view_main(int argc, char * const argv[])
 			ret = 1;
 			goto out;
 		}
-		while (bn_read(fp, format, &fragment) == 0) {
+		if (file && i == optind) {  /* with channels of the first input */
+			save_header(file, &map, out_format);
+		}
+		while (bn_read_shard(fp, format, &fragment, shard_index, shard_count, &ordinal) == 0) {
 			if (ranges.size == 0) {
 				if (process_fragment(&map, &fragment, file)) {
 					ret = 1;
@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
 
 struct file *file_open(const char *filename)
 {
@@ -32,6 +33,26 @@ struct file *file_open(const char *filename)
 	return fp;
 }
 
+/* file to read from an opened descriptor, such as a socket */
+struct file *file_dopen(int fd, const char *name)
+{
+	struct file *fp;
+
+	fp = malloc(sizeof(struct file));
+	if (!fp) {
+		return NULL;
+	}
+	fp->file = gzdopen(fd, "r");
+	if (!fp->file) {
+		fprintf(stderr, "Error: Can not open file to read: '%s'\n", name);
+		free(fp);
+		return NULL;
+	}
+	fp->name = name;
+	fp->line = 1;
+	return fp;
+}
+
 void file_close(struct file *fp)
 {
 	if (fp) {
@@ -215,3 +236,38 @@ gzFile open_gzfile_write(const char *filename)
 	}
 	return file;
 }
+
+/* reopen output file truncated to 'offset', to append after it */
+gzFile open_gzfile_append(const char *filename, int64_t offset)
+{
+	gzFile file;
+	size_t len = strlen(filename);
+
+	if (truncate(filename, offset) != 0) {
+		fprintf(stderr, "Error: Can not truncate output file '%s'\n", filename);
+		return NULL;
+	}
+	if (len > 3 && strcmp(filename + len - 3, ".gz") == 0) {
+		file = gzopen(filename, "a9"); /* as a new gzip member */
+	} else {
+		file = gzopen(filename, "aT");
+	}
+	if (!file) {
+		fprintf(stderr, "Error: Can not open output file '%s'\n", filename);
+		return NULL;
+	}
+	return file;
+}
+
+/*
+ * Write out all data of output file, completing the gzip stream if
+ * compressed, and get size of the file in 'offset'.
+ */
+int flush_gzfile(gzFile file, int64_t *offset)
+{
+	if (gzflush(file, Z_FINISH) != Z_OK) {
+		return -EIO;
+	}
+	*offset = gzoffset(file);
+	return (*offset >= 0 ? 0 : -EIO);
+}
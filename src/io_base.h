@@ -2,6 +2,7 @@
 #define __IO_BASE_H__
 
 #include <stdio.h>
+#include <stdint.h>
 #include <zlib.h>
 
 struct file {
@@ -11,6 +12,7 @@ struct file {
 };
 
 struct file *file_open(const char *filename);
+struct file *file_dopen(int fd, const char *name);
 void file_close(struct file *fp);
 
 static inline int current_char(struct file *fp)
@@ -32,5 +34,7 @@ void skip_to_next_line(struct file *fp, char *buf, size_t bufsize);
 			##args, (fp)->line, (fp)->name)
 
 gzFile open_gzfile_write(const char *filename);
+gzFile open_gzfile_append(const char *filename, int64_t offset);
+int flush_gzfile(gzFile file, int64_t *offset);
 
 #endif /* __IO_BASE_H__ */
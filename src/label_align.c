@@ -0,0 +1,717 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include "label_align.h"
+
+#define LANES 8  /* cells filled at once, in a vector of int16 scores */
+#define MOVE_TRACED 0x08  /* flag of a move, whose cell is traced from any end */
+#define NO_LINK SIZE_MAX
+
+/* of 128 bits, supported by most SIMD units, with sizes in two halves */
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int16_t v8hi __attribute__((vector_size(16)));
+typedef uint8_t v16qu __attribute__((vector_size(16)));
+
+struct lane_sizes {
+	v4sf size[2];
+	v4sf scaled[2];
+};
+
+/* sizes of LANES intervals between labels from 'end' and 'start' */
+static inline void load_sizes(struct lane_sizes *s, const int *end, const int *start, float scale)
+{
+	v4si p0, p1;
+	int k;
+
+	for (k = 0; k < 2; ++k) {
+		memcpy(&p0, end + k * 4, sizeof(p0));
+		memcpy(&p1, start + k * 4, sizeof(p1));
+		s->size[k] = __builtin_convertvector(p0 - p1, v4sf);
+		s->scaled[k] = s->size[k] * scale;
+	}
+}
+
+void dp_matrix_init(struct dp_matrix *m)
+{
+	memset(m, 0, sizeof(struct dp_matrix));
+}
+
+void dp_matrix_free(struct dp_matrix *m)
+{
+	array_free(m->heap);
+	array_free(m->extended);
+	array_free(m->steps);
+	array_free(m->ends);
+	array_free(m->checkpoints);
+	array_free(m->pos_b);
+	array_free(m->pos_a);
+	array_free(m->moves);
+	array_free(m->scores);
+	array_free(m->offsets);
+}
+
+/*
+ * Range of i in anti-diagonal d, also inside the band of j - i, which is
+ * d - 2 * i, from 'band_low' to 'band_high'. An anti-diagonal out of the
+ * band is empty, as [1, 0].
+ */
+static inline void diagonal_range(const struct dp_matrix *m, size_t d, size_t *low, size_t *high)
+{
+	long x = (long)d - m->band_high, y = (long)d - m->band_low;
+	long l = (x > 0 ? (x + 1) / 2 : 0), h = y / 2;
+
+	if ((long)d + 1 - (long)m->h > l) {
+		l = (long)d + 1 - (long)m->h;
+	}
+	if ((long)d < h) {
+		h = d;
+	}
+	if ((long)(m->w - 1) < h) {
+		h = m->w - 1;
+	}
+	if (y < 0 || l > h) {
+		l = 1;
+		h = 0;
+	}
+	*low = l;
+	*high = h;
+}
+
+static inline size_t diagonal_low(const struct dp_matrix *m, size_t d)
+{
+	size_t low, high;
+	diagonal_range(m, d, &low, &high);
+	return low;
+}
+
+static inline size_t diagonal_high(const struct dp_matrix *m, size_t d)
+{
+	size_t low, high;
+	diagonal_range(m, d, &low, &high);
+	return high;
+}
+
+/* j - i of cell i in anti-diagonal d */
+static inline long diagonal_shift(size_t d, size_t i)
+{
+	return (long)d - 2 * (long)i;
+}
+
+/* in linear mode, anti-diagonal d is kept in the slot-th 'width' cells */
+static inline void map_diagonal(struct dp_matrix *m, size_t d, size_t slot)
+{
+	m->offsets.data[d] = slot * m->width - diagonal_low(m, d);  /* maybe wrapped */
+}
+
+/* anti-diagonals kept before a checkpoint, for all moves into it */
+static inline size_t history(const struct dp_matrix *m)
+{
+	return m->params.max_delta * 2;
+}
+
+/*
+ * In linear mode, there are 'history' anti-diagonals kept with the one
+ * filled, and a block between checkpoints of about sqrt(n * history) ones
+ * is filled again, for least memory of checkpoints and block together.
+ */
+static int prepare_linear(struct dp_matrix *m)
+{
+	size_t n = m->offsets.size;
+	size_t count, cells;
+
+	m->linear = 1;
+	m->interval = (size_t)sqrt((double)n * history(m)) + 1;
+	if (m->interval < history(m)) {
+		m->interval = history(m);
+	}
+	count = (n + m->interval - 1) / m->interval;
+	cells = m->interval + history(m);  /* more than ring of history(m) + 1 */
+
+	if (array_reserve(m->checkpoints, count * history(m) * m->width)
+			|| array_reserve(m->scores, cells * m->width)
+			|| array_reserve(m->moves, cells * m->width)) {
+		return -ENOMEM;
+	}
+	m->checkpoints.size = count * history(m) * m->width;
+	m->scores.size = cells * m->width;
+	m->moves.size = cells * m->width;
+	return 0;
+}
+
+static int prepare_matrix(struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb, const struct align_params *params,
+		long band_low, long band_high)
+{
+	size_t d, i, n, low, high;
+
+	m->w = fa->nicks.size;
+	m->h = fb->nicks.size;
+	m->params = *params;
+	m->band_low = band_low;
+	m->band_high = band_high;
+	m->offsets.size = 0;
+	m->scores.size = 0;
+	m->moves.size = 0;
+	m->pos_a.size = 0;
+	m->pos_b.size = 0;
+	m->linear = 0;
+	m->checkpoints.size = 0;
+	m->ends.size = 0;
+	m->steps.size = 0;
+	m->heap.size = 0;
+	if (m->w == 0 || m->h == 0) {
+		return 0;
+	}
+
+	if (array_reserve(m->offsets, m->w + m->h - 1)
+			|| array_reserve(m->pos_a, m->w)
+			|| array_reserve(m->pos_b, m->h)) {
+		return -ENOMEM;
+	}
+	m->offsets.size = m->w + m->h - 1;
+
+	for (d = 0, n = 0, m->width = 0; d < m->offsets.size; ++d) {
+		diagonal_range(m, d, &low, &high);
+		m->offsets.data[d] = n - low;
+		n += high + 1 - low;
+		if (m->width < high + 1 - low) {
+			m->width = high + 1 - low;
+		}
+	}
+	if (array_reserve(m->extended, m->width)) {
+		return -ENOMEM;
+	}
+
+	if (n * (sizeof(int16_t) + sizeof(uint8_t)) > params->max_memory) {
+		if (prepare_linear(m)) {
+			return -ENOMEM;
+		}
+	} else {
+		if (array_reserve(m->scores, n) || array_reserve(m->moves, n)) {
+			return -ENOMEM;
+		}
+		m->scores.size = n;
+		m->moves.size = n;
+	}
+
+	for (i = 0; i < m->w; ++i) {
+		m->pos_a.data[i] = fa->nicks.data[i].pos;
+	}
+	for (i = 0; i < m->h; ++i) {
+		m->pos_b.data[i] = fb->nicks.data[m->h - 1 - i].pos;
+	}
+	m->pos_a.size = m->w;
+	m->pos_b.size = m->h;
+	return 0;
+}
+
+/*
+ * Intervals are similar if their difference is less than 'tolerance' of the
+ * smaller one, as each is less than the other scaled by (1 + tolerance).
+ */
+static inline int similar(int frag_a, int frag_b, float scale)
+{
+	return frag_a < frag_b * scale && frag_b < frag_a * scale;
+}
+
+/*
+ * Cell i of anti-diagonal d, moved from (i - di, j - dj) with the most
+ * score, where intervals stepped over in 'a' and 'b' are similar. Moves
+ * are tried in order of delta_j and then delta_i, with the first best one
+ * kept.
+ */
+static void fill_cell(struct dp_matrix *m, size_t d, size_t i, int max_delta, float scale)
+{
+	const int *pa = m->pos_a.data + i;
+	const int *pb = m->pos_b.data + (m->h - 1 + i - d);  /* as label j of 'b' */
+	size_t j = d - i;
+	long shift = diagonal_shift(d, i);
+	int16_t best = 0, score;
+	uint8_t move = 0;
+	int di, dj;
+
+	for (dj = 1; dj <= max_delta && dj <= j; ++dj) {
+		for (di = 1; di <= max_delta && di <= i; ++di) {
+			if (shift + di - dj < m->band_low || shift + di - dj > m->band_high) continue;
+			if (!similar(pa[0] - pa[-di], pb[0] - pb[dj], scale)) continue;
+			score = m->scores.data[m->offsets.data[d - di - dj] + i - di];
+			if (score < INT16_MAX) {  /* saturated */
+				++score;
+			}
+			if (best < score) {
+				best = score;
+				move = (di << 4) | dj;
+			}
+		}
+	}
+	m->scores.data[m->offsets.data[d] + i] = best;
+	m->moves.data[m->offsets.data[d] + i] = move;
+}
+
+/* the same as fill_cell(), for LANES cells from i, with all moves inside */
+static void fill_lanes(struct dp_matrix *m, size_t d, size_t i, int max_delta, float scale)
+{
+	const v8hi even = { 0, 2, 4, 6, 8, 10, 12, 14 };
+	const v16qu even_bytes = { 0, 2, 4, 6, 8, 10, 12, 14, 0, 2, 4, 6, 8, 10, 12, 14 };
+	const int *pa = m->pos_a.data + i;
+	const int *pb = m->pos_b.data + (m->h - 1 + i - d);
+	struct lane_sizes frag_a[MAX_DELTA + 1], frag_b[MAX_DELTA + 1];
+	v4si match[2];
+	v8hi best = { }, move = { }, score, gt;
+	v16qu moves;
+	int di, dj, k;
+
+	for (di = 1; di <= max_delta; ++di) {
+		load_sizes(&frag_a[di], pa, pa - di, scale);
+	}
+	for (dj = 1; dj <= max_delta; ++dj) {
+		load_sizes(&frag_b[dj], pb, pb + dj, scale);
+	}
+
+	for (dj = 1; dj <= max_delta; ++dj) {
+		for (di = 1; di <= max_delta; ++di) {
+			const int16_t *prev = m->scores.data + m->offsets.data[d - di - dj] + i - di;
+			for (k = 0; k < 2; ++k) {
+				match[k] = (frag_a[di].size[k] < frag_b[dj].scaled[k])
+					& (frag_b[dj].size[k] < frag_a[di].scaled[k]);
+			}
+			memcpy(&score, prev, sizeof(score));
+			score = (score - (score < INT16_MAX))
+				& __builtin_shuffle((v8hi)match[0], (v8hi)match[1], even);
+			gt = score > best;
+			best = (best & ~gt) | (score & gt);
+			move = (move & ~gt) | ((int16_t)((di << 4) | dj) & gt);
+		}
+	}
+	moves = __builtin_shuffle((v16qu)move, even_bytes);
+	memcpy(m->scores.data + m->offsets.data[d] + i, &best, sizeof(best));
+	memcpy(m->moves.data + m->offsets.data[d] + i, &moves, LANES);
+}
+
+/*
+ * Cells of an anti-diagonal only depend on former ones, so they are filled
+ * in vectors, except those near the edges with some moves out of matrix,
+ * or out of band, where j - i of a move changes by up to max_delta - 1.
+ */
+static void fill_diagonal(struct dp_matrix *m, size_t d)
+{
+	float scale = 1 + m->params.tolerance;
+	int max_delta = m->params.max_delta;
+	size_t i, low, high;
+
+	diagonal_range(m, d, &low, &high);
+	for (i = low; i <= high; ) {
+		if (i >= max_delta && i + LANES - 1 <= high && i + LANES - 1 + max_delta <= d
+				&& diagonal_shift(d, i) + max_delta - 1 <= m->band_high
+				&& diagonal_shift(d, i + LANES - 1) - (max_delta - 1) >= m->band_low) {
+			fill_lanes(m, d, i, max_delta, scale);
+			i += LANES;
+		} else {
+			fill_cell(m, d, i, max_delta, scale);
+			++i;
+		}
+	}
+}
+
+/* cells moved from by 'move', flagged as nonzero */
+static inline void flag_moved(uint8_t *flags, const uint8_t *moves, size_t n, uint8_t move)
+{
+	v16qu f, v;
+	size_t k;
+
+	for (k = 0; k + sizeof(v) <= n; k += sizeof(v)) {
+		memcpy(&f, flags + k, sizeof(f));
+		memcpy(&v, moves + k, sizeof(v));
+		f |= (v16qu)(v == move);
+		memcpy(flags + k, &f, sizeof(f));
+	}
+	for (; k < n; ++k) {
+		flags[k] |= (moves[k] == move);
+	}
+}
+
+/*
+ * Ends of alignments, as local maxima not moved from by any cell after,
+ * which needs anti-diagonals up to d + history(m) filled.
+ */
+static int collect_ends(struct dp_matrix *m, size_t d)
+{
+	int max_delta = m->params.max_delta;
+	size_t i, k, from, to, low, high;
+	uint8_t *extended = m->extended.data;
+	struct dp_end *e;
+	int di, dj;
+
+	diagonal_range(m, d, &low, &high);
+	memset(m->extended.data, 0, high + 1 - low);
+	for (dj = 1; dj <= max_delta; ++dj) {
+		for (di = 1; di <= max_delta && d + di + dj < m->offsets.size; ++di) {
+			diagonal_range(m, d + di + dj, &from, &to);  /* of cell (i + di, j + dj) */
+			if (to < di || from > to) continue;
+			from = (from > low + di ? from - di : low);
+			to = (to - di < high ? to - di : high);
+			if (from <= to) {
+				flag_moved(extended + (from - low),
+						m->moves.data + m->offsets.data[d + di + dj] + di + from,
+						to - from + 1, (di << 4) | dj);
+			}
+		}
+	}
+
+	for (i = low, k = m->offsets.data[d] + low; i <= high; ++i, ++k) {
+		if (m->scores.data[k] < m->params.min_score || extended[i - low]) continue;
+		if (m->ends.size == m->ends.capacity
+				&& array_reserve(m->ends, m->ends.size + m->ends.size / 2 + 1)) {
+			return -ENOMEM;
+		}
+		e = &m->ends.data[m->ends.size++];
+		e->score = m->scores.data[k];
+		e->i = i;
+		e->j = d - i;
+	}
+	return 0;
+}
+
+/* scores of anti-diagonals before the c-th checkpoint, in (or into) slots from 0 */
+static void copy_checkpoint(struct dp_matrix *m, size_t c, int restore)
+{
+	size_t first = c * m->interval, t, d, low;
+	int16_t *p;
+
+	for (t = 0; t < history(m) && t < first; ++t) {
+		d = first - history(m) + t;
+		low = diagonal_low(m, d);
+		p = m->checkpoints.data + (c * history(m) + t) * m->width;
+		if (restore) {
+			map_diagonal(m, d, t);
+			memcpy(m->scores.data + m->offsets.data[d] + low, p,
+					sizeof(int16_t) * (diagonal_high(m, d) - low + 1));
+		} else {
+			memcpy(p, m->scores.data + m->offsets.data[d] + low,
+					sizeof(int16_t) * (diagonal_high(m, d) - low + 1));
+		}
+	}
+}
+
+static int fill_full(struct dp_matrix *m)
+{
+	size_t d;
+
+	for (d = 0; d < m->offsets.size; ++d) {
+		fill_diagonal(m, d);
+		if (d >= history(m) && collect_ends(m, d - history(m))) {
+			return -ENOMEM;
+		}
+	}
+	for (d = (d > history(m) ? d - history(m) : 0); d < m->offsets.size; ++d) {
+		if (collect_ends(m, d)) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* ends of alignments are collected from anti-diagonals out of ring */
+static int fill_linear(struct dp_matrix *m)
+{
+	size_t slots = history(m) + 1;
+	size_t d;
+
+	for (d = 0; d < m->offsets.size; ++d) {
+		if (d % m->interval == 0) {
+			copy_checkpoint(m, d / m->interval, 0);
+		}
+		if (d >= slots && collect_ends(m, d - slots)) {
+			return -ENOMEM;
+		}
+		map_diagonal(m, d, d % slots);
+		fill_diagonal(m, d);
+	}
+	for (d = (d > slots ? d - slots : 0); d < m->offsets.size; ++d) {
+		if (collect_ends(m, d)) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* moves between the c-th checkpoint and the next, in linear mode */
+static void fill_block(struct dp_matrix *m, size_t c)
+{
+	size_t first = c * m->interval, d, t;
+
+	copy_checkpoint(m, c, 1);
+	t = (first < history(m) ? first : history(m));
+	for (d = first; d < first + m->interval && d < m->offsets.size; ++d) {
+		map_diagonal(m, d, t + d - first);
+		fill_diagonal(m, d);
+	}
+}
+
+int dp_matrix_fill(struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb, const struct align_params *params)
+{
+	return dp_matrix_fill_band(m, fa, fb, params,
+			1 - (long)fa->nicks.size, (long)fb->nicks.size - 1);
+}
+
+int dp_matrix_fill_band(struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb, const struct align_params *params,
+		long band_low, long band_high)
+{
+	assert(params->max_delta >= 1 && params->max_delta <= MAX_DELTA);
+
+	if (prepare_matrix(m, fa, fb, params, band_low, band_high)) {
+		return -ENOMEM;
+	}
+	return (m->linear ? fill_linear(m) : fill_full(m));
+}
+
+/*
+ * Traces of ends from anti-diagonal 'first' on, with steps appended. A
+ * trace stops at cell traced by another, as they are the same from then.
+ */
+static int trace_block(struct dp_matrix *m, struct dp_step *traces, size_t *count, size_t first)
+{
+	struct dp_step *p;
+	size_t e, k;
+	uint8_t move;
+	int done;
+
+	for (e = 0; e < *count; ) {
+		p = &traces[e];
+		done = 0;
+		while (!done && p->i + p->j >= first) {
+			k = dp_cell(m, p->i, p->j);
+			move = m->moves.data[k];
+			if ((move & MOVE_TRACED) != 0) {
+				m->ends.data[p->end].link = p->j * m->w + p->i;
+				break;
+			}
+			if (m->steps.size == m->steps.capacity
+					&& array_reserve(m->steps, m->steps.size + m->steps.size / 2 + 1)) {
+				return -ENOMEM;
+			}
+			m->steps.data[m->steps.size++] = *p;
+			m->moves.data[k] = move | MOVE_TRACED;
+			done = (move_delta_i(move) == 0 && move_delta_j(move) == 0);
+			p->i -= move_delta_i(move);
+			p->j -= move_delta_j(move);
+		}
+		if (done || p->i + p->j >= first) {
+			traces[e] = traces[--*count];
+		} else {
+			++e;
+		}
+	}
+	return 0;
+}
+
+/* by score, and then by position as scanned row by row */
+static inline int end_less(const struct dp_end *x, const struct dp_end *y)
+{
+	if (x->score != y->score) {
+		return x->score > y->score;
+	} else if (x->j != y->j) {
+		return x->j < y->j;
+	} else {
+		return x->i < y->i;
+	}
+}
+
+static void sift_down(struct dp_matrix *m, size_t i)
+{
+	size_t *heap = m->heap.data;
+	size_t e = heap[i];
+	size_t child;
+
+	while ((child = i * 2 + 1) < m->heap.size) {
+		if (child + 1 < m->heap.size
+				&& end_less(&m->ends.data[heap[child + 1]], &m->ends.data[heap[child]])) {
+			++child;
+		}
+		if (!end_less(&m->ends.data[heap[child]], &m->ends.data[e])) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+/* by end, and then from the end of alignment */
+static int compare_step(const void *a, const void *b)
+{
+	const struct dp_step *x = a;
+	const struct dp_step *y = b;
+	if (x->end != y->end) {
+		return (x->end < y->end ? -1 : 1);
+	}
+	return (x->i + x->j > y->i + y->j ? -1 : (x->i + x->j < y->i + y->j ? 1 : 0));
+}
+
+struct cell_step {
+	size_t cell;  /* as j * w + i */
+	size_t step;
+};
+
+static int compare_cell(const void *a, const void *b)
+{
+	const struct cell_step *x = a;
+	const struct cell_step *y = b;
+	return (x->cell < y->cell ? -1 : (x->cell > y->cell ? 1 : 0));
+}
+
+/* steps grouped by end, with cells where traces stop as index of steps */
+static int link_steps(struct dp_matrix *m)
+{
+	array(struct cell_step) cells = { };
+	struct cell_step key, *found;
+	struct dp_end *p;
+	size_t e, k;
+
+	qsort(m->steps.data, m->steps.size, sizeof(struct dp_step), compare_step);
+	if (array_reserve(cells, m->steps.size)) {
+		return -ENOMEM;
+	}
+	for (k = 0; k < m->steps.size; ++k) {
+		cells.data[k].cell = m->steps.data[k].j * m->w + m->steps.data[k].i;
+		cells.data[k].step = k;
+	}
+	cells.size = m->steps.size;
+	qsort(cells.data, cells.size, sizeof(struct cell_step), compare_cell);
+
+	for (e = 0, k = 0; e < m->ends.size; ++e) {
+		p = &m->ends.data[e];
+		p->first = k;
+		while (k < m->steps.size && m->steps.data[k].end == e) {
+			++k;
+		}
+		p->count = k - p->first;
+		p->claimed = k;
+		if (p->link != NO_LINK) {
+			key.cell = p->link;
+			found = bsearch(&key, cells.data, cells.size, sizeof(struct cell_step), compare_cell);
+			assert(found != NULL);
+			p->link = found->step;
+		}
+	}
+	array_free(cells);
+	return 0;
+}
+
+/*
+ * All ends are traced back together, block by block from the last in linear
+ * mode, so that each block is filled once. Then ends are put in a heap, for
+ * alignments to be taken in order by dp_matrix_next().
+ */
+int dp_matrix_trace(struct dp_matrix *m)
+{
+	array(struct dp_step) traces = { };  /* of each end being traced */
+	size_t c, e;
+	int ret = 0;
+
+	m->steps.size = 0;
+	m->heap.size = 0;
+	if (array_reserve(traces, m->ends.size) || array_reserve(m->heap, m->ends.size)) {
+		array_free(traces);
+		return -ENOMEM;
+	}
+	for (e = 0; e < m->ends.size; ++e) {
+		m->ends.data[e].link = NO_LINK;
+		traces.data[e].end = e;
+		traces.data[e].i = m->ends.data[e].i;
+		traces.data[e].j = m->ends.data[e].j;
+	}
+	traces.size = m->ends.size;
+
+	if (m->linear) {
+		for (c = (m->offsets.size - 1) / m->interval + 1; c > 0 && traces.size > 0 && ret == 0; --c) {
+			fill_block(m, c - 1);
+			ret = trace_block(m, traces.data, &traces.size, (c - 1) * m->interval);
+		}
+	} else if (m->offsets.size > 0) {
+		ret = trace_block(m, traces.data, &traces.size, 0);
+	}
+	array_free(traces);
+	if (ret || link_steps(m)) {
+		return -ENOMEM;
+	}
+
+	for (e = 0; e < m->ends.size; ++e) {
+		m->heap.data[e] = e;
+	}
+	m->heap.size = m->ends.size;
+	for (e = m->heap.size / 2; e > 0; --e) {
+		sift_down(m, e - 1);
+	}
+	return 0;
+}
+
+/*
+ * Cells of the alignment from end e, along its steps and then steps where
+ * its trace stops, until any cell claimed by alignments taken before. As an
+ * alignment claims steps from where it enters, up to those claimed before,
+ * claimed steps of each end are always its last ones, from 'claimed' on.
+ */
+static size_t walk_alignment(struct dp_matrix *m, size_t e, int claim,
+		size_t *result_a, size_t *result_b, int *truncated)
+{
+	struct dp_end *p;
+	size_t k = m->ends.data[e].first, stop, count = 0;
+
+	for (;;) {
+		p = &m->ends.data[m->steps.data[k].end];
+		stop = (p->claimed > k ? p->claimed : k);
+		if (claim && stop > k) {
+			p->claimed = k;
+			for (; k < stop; ++k, ++count) {
+				result_a[count] = m->steps.data[k].i;
+				result_b[count] = m->steps.data[k].j;
+			}
+		} else {
+			count += stop - k;
+		}
+		if (stop < p->first + p->count) {
+			*truncated = 1;
+			break;
+		} else if (p->link == NO_LINK) {
+			*truncated = 0;
+			break;
+		}
+		k = p->link;
+	}
+	return count;
+}
+
+size_t dp_matrix_next(struct dp_matrix *m, size_t *result_a, size_t *result_b)
+{
+	struct dp_end *p;
+	size_t e, count;
+	int truncated, score;
+
+	while (m->heap.size > 0) {
+		e = m->heap.data[0];
+		p = &m->ends.data[e];
+		count = walk_alignment(m, e, 0, NULL, NULL, &truncated);
+		score = (truncated ? (int)count - 1 : p->score);
+		if (score == p->score) {
+			m->heap.data[0] = m->heap.data[--m->heap.size];
+			if (m->heap.size > 0) {
+				sift_down(m, 0);
+			}
+			return walk_alignment(m, e, 1, result_a, result_b, &truncated);
+		} else if (score >= m->params.min_score) {
+			p->score = score;  /* taken again later, with cells claimed by then */
+			sift_down(m, 0);
+		} else {
+			m->heap.data[0] = m->heap.data[--m->heap.size];
+			if (m->heap.size > 0) {
+				sift_down(m, 0);
+			}
+		}
+	}
+	return 0;
+}
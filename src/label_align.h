@@ -0,0 +1,99 @@
+#ifndef __LABEL_ALIGN_H__
+#define __LABEL_ALIGN_H__
+
+#include <stdint.h>
+#include "nick_map.h"
+#include "array.h"
+
+#define MAX_DELTA 7  /* as packed in 3 bits of a move */
+
+struct align_params {
+	double tolerance;  /* to compare interval sizes */
+	int max_delta;     /* max labels stepped over in one move, 1 for none missing */
+	int min_score;     /* minimal matched intervals of a reported alignment */
+	size_t max_memory; /* of full matrix, in bytes, or filled in linear memory */
+};
+
+/* cell where a local alignment ends, as it is not extended by others */
+struct dp_end {
+	int score;       /* less when truncated by alignments taken before */
+	size_t i, j;
+	size_t first;    /* of steps traced from it */
+	size_t count;
+	size_t link;     /* step where its trace stops, as traced from others */
+	size_t claimed;  /* first of its steps taken by alignments */
+};
+
+/* label pair of an alignment, traced back from its end */
+struct dp_step {
+	size_t end;  /* index of end */
+	size_t i, j;
+};
+
+/*
+ * DP matrix between labels of two fragments, where cell (i, j) is the best
+ * local alignment ending at label i of 'a' and label j of 'b', scored as
+ * matched intervals. Cells are stored by anti-diagonal (i + j), as a cell
+ * only depends on cells of former anti-diagonals, so that each one is
+ * filled in vectors.
+ *
+ * Ends of alignments are collected while filling, and then all traced
+ * back together, for local alignments to be taken from a heap of ends, by
+ * score, with cells taken before skipped.
+ *
+ * With a band, only cells of j - i from 'band_low' to 'band_high' are
+ * filled, as those out of band are taken as 0, for alignments near the
+ * diagonals of seeds.
+ *
+ * In linear mode, for matrix larger than 'max_memory', only the last
+ * anti-diagonals are kept while filling, with scores saved at checkpoints.
+ * Moves are then filled again by blocks between checkpoints to trace back.
+ */
+struct dp_matrix {
+	size_t w, h;  /* label count of 'a' and 'b' */
+	struct align_params params;
+	long band_low, band_high;  /* of j - i, for cells filled */
+	array(size_t) offsets;  /* of each anti-diagonal, as index of its cell i = 0 */
+	array(int16_t) scores;
+	array(uint8_t) moves;   /* delta_i << 4 | delta_j, 0 for start of alignment */
+	array(int) pos_a;
+	array(int) pos_b;  /* reversed, to be contiguous along anti-diagonal */
+
+	int linear;
+	size_t width;     /* cells kept for each anti-diagonal */
+	size_t interval;  /* anti-diagonals between checkpoints */
+	array(int16_t) checkpoints;  /* scores of anti-diagonals before each checkpoint */
+	array(uint8_t) extended;  /* flags of cells in an anti-diagonal */
+	array(struct dp_end) ends;
+	array(struct dp_step) steps; /* grouped by end */
+	array(size_t) heap;          /* of ends, not taken yet */
+};
+
+void dp_matrix_init(struct dp_matrix *m);
+void dp_matrix_free(struct dp_matrix *m);
+
+int dp_matrix_fill(struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb, const struct align_params *params);
+int dp_matrix_fill_band(struct dp_matrix *m, const struct fragment *fa,
+		const struct fragment *fb, const struct align_params *params,
+		long band_low, long band_high);
+
+int dp_matrix_trace(struct dp_matrix *m);
+
+/*
+ * Label pairs of the next best alignment, from its end, into 'result_a'
+ * and 'result_b' of at least min(w, h) items, with count of them returned,
+ * or 0 for no more alignments.
+ */
+size_t dp_matrix_next(struct dp_matrix *m, size_t *result_a, size_t *result_b);
+
+/* in linear mode, only for anti-diagonals kept, and only inside band */
+static inline size_t dp_cell(const struct dp_matrix *m, size_t i, size_t j)
+{
+	return m->offsets.data[i + j] + i;
+}
+
+static inline int move_delta_i(uint8_t move) { return (move >> 4) & MAX_DELTA; }
+static inline int move_delta_j(uint8_t move) { return move & MAX_DELTA; }
+
+#endif /* __LABEL_ALIGN_H__ */
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include "label_sketch.h"
+
+struct sketch_buffer {
+	array(uint64_t) tuples;      /* hash of each tuple in a fragment */
+	array(uint64_t) minimizers;  /* distinct ones of a fragment */
+	array(size_t) fragments;     /* hit by minimizers of a fragment */
+};
+
+void map_sketch_init(struct map_sketch *s)
+{
+	memset(s, 0, sizeof(struct map_sketch));
+}
+
+void map_sketch_free(struct map_sketch *s)
+{
+	array_free(s->items);
+}
+
+static void sketch_buffer_free(struct sketch_buffer *buf)
+{
+	array_free(buf->fragments);
+	array_free(buf->minimizers);
+	array_free(buf->tuples);
+}
+
+/* finalizer of splitmix64, for tuples spread over hashes */
+static inline uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * Intervals are quantized by log of size, into bins twice as wide as the
+ * tolerance, so that most similar intervals fall into the same bin. Bins
+ * of each grid are shifted by half, for those near bounds of the other.
+ */
+#define GRIDS 2
+
+static inline uint64_t quantize(int size, double bin, int grid)
+{
+	return (size > 1 ? (uint64_t)(log(size) / bin + 0.5 * grid) : 0);
+}
+
+static int compare_hash(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/*
+ * Distinct minimizers of fragment f, as the least hash of tuples in each
+ * window, or of all tuples for fragment shorter than a window.
+ */
+static int fragment_minimizers(const struct fragment *f,
+		const struct sketch_params *params, struct sketch_buffer *buf)
+{
+	double bin = log(1 + params->tolerance * 2);
+	size_t n = (f->nicks.size > 0 ? f->nicks.size - 1 : 0);  /* intervals */
+	size_t count, window, p, t, k;
+	uint64_t h, least;
+	int grid;
+
+	buf->tuples.size = 0;
+	buf->minimizers.size = 0;
+	if (n < params->k) {
+		return 0;
+	}
+	count = n - params->k + 1;
+	window = (count < params->window ? count : params->window);
+	if (array_reserve(buf->tuples, count)
+			|| array_reserve(buf->minimizers, (count - window + 1) * GRIDS)) {
+		return -ENOMEM;
+	}
+
+	for (grid = 0; grid < GRIDS; ++grid) {
+		for (p = 0; p < count; ++p) {
+			for (k = 0, h = grid; k < params->k; ++k) {
+				h = mix(h + quantize(f->nicks.data[p + k + 1].pos - f->nicks.data[p + k].pos,
+							bin, grid));
+			}
+			buf->tuples.data[p] = h;
+		}
+		buf->tuples.size = count;
+
+		for (p = 0; p + window <= count; ++p) {
+			for (t = 1, least = buf->tuples.data[p]; t < window; ++t) {
+				if (least > buf->tuples.data[p + t]) {
+					least = buf->tuples.data[p + t];
+				}
+			}
+			if (p == 0 || buf->minimizers.data[buf->minimizers.size - 1] != least) {
+				buf->minimizers.data[buf->minimizers.size++] = least;
+			}
+		}
+	}
+
+	qsort(buf->minimizers.data, buf->minimizers.size, sizeof(uint64_t), compare_hash);
+	for (p = 0, k = 0; p < buf->minimizers.size; ++p) {
+		if (k == 0 || buf->minimizers.data[k - 1] != buf->minimizers.data[p]) {
+			buf->minimizers.data[k++] = buf->minimizers.data[p];
+		}
+	}
+	buf->minimizers.size = k;
+	return 0;
+}
+
+static int compare_item(const void *a, const void *b)
+{
+	const struct sketch_item *x = a;
+	const struct sketch_item *y = b;
+	if (x->hash != y->hash) {
+		return (x->hash < y->hash ? -1 : 1);
+	}
+	return (x->fragment < y->fragment ? -1 : (x->fragment > y->fragment ? 1 : 0));
+}
+
+int map_sketch_build(struct map_sketch *s, const struct nick_map *map,
+		const struct sketch_params *params)
+{
+	struct sketch_buffer buf = { };
+	struct sketch_item *item;
+	size_t i, k;
+	int ret = 0;
+
+	assert(params->k > 0 && params->window > 0);
+
+	s->params = *params;
+	s->items.size = 0;
+	for (i = 0; i < map->fragments.size; ++i) {
+		if (fragment_minimizers(&map->fragments.data[i], params, &buf)
+				|| array_reserve(s->items, s->items.size + buf.minimizers.size)) {
+			ret = -ENOMEM;
+			break;
+		}
+		for (k = 0; k < buf.minimizers.size; ++k) {
+			item = &s->items.data[s->items.size++];
+			item->hash = buf.minimizers.data[k];
+			item->fragment = i;
+		}
+	}
+	sketch_buffer_free(&buf);
+
+	qsort(s->items.data, s->items.size, sizeof(struct sketch_item), compare_item);
+	return ret;
+}
+
+/* first item of hash not less than 'hash' */
+static size_t lower_bound(const struct map_sketch *s, uint64_t hash)
+{
+	size_t low = 0, high = s->items.size, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (s->items.data[mid].hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static int compare_fragment(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a;
+	size_t y = *(const size_t *)b;
+	return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/* fragments hit by minimizers of fragment a, counted by sorting */
+static int fragment_pairs(const struct map_sketch *b, size_t a, int self,
+		struct sketch_buffer *buf, sketch_pairs_t *pairs)
+{
+	struct sketch_pair *pair;
+	size_t i, k, first, last;
+
+	buf->fragments.size = 0;
+	for (i = 0; i < buf->minimizers.size; ++i) {
+		first = lower_bound(b, buf->minimizers.data[i]);
+		for (last = first; last < b->items.size
+				&& b->items.data[last].hash == buf->minimizers.data[i]; ++last) {
+		}
+		if (last - first > b->params.max_hits) continue;  /* as repeat */
+
+		if (array_reserve(buf->fragments, buf->fragments.size + (last - first))) {
+			return -ENOMEM;
+		}
+		for (k = first; k < last; ++k) {
+			if (!self || b->items.data[k].fragment > a) {
+				buf->fragments.data[buf->fragments.size++] = b->items.data[k].fragment;
+			}
+		}
+	}
+
+	qsort(buf->fragments.data, buf->fragments.size, sizeof(size_t), compare_fragment);
+	for (i = 0; i < buf->fragments.size; i = k) {
+		for (k = i + 1; k < buf->fragments.size
+				&& buf->fragments.data[k] == buf->fragments.data[i]; ++k) {
+		}
+		if (k - i < b->params.min_hits) continue;
+
+		if (pairs->size == pairs->capacity
+				&& array_reserve(*pairs, pairs->size + pairs->size / 2 + 1)) {
+			return -ENOMEM;
+		}
+		pair = &pairs->data[pairs->size++];
+		pair->a = a;
+		pair->b = buf->fragments.data[i];
+		pair->hits = k - i;
+	}
+	return 0;
+}
+
+int map_sketch_pairs(const struct map_sketch *b, const struct nick_map *map_a,
+		int self, sketch_pairs_t *pairs)
+{
+	struct sketch_buffer buf = { };
+	size_t a;
+	int ret = 0;
+
+	pairs->size = 0;
+	for (a = 0; a < map_a->fragments.size; ++a) {
+		if (fragment_minimizers(&map_a->fragments.data[a], &b->params, &buf)
+				|| fragment_pairs(b, a, self, &buf, pairs)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	sketch_buffer_free(&buf);
+	return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef __LABEL_SKETCH_H__
+#define __LABEL_SKETCH_H__
+
+#include <stdint.h>
+#include "nick_map.h"
+#include "array.h"
+
+struct sketch_params {
+	double tolerance;  /* of interval sizes, for width of quantized bins */
+	int k;             /* consecutive intervals in a tuple */
+	int window;        /* consecutive tuples, each with its minimizer */
+	int min_hits;      /* shared minimizers of a candidate pair */
+	int max_hits;      /* fragments of a minimizer, above which it is a repeat */
+};
+
+/* minimizer of a fragment, in sketch of a map */
+struct sketch_item {
+	uint64_t hash;
+	size_t fragment;
+};
+
+/* fragments of map 'a' and 'b', likely to be aligned */
+struct sketch_pair {
+	size_t a, b;
+	int hits;
+};
+
+typedef array(struct sketch_pair) sketch_pairs_t;
+
+/*
+ * Sketch of a map, as minimizers of tuples of quantized intervals in each
+ * fragment, sorted by hash and then by fragment.
+ */
+struct map_sketch {
+	struct sketch_params params;
+	array(struct sketch_item) items;
+};
+
+void map_sketch_init(struct map_sketch *s);
+void map_sketch_free(struct map_sketch *s);
+
+int map_sketch_build(struct map_sketch *s, const struct nick_map *map,
+		const struct sketch_params *params);
+
+/*
+ * Pairs of fragments sharing at least 'min_hits' minimizers, between 'map_a'
+ * and map of sketch 'b', ordered by 'a' and then by 'b'. When 'self' is set,
+ * as both are the same map, only pairs of a < b are found.
+ */
+int map_sketch_pairs(const struct map_sketch *b, const struct nick_map *map_a,
+		int self, sketch_pairs_t *pairs);
+
+#endif /* __LABEL_SKETCH_H__ */
@@ -19,12 +19,24 @@ void nick_map_free(struct nick_map *map)
 	array_free(map->fragments);
 }
 
-void nick_map_set_enzyme(struct nick_map *map, const char *enzyme, const char *rec_seq)
+/* recognition site of label channel, from 1, with channels before it kept */
+int nick_map_set_channel(struct nick_map *map, int channel,
+		const char *enzyme, const char *rec_seq)
 {
-	snprintf(map->enzyme, sizeof(map->enzyme), "%s", enzyme);
-	snprintf(map->rec_seq, sizeof(map->rec_seq), "%s", rec_seq);
-	assert(strcmp(map->enzyme, enzyme) == 0);
-	assert(strcmp(map->rec_seq, rec_seq) == 0);
+	struct label_channel *c;
+
+	if (channel < 1 || channel > MAX_CHANNELS) {
+		return -EINVAL;
+	}
+	c = &map->channels[channel - 1];
+	snprintf(c->enzyme, sizeof(c->enzyme), "%s", enzyme);
+	snprintf(c->rec_seq, sizeof(c->rec_seq), "%s", rec_seq);
+	assert(strcmp(c->enzyme, enzyme) == 0);
+	assert(strcmp(c->rec_seq, rec_seq) == 0);
+	if (map->channel_count < channel) {
+		map->channel_count = channel;
+	}
+	return 0;
 }
 
 struct fragment *nick_map_add_fragment(struct nick_map *map, const char *name)
@@ -47,15 +59,18 @@ struct fragment *nick_map_add_fragment(struct nick_map *map, const char *name)
 	return f;
 }
 
-int nick_map_add_site(struct fragment *f, int pos, unsigned int flag)
+/* nicks are ordered by position and then by channel, with flags merged for the same one */
+int nick_map_add_site(struct fragment *f, int pos, unsigned int flag, int channel)
 {
+	const struct nick *n;
 	size_t i, j;
 
 	for (i = f->nicks.size; i > 0; --i) {
-		if (f->nicks.data[i - 1].pos == pos) {
+		n = &f->nicks.data[i - 1];
+		if (n->pos == pos && n->channel == channel) {
 			f->nicks.data[i - 1].flag |= flag;
 			return 0;
-		} else if (f->nicks.data[i - 1].pos < pos) {
+		} else if (n->pos < pos || (n->pos == pos && n->channel < channel)) {
 			break;
 		}
 	}
@@ -67,6 +82,7 @@ int nick_map_add_site(struct fragment *f, int pos, unsigned int flag)
 	}
 	f->nicks.data[i].pos = pos;
 	f->nicks.data[i].flag = flag;
+	f->nicks.data[i].channel = channel;
 	++f->nicks.size;
 	return 0;
 }
@@ -9,6 +9,7 @@
 #define MAX_REC_SEQ_SIZE 127
 #define MAX_CHROM_NAME_SIZE 63
 #define MAX_FRAGMENT_NAME_SIZE 63
+#define MAX_CHANNELS 4  /* of labels, each by a recognition site */
 
 enum nick_flag {
 	NICK_PLUS_STRAND  = 1,  /* nick on plus strand */
@@ -18,6 +19,7 @@ enum nick_flag {
 struct nick {
 	int pos;
 	unsigned int flag;
+	int channel;  /* of label, from 1 */
 };
 
 struct fragment {  /* molecule, contig or chromosome */
@@ -26,18 +28,24 @@ struct fragment {  /* molecule, contig or chromosome */
 	array(struct nick) nicks;  /* label positions */
 };
 
+struct label_channel {  /* of labels by one recognition site */
+	char enzyme[MAX_ENZYME_NAME_SIZE + 1];
+	char rec_seq[MAX_REC_SEQ_SIZE + 1];
+};
+
 struct nick_map {
 	array(struct fragment) fragments;
 
-	char enzyme[MAX_ENZYME_NAME_SIZE + 1];
-	char rec_seq[MAX_REC_SEQ_SIZE + 1];
+	struct label_channel channels[MAX_CHANNELS];  /* channel c as channels[c - 1] */
+	int channel_count;
 };
 
 void nick_map_init(struct nick_map *map);
 void nick_map_free(struct nick_map *map);
-void nick_map_set_enzyme(struct nick_map *map, const char *enzyme, const char *rec_seq);
+int nick_map_set_channel(struct nick_map *map, int channel,
+		const char *enzyme, const char *rec_seq);
 
 struct fragment *nick_map_add_fragment(struct nick_map *map, const char *name);
-int nick_map_add_site(struct fragment *f, int pos, unsigned int flag);
+int nick_map_add_site(struct fragment *f, int pos, unsigned int flag, int channel);
 
 #endif /* __NICK_MAP_H__ */
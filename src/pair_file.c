@@ -0,0 +1,497 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "pair_file.h"
+
+/*
+ * Binary file: BGZF compressed, with magic "\211BNP", u32 version;
+ * and then records, each as
+ *   u32 length of the rest, varint coded length and name of 'a' and 'b',
+ *   varint count of label pairs, and if any, varint labels of the first
+ *   pair (the end of alignment), then steps to the others in runs, each as
+ *   varint run length and a step byte of delta_a << 4 | delta_b, or 0
+ *   followed by varint delta_a and delta_b when any delta is above 15.
+ * Ids of records are their ordinals. All integers are little-endian.
+ */
+
+#define PAIR_MAGIC "\211BNP"
+#define PAIR_VERSION 1
+#define PAIR_BLOCK_SIZE 0x100000  /* of buffered records, written at once */
+
+int parse_pair_format(const char *s)
+{
+	if (strcmp(s, "txt") == 0) {
+		return PAIR_FORMAT_TXT;
+	} else if (strcmp(s, "bin") == 0) {
+		return PAIR_FORMAT_BIN;
+	} else {
+		return PAIR_FORMAT_UNKNOWN;
+	}
+}
+
+void pair_record_init(struct pair_record *r)
+{
+	memset(r, 0, sizeof(struct pair_record));
+}
+
+void pair_record_free(struct pair_record *r)
+{
+	array_free(r->labels_b);
+	array_free(r->labels_a);
+}
+
+static struct pair_file *pair_file_new(const char *filename, int format, int writing)
+{
+	struct pair_file *fp;
+
+	fp = malloc(sizeof(struct pair_file));
+	if (!fp) {
+		return NULL;
+	}
+	memset(fp, 0, sizeof(struct pair_file));
+	fp->name = filename;
+	fp->format = format;
+	fp->writing = writing;
+	pthread_mutex_init(&fp->lock, NULL);
+	array_init(fp->buf);
+	return fp;
+}
+
+static void pair_file_delete(struct pair_file *fp)
+{
+	if (fp->text) {
+		gzclose(fp->text);
+	}
+	array_free(fp->buf);
+	pthread_mutex_destroy(&fp->lock);
+	free(fp);
+}
+
+/* buffer of encoded bytes */
+
+static inline int put_bytes(struct pair_file *fp, const void *data, size_t size)
+{
+	if (array_reserve(fp->buf, fp->buf.size + size)) {
+		return -ENOMEM;
+	}
+	memcpy(fp->buf.data + fp->buf.size, data, size);
+	fp->buf.size += size;
+	return 0;
+}
+
+static inline void set_u32(unsigned char *p, uint32_t value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
+static inline int put_u32(struct pair_file *fp, uint32_t value)
+{
+	unsigned char p[4];
+	set_u32(p, value);
+	return put_bytes(fp, p, sizeof(p));
+}
+
+static inline int put_varint(struct pair_file *fp, uint64_t value)
+{
+	unsigned char p[10];
+	size_t n = 0;
+	while (value >= 0x80) {
+		p[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[n++] = value;
+	return put_bytes(fp, p, n);
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	while (*p < end && shift < 64) {
+		unsigned char c = *(*p)++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*value = v;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* text format */
+
+static inline int put_text(struct pair_file *fp, const char *s)
+{
+	return put_bytes(fp, s, strlen(s));
+}
+
+/* decimal digits, without printf() for each of many labels */
+static inline int put_number(struct pair_file *fp, uint64_t value, char sep)
+{
+	char p[24];
+	size_t n = sizeof(p);
+
+	p[--n] = sep;
+	do {
+		p[--n] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	return put_bytes(fp, p + n, sizeof(p) - n);
+}
+
+static int write_text_header(struct pair_file *fp)
+{
+	return put_text(fp, "#>0\tAlignmentID\tMol0ID\tMol1ID\n");
+}
+
+static int write_text(struct pair_file *fp, const char *name_a, const char *name_b,
+		const size_t *labels_a, const size_t *labels_b, size_t count)
+{
+	size_t k;
+
+	if (put_text(fp, ">0\t") || put_number(fp, fp->count + 1, '\t')
+			|| put_text(fp, name_a) || put_text(fp, "\t")
+			|| put_text(fp, name_b) || put_text(fp, "\n")) {
+		return -ENOMEM;
+	}
+	for (k = 0; k < count; ++k) {
+		if (put_number(fp, labels_a[k], (k + 1 < count ? '\t' : '\n'))) {
+			return -ENOMEM;
+		}
+	}
+	if (count == 0 && put_text(fp, "\n")) {
+		return -ENOMEM;
+	}
+	for (k = 0; k < count; ++k) {
+		if (put_number(fp, labels_b[k], (k + 1 < count ? '\t' : '\n'))) {
+			return -ENOMEM;
+		}
+	}
+	if (count == 0 && put_text(fp, "\n")) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* binary format */
+
+static int write_bin_header(struct pair_file *fp)
+{
+	return put_bytes(fp, PAIR_MAGIC, 4) || put_u32(fp, PAIR_VERSION);
+}
+
+static int put_step(struct pair_file *fp, size_t delta_a, size_t delta_b, uint64_t run)
+{
+	unsigned char step = (delta_a << 4) | delta_b;
+
+	if (put_varint(fp, run)) {
+		return -ENOMEM;
+	}
+	if (delta_a > 15 || delta_b > 15) {
+		step = 0;
+		return put_bytes(fp, &step, 1) || put_varint(fp, delta_a) || put_varint(fp, delta_b);
+	}
+	return put_bytes(fp, &step, 1);
+}
+
+static int write_bin(struct pair_file *fp, const char *name_a, const char *name_b,
+		const size_t *labels_a, const size_t *labels_b, size_t count)
+{
+	size_t start = fp->buf.size, len_a = strlen(name_a), len_b = strlen(name_b);
+	size_t k, delta_a = 0, delta_b = 0;
+	uint64_t run = 0;
+
+	if (put_u32(fp, 0)  /* length, filled later */
+			|| put_varint(fp, len_a) || put_bytes(fp, name_a, len_a)
+			|| put_varint(fp, len_b) || put_bytes(fp, name_b, len_b)
+			|| put_varint(fp, count)) {
+		return -ENOMEM;
+	}
+	if (count > 0 && (put_varint(fp, labels_a[0]) || put_varint(fp, labels_b[0]))) {
+		return -ENOMEM;
+	}
+	for (k = 1; k < count; ++k) {
+		if (labels_a[k] >= labels_a[k - 1] || labels_b[k] >= labels_b[k - 1]) {
+			fprintf(stderr, "Error: Labels of alignment are not decreasing!\n");
+			return -EINVAL;
+		}
+		if (run > 0 && (labels_a[k - 1] - labels_a[k] != delta_a
+					|| labels_b[k - 1] - labels_b[k] != delta_b)) {
+			if (put_step(fp, delta_a, delta_b, run)) {
+				return -ENOMEM;
+			}
+			run = 0;
+		}
+		delta_a = labels_a[k - 1] - labels_a[k];
+		delta_b = labels_b[k - 1] - labels_b[k];
+		++run;
+	}
+	if (run > 0 && put_step(fp, delta_a, delta_b, run)) {
+		return -ENOMEM;
+	}
+	set_u32((unsigned char *)fp->buf.data + start, fp->buf.size - start - 4);
+	return 0;
+}
+
+/* 0 if all read, 1 if none at the end of file, or -EIO if read in part */
+static int read_bytes(struct pair_file *fp, void *buf, size_t size)
+{
+	ssize_t n = bgzf_read(fp->bin, buf, size);
+
+	if (n == (ssize_t)size) {
+		return 0;
+	} else if (n == 0) {
+		return 1;
+	} else {
+		fprintf(stderr, "Error: Failed to read file '%s', or it is truncated\n", fp->name);
+		return -EIO;
+	}
+}
+
+static int read_bin_header(struct pair_file *fp)
+{
+	unsigned char p[8];
+	int ret;
+
+	if ((ret = read_bytes(fp, p, 8)) < 0) {
+		return ret;
+	}
+	if (ret > 0 || memcmp(p, PAIR_MAGIC, 4) != 0) {
+		fprintf(stderr, "Error: Invalid binary align file '%s'\n", fp->name);
+		return -EINVAL;
+	}
+	if (get_u32(p + 4) != PAIR_VERSION) {
+		fprintf(stderr, "Error: Unsupported version %u of file '%s'\n", get_u32(p + 4), fp->name);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int get_name(const unsigned char **p, const unsigned char *end, char *name, size_t size)
+{
+	uint64_t len;
+
+	if (get_varint(p, end, &len) || len >= size || len > (uint64_t)(end - *p)) {
+		return -1;
+	}
+	memcpy(name, *p, len);
+	name[len] = '\0';
+	*p += len;
+	return 0;
+}
+
+static int read_bin(struct pair_file *fp, struct pair_record *r)
+{
+	const unsigned char *p, *end;
+	unsigned char head[4];
+	uint64_t count, a, b, run, delta_a, delta_b;
+	uint32_t len;
+	size_t k;
+	int ret;
+
+	if ((ret = read_bytes(fp, head, sizeof(head))) != 0) {
+		return (ret > 0 ? -1 : ret);  /* -1 only at the end of file */
+	}
+	len = get_u32(head);
+	fp->buf.size = 0;
+	if (array_reserve(fp->buf, len)) {
+		return -ENOMEM;
+	}
+	if ((ret = read_bytes(fp, fp->buf.data, len)) != 0) {
+		if (ret > 0) {
+			fprintf(stderr, "Error: Truncated record in file '%s'\n", fp->name);
+		}
+		return (ret > 0 ? -EIO : ret);
+	}
+	p = (const unsigned char *)fp->buf.data;
+	end = p + len;
+
+	if (get_name(&p, end, r->name_a, sizeof(r->name_a))
+			|| get_name(&p, end, r->name_b, sizeof(r->name_b))
+			|| get_varint(&p, end, &count)) {
+		goto invalid;
+	}
+	if (count > 0) {
+		/* labels decreasing from the first pair, down to 0 at most */
+		if (get_varint(&p, end, &a) || get_varint(&p, end, &b)
+				|| count - 1 > a || count - 1 > b) goto invalid;
+	}
+	r->labels_a.size = 0;
+	r->labels_b.size = 0;
+	if (array_reserve(r->labels_a, count) || array_reserve(r->labels_b, count)) {
+		return -ENOMEM;
+	}
+	if (count > 0) {
+		r->labels_a.data[0] = a;
+		r->labels_b.data[0] = b;
+	}
+	for (k = 1; k < count; ) {
+		if (get_varint(&p, end, &run) || p >= end || run == 0 || run > count - k) goto invalid;
+		delta_a = *p >> 4;
+		delta_b = *p++ & 0xf;
+		if (delta_a == 0 && delta_b == 0
+				&& (get_varint(&p, end, &delta_a) || get_varint(&p, end, &delta_b))) {
+			goto invalid;
+		}
+		for (; run > 0; --run, ++k) {
+			if (delta_a == 0 || delta_b == 0 || r->labels_a.data[k - 1] < delta_a
+					|| r->labels_b.data[k - 1] < delta_b) goto invalid;
+			r->labels_a.data[k] = r->labels_a.data[k - 1] - delta_a;
+			r->labels_b.data[k] = r->labels_b.data[k - 1] - delta_b;
+		}
+	}
+	if (p != end) goto invalid;
+	r->labels_a.size = count;
+	r->labels_b.size = count;
+	r->id = ++fp->count;
+	return 0;
+
+invalid:
+	fprintf(stderr, "Error: Invalid record in file '%s'\n", fp->name);
+	return -EINVAL;
+}
+
+/* file */
+
+static int flush_buffer(struct pair_file *fp)
+{
+	int ret = 0;
+
+	if (fp->buf.size == 0) {
+		return 0;
+	}
+	if (fp->bin) {
+		ret = bgzf_write(fp->bin, fp->buf.data, fp->buf.size);
+	} else if (gzwrite(fp->text, fp->buf.data, fp->buf.size) != (int)fp->buf.size) {
+		fprintf(stderr, "Error: Failed to write file '%s'\n", fp->name);
+		ret = -EIO;
+	}
+	fp->buf.size = 0;
+	return ret;
+}
+
+struct pair_file *pair_open_write(const char *filename, int format)
+{
+	struct pair_file *fp;
+	int ret;
+
+	assert(format == PAIR_FORMAT_TXT || format == PAIR_FORMAT_BIN);
+
+	fp = pair_file_new(filename, format, 1);
+	if (!fp) {
+		return NULL;
+	}
+	if (format == PAIR_FORMAT_TXT) {
+		fp->text = open_gzfile_write(filename);
+		if (!fp->text) {
+			pair_file_delete(fp);
+			return NULL;
+		}
+		ret = write_text_header(fp);
+	} else {
+		fp->bin = bgzf_open(filename, "w");
+		if (!fp->bin) {
+			pair_file_delete(fp);
+			return NULL;
+		}
+		ret = write_bin_header(fp);
+	}
+	if (ret) {
+		pair_close(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+struct pair_file *pair_open_read(const char *filename)
+{
+	struct pair_file *fp;
+
+	fp = pair_file_new(filename, PAIR_FORMAT_BIN, 0);
+	if (!fp) {
+		return NULL;
+	}
+	fp->bin = bgzf_open(filename, "r");
+	if (!fp->bin) {
+		pair_file_delete(fp);
+		return NULL;
+	}
+	if (read_bin_header(fp)) {
+		pair_close(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+int pair_flush(struct pair_file *fp)
+{
+	int ret;
+
+	pthread_mutex_lock(&fp->lock);
+	ret = flush_buffer(fp);
+	if (ret == 0 && fp->text && gzflush(fp->text, Z_SYNC_FLUSH) != Z_OK) {
+		ret = -EIO;
+	}
+	pthread_mutex_unlock(&fp->lock);
+	return ret;
+}
+
+int pair_close(struct pair_file *fp)
+{
+	int ret = 0;
+
+	if (!fp) {
+		return 0;
+	}
+	if (fp->writing) {
+		ret = flush_buffer(fp);
+	}
+	if (fp->bin && bgzf_close(fp->bin)) {
+		ret = -EIO;
+	}
+	pair_file_delete(fp);
+	return ret;
+}
+
+int pair_write(struct pair_file *fp, const char *name_a, const char *name_b,
+		const size_t *labels_a, const size_t *labels_b, size_t count)
+{
+	size_t start;
+	int ret;
+
+	assert(fp->writing);
+
+	pthread_mutex_lock(&fp->lock);
+	start = fp->buf.size;
+	if (fp->format == PAIR_FORMAT_TXT) {
+		ret = write_text(fp, name_a, name_b, labels_a, labels_b, count);
+	} else {
+		ret = write_bin(fp, name_a, name_b, labels_a, labels_b, count);
+	}
+	if (ret == 0) {
+		++fp->count;
+		if (fp->buf.size >= PAIR_BLOCK_SIZE) {
+			ret = flush_buffer(fp);
+		}
+	} else {
+		fp->buf.size = start;  /* record dropped */
+	}
+	pthread_mutex_unlock(&fp->lock);
+	return ret;
+}
+
+int pair_read(struct pair_file *fp, struct pair_record *r)
+{
+	assert(!fp->writing);
+	return read_bin(fp, r);
+}
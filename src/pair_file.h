@@ -0,0 +1,62 @@
+#ifndef __PAIR_FILE_H__
+#define __PAIR_FILE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "nick_map.h"
+#include "io_base.h"
+#include "bgzf.h"
+
+enum pair_format {  /* of align results */
+	PAIR_FORMAT_UNKNOWN = 0,
+	PAIR_FORMAT_TXT,  /* a header line, and labels of 'a' and 'b' in two lines */
+	PAIR_FORMAT_BIN,  /* binary records, with steps between label pairs run-length encoded */
+};
+
+/* alignment between two fragments, as label pairs from its end */
+struct pair_record {
+	uint64_t id;  /* ordinal of record, from 1 */
+	char name_a[MAX_FRAGMENT_NAME_SIZE + 1];
+	char name_b[MAX_FRAGMENT_NAME_SIZE + 1];
+	array(size_t) labels_a;
+	array(size_t) labels_b;
+};
+
+struct pair_file {
+	const char *name;
+	int format;
+	int writing;
+
+	gzFile text;       /* writing text */
+	struct bgzf *bin;  /* reading/writing binary */
+	uint64_t count;    /* of records written or read, as id of the last one */
+
+	pthread_mutex_t lock;  /* of writing, with id taken by each record */
+	array(char) buf;       /* of encoded records, written by blocks */
+};
+
+int parse_pair_format(const char *s);
+
+void pair_record_init(struct pair_record *r);
+void pair_record_free(struct pair_record *r);
+
+struct pair_file *pair_open_write(const char *filename, int format);
+struct pair_file *pair_open_read(const char *filename);
+int pair_flush(struct pair_file *fp);
+int pair_close(struct pair_file *fp);
+
+/*
+ * Record of 'count' label pairs, in order from the end of alignment, with
+ * labels decreasing. Records are written in the order of calls, from any
+ * thread, with id taken in the same order.
+ */
+int pair_write(struct pair_file *fp, const char *name_a, const char *name_b,
+		const size_t *labels_a, const size_t *labels_b, size_t count);
+
+/*
+ * The next record of binary input, or -1 at the end of file, and -EINVAL or
+ * -EIO for an invalid or truncated one.
+ */
+int pair_read(struct pair_file *fp, struct pair_record *r);
+
+#endif /* __PAIR_FILE_H__ */
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include "ref_band.h"
+
+struct band_seed {
+	size_t chrom;
+	long diagonal;
+};
+
+typedef array(struct band_seed) band_seeds_t;
+
+/*
+ * Forward intervals in index of reference, with sizes of 'seed_size'
+ * intervals in a row kept along, for seeds to be matched without nodes
+ * looked up. Intervals are put in bins by log of size, about as wide as
+ * the tolerance, and sorted by the next size in each bin, so that only a
+ * few runs of intervals, with both sizes nearly similar, are scanned.
+ */
+struct band_index {
+	int stride;
+	double scale;
+	array(int) sizes;
+	array(size_t) nodes;
+	array(size_t) bins;  /* first interval of each bin, and the end */
+	array(int) low;      /* bounds of sizes similar to intervals of a seed */
+	array(int) high;
+};
+
+struct band_item {  /* of an interval, while sorting */
+	size_t bin;
+	int key;   /* the next size, or its size for seeds of one interval */
+	size_t k;  /* as added */
+};
+
+static void band_index_free(struct band_index *x)
+{
+	array_free(x->high);
+	array_free(x->low);
+	array_free(x->bins);
+	array_free(x->nodes);
+	array_free(x->sizes);
+}
+
+static inline size_t size_bin(const struct band_index *x, int size)
+{
+	return (size > 1 ? (size_t)(log(size) / log(x->scale)) : 0);
+}
+
+static int compare_item(const void *a, const void *b)
+{
+	const struct band_item *x = a;
+	const struct band_item *y = b;
+	if (x->bin != y->bin) {
+		return (x->bin < y->bin ? -1 : 1);
+	}
+	return (x->key < y->key ? -1 : (x->key > y->key ? 1 : 0));
+}
+
+/* of intervals added in order of k, sorted as items and put in bins */
+static int sort_intervals(struct band_index *x)
+{
+	array(struct band_item) items = { };
+	array(int) sizes = { };
+	array(size_t) nodes = { };
+	size_t n = x->nodes.size, k, b;
+	int column = (x->stride > 1 ? 1 : 0);
+
+	if (array_reserve(items, n) || array_reserve(sizes, n * x->stride)
+			|| array_reserve(nodes, n)) {
+		array_free(nodes);
+		array_free(sizes);
+		array_free(items);
+		return -ENOMEM;
+	}
+	for (k = 0; k < n; ++k) {
+		items.data[k].bin = size_bin(x, x->sizes.data[k * x->stride]);
+		items.data[k].key = x->sizes.data[k * x->stride + column];
+		items.data[k].k = k;
+	}
+	qsort(items.data, n, sizeof(struct band_item), compare_item);
+
+	for (k = 0; k < n; ++k) {
+		memcpy(sizes.data + k * x->stride, x->sizes.data + items.data[k].k * x->stride,
+				sizeof(int) * x->stride);
+		nodes.data[k] = x->nodes.data[items.data[k].k];
+	}
+	memcpy(x->sizes.data, sizes.data, sizeof(int) * n * x->stride);
+	memcpy(x->nodes.data, nodes.data, sizeof(size_t) * n);
+
+	b = (n > 0 ? items.data[n - 1].bin + 1 : 0);
+	if (array_reserve(x->bins, b + 1) == 0) {
+		for (k = 0, x->bins.size = 0; x->bins.size <= b; ++x->bins.size) {
+			while (k < n && items.data[k].bin < x->bins.size) {
+				++k;
+			}
+			x->bins.data[x->bins.size] = k;
+		}
+	}
+	array_free(nodes);
+	array_free(sizes);
+	array_free(items);
+	return (x->bins.size == b + 1 ? 0 : -ENOMEM);
+}
+
+/* intervals with less than 'stride' ones in a row to the end of chrom are skipped */
+static int band_index_build(struct band_index *x, const struct ref_map *ref,
+		int stride, double scale)
+{
+	const struct ref_index *r;
+	const struct ref_node *n;
+	size_t i, k;
+	int t;
+
+	x->stride = stride;
+	x->scale = scale;
+	if (array_reserve(x->sizes, ref->index_.size * stride)
+			|| array_reserve(x->nodes, ref->index_.size)
+			|| array_reserve(x->low, stride)
+			|| array_reserve(x->high, stride)) {
+		return -ENOMEM;
+	}
+	for (i = 0, k = 0; i < ref->index_.size; ++i) {
+		r = &ref->index_.data[i];
+		if (r->direct < 0 || r->span > 1) continue;
+		n = ref_index_node(ref, r);
+		for (t = 0; t < stride && (n[t].flag & LAST_INTERVAL) == 0; ++t) {
+			x->sizes.data[k * stride + t] = n[t].size;
+		}
+		if (t == stride) {
+			x->nodes.data[k++] = r->node;
+		}
+	}
+	x->sizes.size = k * stride;
+	x->nodes.size = k;
+	return sort_intervals(x);
+}
+
+/* first interval in [low, high) of a bin, whose key is not less than 'size' */
+static size_t lower_bound(const struct band_index *x, size_t low, size_t high, int size)
+{
+	int column = (x->stride > 1 ? 1 : 0);
+	size_t mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (x->sizes.data[mid * x->stride + column] < size) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * As in DP of alignment, intervals are similar if each is less than the
+ * other scaled by (1 + tolerance), where sizes similar to 'size' are from
+ * low + 1 to high.
+ */
+static inline void similar_bounds(int size, double scale, int *low, int *high)
+{
+	*low = (int)(size / scale);
+	*high = (int)ceil(size * scale) - 1;
+}
+
+static inline int add_seed(const struct ref_map *ref, const struct band_index *x,
+		size_t i, size_t k, band_seeds_t *seeds)
+{
+	const struct ref_node *n = &ref->nodes.data[x->nodes.data[i]];
+
+	if (seeds->size == seeds->capacity
+			&& array_reserve(*seeds, seeds->size + seeds->size / 2 + 1)) {
+		return -ENOMEM;
+	}
+	seeds->data[seeds->size].chrom = n->chrom;
+	seeds->data[seeds->size].diagonal = (long)n->label - (long)k;
+	++seeds->size;
+	return 0;
+}
+
+/*
+ * Seeds of fragment f, as its intervals from label k on matched with
+ * forward intervals of a chrom, for 'seed_size' ones in a row.
+ */
+static int fragment_seeds(const struct ref_map *ref, struct band_index *x,
+		const struct fragment *f, band_seeds_t *seeds)
+{
+	const struct nick *p = f->nicks.data;
+	const int *z, *low = x->low.data, *high = x->high.data;
+	int column = (x->stride > 1 ? 1 : 0);
+	size_t k, b, last, i, end;
+	int t;
+
+	seeds->size = 0;
+	for (k = 1; k + x->stride <= f->nicks.size; ++k) {
+		for (t = 0; t < x->stride; ++t) {
+			similar_bounds(p[k + t].pos - p[k + t - 1].pos, x->scale,
+					&x->low.data[t], &x->high.data[t]);
+		}
+		last = size_bin(x, high[0]);
+		for (b = size_bin(x, low[0] + 1); b <= last && b + 1 < x->bins.size; ++b) {
+			end = x->bins.data[b + 1];
+			i = lower_bound(x, x->bins.data[b], end, low[column] + 1);
+			for (; i < end; ++i) {
+				z = x->sizes.data + i * x->stride;
+				if (z[column] > high[column]) break;
+				for (t = 0; t < x->stride && z[t] > low[t] && z[t] <= high[t]; ++t) {
+				}
+				if (t == x->stride && add_seed(ref, x, i, k, seeds)) {
+					return -ENOMEM;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int compare_seed(const void *a, const void *b)
+{
+	const struct band_seed *x = a;
+	const struct band_seed *y = b;
+	if (x->chrom != y->chrom) {
+		return (x->chrom < y->chrom ? -1 : 1);
+	}
+	return (x->diagonal < y->diagonal ? -1 : (x->diagonal > y->diagonal ? 1 : 0));
+}
+
+/*
+ * Seeds sorted by diagonal, and clustered as gaps between them are no more
+ * than twice of margin, so that bands of clusters never overlap.
+ */
+static int cluster_seeds(size_t fragment, band_seeds_t *seeds,
+		const struct band_params *params, ref_bands_t *bands)
+{
+	struct ref_band *band;
+	size_t i, k;
+
+	qsort(seeds->data, seeds->size, sizeof(struct band_seed), compare_seed);
+	for (i = 0; i < seeds->size; i = k) {
+		for (k = i + 1; k < seeds->size && seeds->data[k].chrom == seeds->data[i].chrom
+				&& seeds->data[k].diagonal - seeds->data[k - 1].diagonal <= params->margin * 2; ++k) {
+		}
+		if (k - i < params->min_seeds) continue;
+
+		if (bands->size == bands->capacity
+				&& array_reserve(*bands, bands->size + bands->size / 2 + 1)) {
+			return -ENOMEM;
+		}
+		band = &bands->data[bands->size++];
+		band->fragment = fragment;
+		band->chrom = seeds->data[i].chrom;
+		band->low = seeds->data[i].diagonal - params->margin;
+		band->high = seeds->data[k - 1].diagonal + params->margin;
+		band->seeds = k - i;
+	}
+	return 0;
+}
+
+int ref_map_bands(const struct ref_map *ref, const struct nick_map *map,
+		const struct band_params *params, ref_bands_t *bands)
+{
+	struct band_index x = { };
+	band_seeds_t seeds = { };
+	size_t i;
+	int ret = 0;
+
+	assert(params->seed_size > 0 && params->margin >= 0);
+
+	bands->size = 0;
+	if (band_index_build(&x, ref, params->seed_size, 1 + params->tolerance)) {
+		band_index_free(&x);
+		return -ENOMEM;
+	}
+	for (i = 0; i < map->fragments.size; ++i) {
+		if (fragment_seeds(ref, &x, &map->fragments.data[i], &seeds)
+				|| cluster_seeds(i, &seeds, params, bands)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	array_free(seeds);
+	band_index_free(&x);
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef __REF_BAND_H__
+#define __REF_BAND_H__
+
+#include "nick_map.h"
+#include "ref_map.h"
+#include "array.h"
+
+struct band_params {
+	double tolerance;  /* to compare interval sizes */
+	int seed_size;     /* consecutive intervals matched by a seed */
+	int min_seeds;     /* of a band */
+	int margin;        /* diagonals around seeds of a band */
+};
+
+/*
+ * Diagonals, as label of chrom minus label of query fragment, where the
+ * fragment is likely aligned onto the chrom, from its seeds clustered.
+ */
+struct ref_band {
+	size_t fragment;
+	size_t chrom;
+	long low, high;
+	int seeds;
+};
+
+typedef array(struct ref_band) ref_bands_t;
+
+/*
+ * Bands of fragments of 'map' onto chroms of 'ref', ordered by fragment,
+ * chrom and then diagonals. Seeds are looked up in the index of 'ref', as
+ * forward intervals of chroms matched with all intervals of a fragment.
+ */
+int ref_map_bands(const struct ref_map *ref, const struct nick_map *map,
+		const struct band_params *params, ref_bands_t *bands);
+
+#endif /* __REF_BAND_H__ */
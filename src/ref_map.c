@@ -2,8 +2,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <zlib.h>
 #include "version.h"
@@ -19,11 +23,35 @@ void ref_map_init(struct ref_map *ref)
 
 void ref_map_free(struct ref_map *ref)
 {
+	if (ref->shared) {  /* nodes and index are not owned, if attached */
+		munmap(ref->shared, ref->shared_size);
+		ref->shared = NULL;
+		array_init(ref->nodes);
+		array_init(ref->index_);
+	}
 	array_free(ref->index_);
 	array_free(ref->nodes);
 	nick_map_free(&ref->map);
 }
 
+/* base c of sequence matches base q of site, as (c & q) == c for ambiguous ones */
+static void prepare_masks(struct rec_site *site)
+{
+	int i, c, q, strand;
+
+	for (strand = 0; strand < 2; ++strand) {
+		for (i = 0; i < site->rec_seq_size; ++i) {
+			q = (strand == 0 ? site->rec_bases[i]
+					: base_to_comp(site->rec_bases[site->rec_seq_size - i - 1]));
+			for (c = 1; c < 16; ++c) {
+				if ((c & q) == c) {
+					site->masks[strand][c][i / 64] |= (uint64_t)1 << (i % 64);
+				}
+			}
+		}
+	}
+}
+
 int prepare_rec_site(struct rec_site *site, const char *enzyme, const char *rec_seq)
 {
 	int i;
@@ -70,26 +98,67 @@ int prepare_rec_site(struct rec_site *site, const char *enzyme, const char *rec_
 			break;
 		}
 	}
+	prepare_masks(site);
 	return 0;
 }
 
-static int seq_match(const char *ref, const char *query, size_t len, int strand)
+#define SCAN_WORDS (REC_SEQ_WORDS * 2 * MAX_CHANNELS)
+
+/*
+ * Shift-And scan of all sites on both strands at once, as patterns placed
+ * at successive bits, with bit i set if bases of its pattern up to the one
+ * at bit i match the last bases.
+ */
+struct site_scanner {
+	int words;
+	uint64_t masks[16][SCAN_WORDS];
+	uint64_t starts[SCAN_WORDS];  /* first bit of each pattern */
+	uint64_t ends[SCAN_WORDS];    /* last bit of each pattern */
+	uint64_t bits[SCAN_WORDS];
+	int count;  /* of patterns, as strand of each site */
+	int last[2 * MAX_CHANNELS];  /* bit of pattern end */
+};
+
+static inline void set_bit(uint64_t *bits, int i) { bits[i / 64] |= (uint64_t)1 << (i % 64); }
+static inline int test_bit(const uint64_t *bits, int i) { return (bits[i / 64] >> (i % 64)) & 1; }
+
+static void prepare_scanner(struct site_scanner *s, const struct rec_site *sites, int count)
 {
-	size_t i;
-	for (i = 0; i < len; ++i) {
-		char r = ref[i];
-		char q = (strand == 0 ? query[i] : base_to_comp(query[len - i - 1]));
-		if ((r & q) != r) {
-			return 0;
+	int k, strand, i, c, offset = 0;
+
+	memset(s, 0, sizeof(struct site_scanner));
+	for (k = 0; k < count; ++k) {
+		for (strand = 0; strand < 2; ++strand) {
+			for (i = 0; i < sites[k].rec_seq_size; ++i) {
+				for (c = 1; c < 16; ++c) {
+					if (test_bit(sites[k].masks[strand][c], i)) {
+						set_bit(s->masks[c], offset + i);
+					}
+				}
+			}
+			set_bit(s->starts, offset);
+			offset += sites[k].rec_seq_size;
+			set_bit(s->ends, offset - 1);
+			s->last[s->count++] = offset - 1;
 		}
 	}
-	return 1;
+	s->words = (offset + 63) / 64;
+	assert(s->words <= SCAN_WORDS);
 }
 
-struct buffer {
-	char data[MAX_REC_SEQ_SIZE * 2];
-	size_t pos;
-};
+/* if any pattern matched, ending at base c */
+static inline int scan_base(struct site_scanner *s, int c)
+{
+	uint64_t matched;
+	int w;
+
+	for (w = s->words - 1, matched = 0; w > 0; --w) {
+		s->bits[w] = ((s->bits[w] << 1) | (s->bits[w - 1] >> 63) | s->starts[w]) & s->masks[c][w];
+		matched |= s->bits[w] & s->ends[w];
+	}
+	s->bits[0] = ((s->bits[0] << 1) | s->starts[0]) & s->masks[c][0];
+	return (matched | (s->bits[0] & s->ends[0])) != 0;
+}
 
 static int is_chrom(const char *name)
 {
@@ -108,23 +177,28 @@ static int is_chrom(const char *name)
 	}
 }
 
+/*
+ * Sites of all 'count' recognition sites, scanned in one pass of sequences,
+ * with labels of the k-th site in channel k + 1.
+ */
 int nick_map_load_seq(struct ref_map *ref, const char *filename,
-		const struct rec_site *site, int chrom_only, int verbose)
+		const struct rec_site *sites, int count, int chrom_only, int verbose)
 {
 	struct file *fp;
 	struct fragment *f = NULL;
 	char name[MAX_CHROM_NAME_SIZE] = "";
-	struct buffer buf = { };
-	int c, ret = 0, base_count = 0;
+	struct site_scanner scanner;
+	const struct rec_site *site;
+	int c, k, ret = 0, base_count = 0;
 	int format = 0; /* 1 - FASTA, 2 - FASTQ */
 
-	if (!ref->map.enzyme[0]) {
-		assert(sizeof(ref->map.enzyme) == MAX_ENZYME_NAME_SIZE + 1);
-		assert(sizeof(ref->map.rec_seq) == MAX_REC_SEQ_SIZE + 1);
-		assert(sizeof(site->enzyme) == MAX_ENZYME_NAME_SIZE + 1);
-		assert(sizeof(site->rec_seq) == MAX_REC_SEQ_SIZE + 1);
-		memcpy(ref->map.enzyme, site->enzyme, sizeof(ref->map.enzyme));
-		memcpy(ref->map.rec_seq, site->rec_seq, sizeof(ref->map.rec_seq));
+	assert(count > 0 && count <= MAX_CHANNELS);
+	prepare_scanner(&scanner, sites, count);
+
+	if (ref->map.channel_count == 0) {
+		for (k = 0; k < count; ++k) {
+			nick_map_set_channel(&ref->map, k + 1, sites[k].enzyme, sites[k].rec_seq);
+		}
 	}
 
 	fp = file_open(filename);
@@ -159,11 +233,12 @@ int nick_map_load_seq(struct ref_map *ref, const char *filename,
 				ret = -ENOMEM;
 				goto out;
 			}
-			base_count = 0;
 			if (verbose > 0) {
 				fprintf(stderr, "Loading fragment '%s' ... ", name);
 			}
 		}
+		base_count = 0;
+		memset(scanner.bits, 0, sizeof(scanner.bits));
 
 		for (;;) {
 			int base;
@@ -177,28 +252,22 @@ int nick_map_load_seq(struct ref_map *ref, const char *filename,
 
 			base = char_to_base(c);
 			if (base) {
-				if (buf.pos >= sizeof(buf.data)) {
-					memcpy(buf.data, buf.data + sizeof(buf.data)
-							- site->rec_seq_size + 1,
-							site->rec_seq_size - 1);
-					buf.pos = site->rec_seq_size - 1;
-				}
 				++base_count;
-				buf.data[buf.pos++] = base;
-
-				if (buf.pos >= site->rec_seq_size) {
-					int strand, matched;
-					for (strand = 0, matched = 0; strand < 2; ++strand) {
-						if (matched || seq_match(buf.data + buf.pos - site->rec_seq_size,
-								site->rec_bases, site->rec_seq_size, strand)) {
-							int site_pos = base_count - (strand == 1 ? site->nick_offset
-									: (site->rec_seq_size - site->nick_offset));
-							if (nick_map_add_site(f, site_pos,
-									(strand == 0 ? NICK_PLUS_STRAND : NICK_MINUS_STRAND))) {
-								return -ENOMEM;
-							}
-							matched = site->palindrome;
-						}
+				if (!f) continue;
+
+				if (!scan_base(&scanner, base)) continue;
+
+				for (k = 0; k < count; ++k) {
+					site = &sites[k];
+					if ((test_bit(scanner.bits, scanner.last[k * 2])
+								&& nick_map_add_site(f,
+									base_count - (site->rec_seq_size - site->nick_offset),
+									NICK_PLUS_STRAND, k + 1))
+							|| (test_bit(scanner.bits, scanner.last[k * 2 + 1])
+								&& nick_map_add_site(f,
+									base_count - site->nick_offset, NICK_MINUS_STRAND, k + 1))) {
+						ret = -ENOMEM;
+						goto out;
 					}
 				}
 			} else {
@@ -220,9 +289,11 @@ int nick_map_load_seq(struct ref_map *ref, const char *filename,
 			newline = (c == '\n');
 		}
 
-		f->size = base_count;
-		if (f && verbose > 0) {
-			fprintf(stderr, "%d bp\n", base_count);
+		if (f) {
+			f->size = base_count;
+			if (verbose > 0) {
+				fprintf(stderr, "%d bp\n", base_count);
+			}
 		}
 	}
 out:
@@ -230,27 +301,44 @@ out:
 	return ret;
 }
 
-static int meet_last(const struct ref_index *p, int i)
+static int meet_last(const struct ref_map *ref, const struct ref_index *p, int i)
 {
+	const struct ref_node *n = ref_index_node(ref, p);
 	if (p->direct > 0) {
-		return (p->node[i].flag & LAST_INTERVAL) != 0;
+		return (n[i].flag & LAST_INTERVAL) != 0;
 	} else {
 		assert(p->direct < 0);
-		return (p->node[i].flag & FIRST_INTERVAL) != 0;
+		return (n[i].flag & FIRST_INTERVAL) != 0;
 	}
 }
 
+/* size of the t-th interval from index item, with merged ones as the first */
+static inline int interval_size(const struct ref_map *ref, const struct ref_index *p, int t)
+{
+	return (t == 0 ? ref_index_size(ref, p)
+			: ref_index_node(ref, p)[(t + p->span - 1) * p->direct].size);
+}
+
+static inline int interval_last(const struct ref_map *ref, const struct ref_index *p, int t)
+{
+	return meet_last(ref, p, (t + p->span - 1) * p->direct);
+}
+
+/* qsort() has no context argument for the nodes items refer to */
+static const struct ref_map *sorting_ref;
+
 static int sort_by_size(const void *a, const void *b)
 {
+	const struct ref_map *ref = sorting_ref;
 	const struct ref_index *pa = a;
 	const struct ref_index *pb = b;
-	int i, j;
-	for (i = 0, j = 0; ; i += pa->direct, j += pb->direct) {
-		if (pa->node[i].size < pb->node[j].size) return -1;
-		if (pa->node[i].size > pb->node[j].size) return 1;
-		if (meet_last(pa, i) && meet_last(pb, j)) return 0;
-		if (meet_last(pa, i)) return -1;
-		if (meet_last(pb, j)) return 1;
+	int t;
+	for (t = 0; ; ++t) {
+		if (interval_size(ref, pa, t) < interval_size(ref, pb, t)) return -1;
+		if (interval_size(ref, pa, t) > interval_size(ref, pb, t)) return 1;
+		if (interval_last(ref, pa, t) && interval_last(ref, pb, t)) return 0;
+		if (interval_last(ref, pa, t)) return -1;
+		if (interval_last(ref, pb, t)) return 1;
 	}
 	return 0;
 }
@@ -265,7 +353,7 @@ static void set_node(struct ref_node *node,
 	node->flag = flag;
 }
 
-static int ref_map_prepare_nodes(struct ref_map *ref)
+int ref_map_prepare_nodes(struct ref_map *ref)
 {
 	size_t count, i, j;
 
@@ -298,55 +386,79 @@ static int ref_map_prepare_nodes(struct ref_map *ref)
 	return 0;
 }
 
-int ref_map_build_index(struct ref_map *ref)
+static size_t count_chrom_items(const struct fragment *f, int flags)
 {
-	size_t count, i, j, k, m, n;
+	size_t count = 0, n = f->nicks.size;
+	if (n > 1) {
+		count += n - 1;
+		if ((flags & INDEX_MERGED) != 0) {
+			count += n - 2;
+		}
+	}
+	return ((flags & INDEX_FORWARD) != 0 ? count : count * 2);
+}
 
-	if (ref_map_prepare_nodes(ref)) {
-		return -ENOMEM;
+static size_t count_index_items(const struct ref_map *ref, int flags)
+{
+	size_t count, i;
+	for (count = 0, i = 0; i < ref->map.fragments.size; ++i) {
+		count += count_chrom_items(&ref->map.fragments.data[i], flags);
 	}
+	return count;
+}
 
-	assert(ref->index_.size == 0);
+static void set_index(struct ref_index *p, size_t node, int direct, int span)
+{
+	p->node = node;
+	p->direct = direct;
+	p->span = span;
+	p->uniq_count = 0;
+}
 
-	count = 0;
-	for (i = 0; i < ref->map.fragments.size; ++i) {
-		if (ref->map.fragments.data[i].nicks.size > 1) {
-			count += (ref->map.fragments.data[i].nicks.size - 1) * 2;
-		}
-	}
-	if (array_reserve(ref->index_, count)) {
-		return -ENOMEM;
-	}
+/* index items of a chrom, whose first node (before the first label) is 'm' */
+static void add_chrom_items(struct ref_map *ref, size_t chrom, size_t m, int flags)
+{
+	const struct fragment *f = &ref->map.fragments.data[chrom];
+	size_t j, n = ref->index_.size;
 
-	for (i = 0, m = 0, n = 0; i < ref->map.fragments.size; ++i) {
-		const struct fragment *f = &ref->map.fragments.data[i];
-		if (f->nicks.size <= 1) continue;
-		++m;
-		for (j = 0; j + 1 < f->nicks.size; ++j) {
-			for (k = 0; k < 2; ++k) {
-				ref->index_.data[n].node = &ref->nodes.data[m];
-				ref->index_.data[n].direct = (k == 0 ? 1 : -1);
-				ref->index_.data[n].uniq_count = 0;
-				++n;
+	assert(f->nicks.size > 1);
+	assert(ref->nodes.data[m].chrom == chrom && (ref->nodes.data[m].flag & FIRST_INTERVAL) != 0);
+	assert(n + count_chrom_items(f, flags) <= ref->index_.capacity);
+
+	++m;
+	for (j = 0; j + 1 < f->nicks.size; ++j) {
+		set_index(&ref->index_.data[n++], m, 1, 1);
+		if ((flags & INDEX_FORWARD) == 0) {
+			set_index(&ref->index_.data[n++], m, -1, 1);
+		}
+		if ((flags & INDEX_MERGED) != 0) {
+			if (j + 2 < f->nicks.size) {
+				set_index(&ref->index_.data[n++], m, 1, 2);
+			}
+			if (j > 0 && (flags & INDEX_FORWARD) == 0) {
+				set_index(&ref->index_.data[n++], m, -1, 2);
 			}
-			++m;
 		}
 		++m;
 	}
-	assert(n == count);
-	ref->index_.size = count;
+	ref->index_.size = n;
+}
 
+static void sort_index(struct ref_map *ref)
+{
+	size_t i;
+
+	sorting_ref = ref;
 	qsort(ref->index_.data, ref->index_.size, sizeof(struct ref_index), sort_by_size);
+	sorting_ref = NULL;
 
 	for (i = 0; i + 1 < ref->index_.size; ++i) {
 		struct ref_index *a = &ref->index_.data[i];
 		struct ref_index *b = &ref->index_.data[i + 1];
-		int x, y, z;
-		for (x = 0, y = 0, z = 0; ;
-				x += ref->index_.data[i].direct,
-				y += ref->index_.data[i + 1].direct, ++z) {
-			if (a->node[x].size != b->node[y].size) break;
-			if (meet_last(a, x) || meet_last(b, y)) {
+		int z;
+		for (z = 0; ; ++z) {
+			if (interval_size(ref, a, z) != interval_size(ref, b, z)) break;
+			if (interval_last(ref, a, z) || interval_last(ref, b, z)) {
 				++z;
 				break;
 			}
@@ -358,6 +470,33 @@ int ref_map_build_index(struct ref_map *ref)
 			b->uniq_count = z + 1;
 		}
 	}
+}
+
+int ref_map_build_index(struct ref_map *ref, int flags)
+{
+	size_t count, i, m;
+
+	if (ref_map_prepare_nodes(ref)) {
+		return -ENOMEM;
+	}
+
+	assert(ref->index_.size == 0);
+
+	count = count_index_items(ref, flags);
+	if (array_reserve(ref->index_, count)) {
+		return -ENOMEM;
+	}
+
+	for (i = 0, m = 0; i < ref->map.fragments.size; ++i) {
+		const struct fragment *f = &ref->map.fragments.data[i];
+		if (f->nicks.size <= 1) continue;
+		add_chrom_items(ref, i, m, flags);
+		m += f->nicks.size + 1;
+	}
+	assert(ref->index_.size == count);
+	ref->index_flags = flags;
+
+	sort_index(ref);
 	return 0;
 }
 
@@ -381,32 +520,63 @@ const char *get_index_filename(const char *filename, char *buf, size_t bufsize)
 	return buf;
 }
 
-int ref_map_save(const struct ref_map *ref, const char *filename)
+/* shard of index for one chrom, as '<NAME>.<CHROM>.idx.gz' */
+const char *get_shard_filename(const char *filename, const char *chrom,
+		char *buf, size_t bufsize)
+{
+	size_t len;
+
+	get_index_filename(filename, buf, bufsize);
+	if (strcmp(buf, "-") != 0) {
+		len = strlen(buf) - strlen(".idx.gz");
+		snprintf(buf + len, bufsize - len, ".%s.idx.gz", chrom);
+	}
+	return buf;
+}
+
+/*
+ * Items of all chroms, or only of 'chrom' for a shard, where node indices
+ * and chrom ids are counted from the chrom.
+ */
+static int save_items(const struct ref_map *ref, const char *filename, size_t chrom)
 {
 	gzFile file;
-	size_t i, j;
+	size_t i, j, node_base = 0, chrom_base = 0;
 
 	file = open_gzfile_write(filename);
 	if (!file) {
 		return -EINVAL;
 	}
 
-	gzprintf(file, "##fileformat=IDXv0.1\n");
+	gzprintf(file, "##fileformat=IDXv0.2\n");
 	gzprintf(file, "##program=bntools\n");
 	gzprintf(file, "##programversion="VERSION"\n");
-	gzprintf(file, "#index\tchrom\tlabel\tstrand\tname\tpos\tsize\tuniq\tseq\n");
+	if ((ref->index_flags & INDEX_MERGED) != 0) {
+		gzprintf(file, "##merged=yes\n");
+	}
+	if ((ref->index_flags & INDEX_FORWARD) != 0) {
+		gzprintf(file, "##forward=yes\n");
+	}
+	if (chrom != SIZE_MAX) {
+		gzprintf(file, "##shard=%s\n", ref->map.fragments.data[chrom].name);
+		for (node_base = 0; ref->nodes.data[node_base].chrom != chrom; ++node_base) { }
+		chrom_base = chrom;
+	}
+	gzprintf(file, "#index\tchrom\tlabel\tstrand\tspan\tname\tpos\tsize\tuniq\tseq\n");
 
 	for (i = 0; i < ref->index_.size; ++i) {
 		const struct ref_index *r = &ref->index_.data[i];
-		gzprintf(file, "%zd\t%zd\t%zd\t%s\t%s\t%d\t%d\t%d\t",
-				r->node - ref->nodes.data,
-				r->node->chrom + 1, r->node->label, (r->direct > 0 ? "+" : "-"),
-				ref->map.fragments.data[r->node->chrom].name,
-				r->node->pos, r->node->size, r->uniq_count);
+		const struct ref_node *n = ref_index_node(ref, r);
+		if (chrom != SIZE_MAX && n->chrom != chrom) continue;
+		gzprintf(file, "%zd\t%zd\t%zd\t%s\t%d\t%s\t%d\t%d\t%d\t",
+				r->node - node_base,
+				n->chrom - chrom_base + 1, n->label,
+				(r->direct > 0 ? "+" : "-"), r->span,
+				ref->map.fragments.data[n->chrom].name,
+				n->pos, ref_index_size(ref, r), r->uniq_count);
 		for (j = 0; j < r->uniq_count; ++j) {
-			const struct ref_node *n = &r->node[j * r->direct];
-			gzprintf(file, "%s%d", (j == 0 ? "": ","), n->size);
-			if (meet_last(r, j * r->direct)) break;
+			gzprintf(file, "%s%d", (j == 0 ? "": ","), interval_size(ref, r, j));
+			if (interval_last(ref, r, j)) break;
 		}
 		gzprintf(file, "\n");
 	}
@@ -414,147 +584,443 @@ int ref_map_save(const struct ref_map *ref, const char *filename)
 	return 0;
 }
 
-int ref_map_load(struct ref_map *ref, const char *filename)
+int ref_map_save(const struct ref_map *ref, const char *filename)
 {
-	struct file *file;
-	size_t count;
-	int value;
-	size_t index, chrom, label;
-	char directText[2];
-	int direct;
-	char name[64];
-	int pos, size, uniq;
-	size_t i, m;
-	const struct ref_node *node;
-
-	if (ref_map_prepare_nodes(ref)) {
-		return -ENOMEM;
-	}
+	return save_items(ref, filename, SIZE_MAX);
+}
 
-	assert(ref->index_.size == 0);
+int ref_map_save_shards(const struct ref_map *ref, const char *filename)
+{
+	char path[PATH_MAX];
+	size_t i;
 
-	count = 0;
 	for (i = 0; i < ref->map.fragments.size; ++i) {
-		if (ref->map.fragments.data[i].nicks.size > 1) {
-			count += (ref->map.fragments.data[i].nicks.size - 1) * 2;
+		if (ref->map.fragments.data[i].nicks.size <= 1) continue;
+		get_shard_filename(filename, ref->map.fragments.data[i].name, path, sizeof(path));
+		if (save_items(ref, path, i)) {
+			return -EINVAL;
 		}
 	}
-	if (array_reserve(ref->index_, count)) {
-		return -ENOMEM;
-	}
+	return 0;
+}
 
-	file = file_open(filename);
-	if (!file) {
-		return -EINVAL;
+static int read_index_header(struct file *fp, int *version, int *flags)
+{
+	char buf[256];
+
+	*version = 0;
+	*flags = 0;
+	while (current_char(fp) == '#') {
+		if (read_line(fp, buf, sizeof(buf))) {
+			break;
+		}
+		if (memcmp(buf, "##fileformat=IDXv0.", 19) == 0) {
+			*version = atoi(buf + 19);
+		} else if (memcmp(buf, "##merged=yes", 12) == 0) {
+			*flags |= INDEX_MERGED;
+		} else if (memcmp(buf, "##forward=yes", 13) == 0) {
+			*flags |= INDEX_FORWARD;
+		}
+		skip_to_next_line(fp, buf, sizeof(buf));
 	}
-	if (bn_skip_comment_lines(file)) {
-		file_close(file);
+	if (*version < 1 || *version > 2) {
+		fprintf(stderr, "Error: Unsupported format of index file '%s'\n", fp->name);
 		return -EINVAL;
 	}
+	return 0;
+}
+
+/*
+ * Read 'count' items appended to the index, with node indices and chrom
+ * ids in file counted from 'node_base' and 'chrom_base'.
+ */
+static int read_index_items(struct ref_map *ref, struct file *file, int version, int flags,
+		size_t node_base, size_t chrom_base, size_t count)
+{
+	int value;
+	size_t index, chrom, label;
+	char directText[2];
+	int direct, span;
+	char name[64];
+	int pos, size, uniq;
+	size_t m;
+	const struct ref_node *node;
+	struct ref_index *item;
+
+	assert(ref->index_.size + count <= ref->index_.capacity);
+
 	for (m = 0;;) {
 		if (read_integer(file, &value)) {
 			break;
 		}
-		if (value < 0) {
+		if (value < 0 || node_base + value >= ref->nodes.size || (ref->nodes.data[node_base + value].flag
+					& (FIRST_INTERVAL | LAST_INTERVAL)) != 0) {
 			file_error(file, "Invalid value in 'index' column");
-			file_close(file);
 			return -EINVAL;
 		}
-		index = value;
+		if (m >= count) {
+			file_error(file, "Too many index items");
+			return -EINVAL;
+		}
+		index = node_base + value;
 		node = ref->nodes.data + index;
 
 		if (read_integer(file, &value)) {
 			file_error(file, "Failed to read 'chrom' column");
-			file_close(file);
 			return -EINVAL;
 		}
 		if (value <= 0) {
 			file_error(file, "Invalid value in 'chrom' column");
-			file_close(file);
 			return -EINVAL;
 		}
-		chrom = value - 1;
+		chrom = chrom_base + value - 1;
 		if (node->chrom != chrom) {
 			file_error(file, "Column 'chrom' does not match");
-			file_close(file);
 			return -EINVAL;
 		}
 
 		if (read_integer(file, &value)) {
 			file_error(file, "Failed to read 'label' column");
-			file_close(file);
 			return -EINVAL;
 		}
 		label = value;
 		if (node->label != label) {
 			file_error(file, "Column 'label' does not match");
-			file_close(file);
 			return -EINVAL;
 		}
 
 		if (read_string(file, directText, sizeof(directText))) {
 			file_error(file, "Failed to read 'strand' column");
-			file_close(file);
 			return -EINVAL;
 		}
 		if (strcmp(directText, "+") == 0) {
 			direct = 1;
-		} else if (strcmp(directText, "-") == 0) {
+		} else if (strcmp(directText, "-") == 0 && (flags & INDEX_FORWARD) == 0) {
 			direct = -1;
 		} else {
 			file_error(file, "Invalid value '%s' in 'strand' column", directText);
-			file_close(file);
 			return -EINVAL;
 		}
 
+		span = 1;
+		if (version >= 2) {
+			if (read_integer(file, &span)) {
+				file_error(file, "Failed to read 'span' column");
+				return -EINVAL;
+			}
+			if (span < 1 || span > 2 || (span > 1 && (flags & INDEX_MERGED) == 0)
+					|| (span > 1 && (node[direct].flag & (FIRST_INTERVAL | LAST_INTERVAL)) != 0)) {
+				file_error(file, "Invalid value in 'span' column");
+				return -EINVAL;
+			}
+		}
+
 		if (read_string(file, name, sizeof(name))) {
 			file_error(file, "Failed to read 'name' column");
-			file_close(file);
 			return -EINVAL;
 		}
 		if (strcmp(ref->map.fragments.data[chrom].name, name) != 0) {
 			file_error(file, "Column 'name' does not match");
-			file_close(file);
 			return -EINVAL;
 		}
 
 		if (read_integer(file, &pos)) {
 			file_error(file, "Failed to read 'pos' column");
-			file_close(file);
 			return -EINVAL;
 		}
 		if (node->pos != pos) {
 			file_error(file, "Column 'pos' does not match");
-			file_close(file);
 			return -EINVAL;
 		}
 
 		if (read_integer(file, &size)) {
 			file_error(file, "Failed to read 'size' column");
-			file_close(file);
 			return -EINVAL;
 		}
-		if (node->size != size) {
+		item = &ref->index_.data[ref->index_.size + m];
+		set_index(item, index, direct, span);
+		if (ref_index_size(ref, item) != size) {
 			file_error(file, "Column 'size' does not match");
-			file_close(file);
 			return -EINVAL;
 		}
 
 		if (read_integer(file, &uniq)) {
 			file_error(file, "Failed to read 'uniq' column");
-			file_close(file);
 			return -EINVAL;
 		}
-		ref->index_.data[m].node = ref->nodes.data + index;
-		ref->index_.data[m].direct = direct;
-		ref->index_.data[m].uniq_count = uniq;
+		item->uniq_count = uniq;
 		++m;
 
 		skip_current_line(file);
 	}
-	assert(m == count);
-	ref->index_.size = count;
+	if (m != count) {
+		fprintf(stderr, "Error: Index file '%s' is incomplete\n", file->name);
+		return -EINVAL;
+	}
+	ref->index_.size += count;
+	return 0;
+}
+
+int ref_map_load(struct ref_map *ref, const char *filename)
+{
+	struct file *file;
+	size_t count;
+	int version, flags, ret;
+
+	if (ref_map_prepare_nodes(ref)) {
+		return -ENOMEM;
+	}
+
+	assert(ref->index_.size == 0);
+
+	file = file_open(filename);
+	if (!file) {
+		return -EINVAL;
+	}
+	if (read_index_header(file, &version, &flags)) {
+		file_close(file);
+		return -EINVAL;
+	}
 
+	count = count_index_items(ref, flags);
+	if (array_reserve(ref->index_, count)) {
+		file_close(file);
+		return -ENOMEM;
+	}
+
+	ret = read_index_items(ref, file, version, flags, 0, 0, count);
+	if (ret == 0) {
+		ref->index_flags = flags;
+	}
 	file_close(file);
+	return ret;
+}
+
+/*
+ * Index of chroms in 'ref' (maybe only some of the genome), from their
+ * shards if existed, or built with 'flags' otherwise. As uniqueness of
+ * items depends on all chroms, items are sorted again after loaded.
+ */
+int ref_map_load_shards(struct ref_map *ref, const char *filename, int flags,
+		size_t *loaded_count)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	struct file *file;
+	size_t i, m, next;
+	int version, shard_flags, ret;
+
+	if (ref_map_prepare_nodes(ref)) {
+		return -ENOMEM;
+	}
+
+	assert(ref->index_.size == 0);
+
+	*loaded_count = 0;
+	ref->index_flags = flags;
+	for (i = 0, next = 0; i < ref->map.fragments.size; ++i) {
+		const struct fragment *f = &ref->map.fragments.data[i];
+		if (f->nicks.size <= 1) continue;
+		m = next;
+		next += f->nicks.size + 1;
+
+		get_shard_filename(filename, f->name, path, sizeof(path));
+		if (strcmp(path, "-") == 0 || stat(path, &sb) != 0) {
+			if (array_reserve(ref->index_, ref->index_.size + count_chrom_items(f, flags))) {
+				return -ENOMEM;
+			}
+			add_chrom_items(ref, i, m, flags);
+			continue;
+		}
+
+		file = file_open(path);
+		if (!file) {
+			return -EINVAL;
+		}
+		if (read_index_header(file, &version, &shard_flags)) {
+			file_close(file);
+			return -EINVAL;
+		}
+		if (shard_flags != flags) {
+			fprintf(stderr, "Error: Shard '%s' is indexed with other options\n", path);
+			file_close(file);
+			return -EINVAL;
+		}
+		if (array_reserve(ref->index_, ref->index_.size + count_chrom_items(f, flags))) {
+			file_close(file);
+			return -ENOMEM;
+		}
+		ret = read_index_items(ref, file, version, flags, m, i, count_chrom_items(f, flags));
+		file_close(file);
+		if (ret) {
+			return ret;
+		}
+		++*loaded_count;
+	}
+
+	for (i = 0; i < ref->index_.size; ++i) {
+		ref->index_.data[i].uniq_count = 0;
+	}
+	sort_index(ref);
+	return 0;
+}
+
+/*
+ * Reference published in shared memory is a header followed by chroms,
+ * nodes and index items. Index items refer to nodes by ordinal, so the
+ * segment has no pointers and could be mapped at any address.
+ */
+#define SHARED_MAGIC "BNREFSHM"
+#define SHARED_VERSION 1
+#define SHARED_ALIGN 64
+
+struct shared_chrom {
+	char name[MAX_FRAGMENT_NAME_SIZE + 1];
+	int size;
+};
+
+struct shared_header {
+	char magic[8];
+	uint32_t version;
+	int32_t index_flags;
+	uint32_t node_size;  /* of struct, to reject other builds */
+	uint32_t index_size;
+	uint64_t chrom_count;
+	uint64_t node_count;
+	uint64_t index_count;
+	uint64_t chrom_offset;
+	uint64_t node_offset;
+	uint64_t index_offset;
+	uint64_t total_size;
+};
+
+static inline uint64_t shared_align(uint64_t offset)
+{
+	return (offset + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+}
+
+int ref_map_publish(const struct ref_map *ref, const char *name)
+{
+	struct shared_header h;
+	struct shared_chrom *chroms;
+	char *base;
+	size_t i;
+	int fd;
+
+	memset(&h, 0, sizeof(h));
+	h.version = SHARED_VERSION;
+	h.index_flags = ref->index_flags;
+	h.node_size = sizeof(struct ref_node);
+	h.index_size = sizeof(struct ref_index);
+	h.chrom_count = ref->map.fragments.size;
+	h.node_count = ref->nodes.size;
+	h.index_count = ref->index_.size;
+	h.chrom_offset = shared_align(sizeof(h));
+	h.node_offset = shared_align(h.chrom_offset + sizeof(struct shared_chrom) * h.chrom_count);
+	h.index_offset = shared_align(h.node_offset + sizeof(struct ref_node) * h.node_count);
+	h.total_size = h.index_offset + sizeof(struct ref_index) * h.index_count;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error: Failed to create shared memory '%s': %s\n",
+				name, strerror(errno));
+		return -EIO;
+	}
+	if (ftruncate(fd, h.total_size) == -1
+			|| (base = mmap(NULL, h.total_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to allocate shared memory '%s': %s\n",
+				name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -ENOMEM;
+	}
+	close(fd);
+
+	chroms = (struct shared_chrom *)(base + h.chrom_offset);
+	for (i = 0; i < h.chrom_count; ++i) {
+		snprintf(chroms[i].name, sizeof(chroms[i].name), "%s",
+				ref->map.fragments.data[i].name);
+		chroms[i].size = ref->map.fragments.data[i].size;
+	}
+	memcpy(base + h.node_offset, ref->nodes.data, sizeof(struct ref_node) * h.node_count);
+	memcpy(base + h.index_offset, ref->index_.data, sizeof(struct ref_index) * h.index_count);
+
+	/* magic is written at last, so a partial segment is never attached */
+	memcpy(base, &h, sizeof(h));
+	memcpy(base, SHARED_MAGIC, sizeof(h.magic));
+	munmap(base, h.total_size);
+	return 0;
+}
+
+/*
+ * Nodes and index are mapped read-only, and chroms are loaded with names
+ * and sizes, but no labels.
+ */
+int ref_map_attach(struct ref_map *ref, const char *name)
+{
+	struct shared_header h;
+	const struct shared_chrom *chroms;
+	struct stat sb;
+	char *base;
+	size_t i;
+	int fd;
+
+	assert(ref->map.fragments.size == 0 && ref->nodes.size == 0 && ref->index_.size == 0);
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Error: Failed to open shared memory '%s': %s\n",
+				name, strerror(errno));
+		return -EIO;
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(h)
+			|| (base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to map shared memory '%s'\n", name);
+		close(fd);
+		return -EIO;
+	}
+	close(fd);
+
+	memcpy(&h, base, sizeof(h));
+	if (memcmp(h.magic, SHARED_MAGIC, sizeof(h.magic)) != 0 || h.version != SHARED_VERSION
+			|| h.node_size != sizeof(struct ref_node) || h.index_size != sizeof(struct ref_index)
+			|| h.total_size > sb.st_size) {
+		fprintf(stderr, "Error: Shared memory '%s' is not a reference published "
+				"by this version\n", name);
+		munmap(base, sb.st_size);
+		return -EINVAL;
+	}
+	ref->shared = base;
+	ref->shared_size = sb.st_size;
+#ifdef MADV_HUGEPAGE
+	madvise(base, sb.st_size, MADV_HUGEPAGE);
+#endif
+
+	if (array_reserve(ref->map.fragments, h.chrom_count)) {
+		return -ENOMEM;
+	}
+	chroms = (const struct shared_chrom *)(base + h.chrom_offset);
+	for (i = 0; i < h.chrom_count; ++i) {
+		struct fragment *f = &ref->map.fragments.data[ref->map.fragments.size++];
+		memset(f, 0, sizeof(struct fragment));
+		snprintf(f->name, sizeof(f->name), "%s", chroms[i].name);
+		f->size = chroms[i].size;
+	}
+	ref->nodes.data = (struct ref_node *)(base + h.node_offset);
+	ref->nodes.size = h.node_count;
+	ref->index_.data = (struct ref_index *)(base + h.index_offset);
+	ref->index_.size = h.index_count;
+	ref->index_flags = h.index_flags;
+	return 0;
+}
+
+int ref_map_unpublish(const char *name)
+{
+	if (shm_unlink(name) == -1) {
+		fprintf(stderr, "Error: Failed to remove shared memory '%s': %s\n",
+				name, strerror(errno));
+		return -EIO;
+	}
 	return 0;
 }
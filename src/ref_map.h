@@ -2,6 +2,7 @@
 #define __REF_MAP_H__
 
 #include <string.h>
+#include <stdint.h>
 #include "nick_map.h"
 #include "array.h"
 
@@ -19,21 +20,33 @@ struct ref_node {
 };
 
 struct ref_index {
-	const struct ref_node *node;
+	size_t node;  /* index of node in ref */
 	int direct;
+	int span;  /* number of intervals merged as the first one */
 	int uniq_count;
 };
 
+enum index_flag {
+	INDEX_MERGED  = 1,  /* also index two adjacent intervals merged as one */
+	INDEX_FORWARD = 2,  /* index only forward items, to search both strands */
+};
+
 struct ref_map {
 	struct nick_map map;
 
 	array(struct ref_node) nodes;
 	array(struct ref_index) index_;
+	int index_flags;
+
+	void *shared;  /* mapping of nodes and index, if attached */
+	size_t shared_size;
 };
 
 void ref_map_init(struct ref_map *ref);
 void ref_map_free(struct ref_map *ref);
 
+#define REC_SEQ_WORDS ((MAX_REC_SEQ_SIZE + 63) / 64)
+
 struct rec_site {
 	char enzyme[MAX_ENZYME_NAME_SIZE + 1];
 	char rec_seq[MAX_REC_SEQ_SIZE + 1];
@@ -41,17 +54,49 @@ struct rec_site {
 	int rec_seq_size;
 	int nick_offset;
 	int palindrome;
+
+	/*
+	 * Masks of each base code, for Shift-And scan of both strands, with
+	 * bit i set if the base matches the i-th base of recognition sequence,
+	 * or of its reverse complement.
+	 */
+	uint64_t masks[2][16][REC_SEQ_WORDS];
 };
 
 int prepare_rec_site(struct rec_site *site, const char *enzyme, const char *rec_seq);
 
 int nick_map_load_seq(struct ref_map *ref, const char *filename,
-		const struct rec_site *site, int chrom_only, int verbose);
+		const struct rec_site *sites, int count, int chrom_only, int verbose);
 
-int ref_map_build_index(struct ref_map *ref);
+static inline const struct ref_node *ref_index_node(const struct ref_map *ref,
+		const struct ref_index *p)
+{
+	return &ref->nodes.data[p->node];
+}
+
+static inline int ref_index_size(const struct ref_map *ref, const struct ref_index *p)
+{
+	const struct ref_node *n = ref_index_node(ref, p);
+	return (p->span > 1 ? n[0].size + n[p->direct].size : n[0].size);
+}
+
+int ref_map_prepare_nodes(struct ref_map *ref);
+int ref_map_build_index(struct ref_map *ref, int flags);
 int ref_map_save(const struct ref_map *ref, const char *filename);
 int ref_map_load(struct ref_map *ref, const char *filename);
 
+int ref_map_save_shards(const struct ref_map *ref, const char *filename);
+int ref_map_load_shards(struct ref_map *ref, const char *filename, int flags,
+		size_t *loaded_count);
+
+#define SHARED_PREFIX "shm:"  /* of reference name, to attach published one */
+
+int ref_map_publish(const struct ref_map *ref, const char *name);
+int ref_map_attach(struct ref_map *ref, const char *name);
+int ref_map_unpublish(const char *name);
+
 const char *get_index_filename(const char *filename, char *buf, size_t bufsize);
+const char *get_shard_filename(const char *filename, const char *chrom,
+		char *buf, size_t bufsize);
 
 #endif /* __REF_MAP_H__ */
@@ -0,0 +1,3 @@
+#ifndef VERSION
+#define VERSION "0.1.0-c4502c5"
+#endif
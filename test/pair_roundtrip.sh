@@ -0,0 +1,37 @@
+#!/bin/sh
+# Alignments written as txt, and as bin decoded by 'align -D', should be the
+# same, with perfect ones (of long runs of the same step) included.
+
+BNTOOLS=${BNTOOLS:-./bntools}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# identical maps, and one with labels missing, for runs of (1,1) and (1,2) steps
+awk 'BEGIN {
+	printf "##fileformat=MAPv0.1\n#name\tlabel\tpos\tstrand\tsize\n";
+	n = split("m1 m2 m3", names, " ");
+	for (m = 1; m <= n; ++m) {
+		k = 0;
+		pos = 0;
+		for (i = 0; i < 40; ++i) {
+			pos += 1000 + (i * 7919) % 3001;
+			if (m == 3 && i % 2 == 1) continue;
+			printf "%s\t%d\t%d\t+\t0\n", names[m], k++, pos;
+		}
+		printf "%s\t%d\t%d\t*\t500\n", names[m], k, pos + 500;
+	}
+}' > "$DIR/maps.tsv"
+
+$BNTOOLS align -o "$DIR/out.txt" "$DIR/maps.tsv" || exit 1
+$BNTOOLS align -f bin -o "$DIR/out.bin" "$DIR/maps.tsv" || exit 1
+$BNTOOLS align -D "$DIR/out.bin" > "$DIR/decoded.txt" || exit 1
+
+if ! grep -q "^39	38	37" "$DIR/out.txt"; then
+	echo "FAIL: no perfect alignment found" >&2
+	exit 1
+fi
+if ! cmp -s "$DIR/out.txt" "$DIR/decoded.txt"; then
+	echo "FAIL: decoded alignments differ" >&2
+	exit 1
+fi
+echo "ok"